@@ -0,0 +1,384 @@
+/*
+ * git-fs-top: live view of the statistics of a git-fs mount
+ *
+ * Reads the /.git-fs-stats file of a mount made with -o stats every few
+ * seconds and shows what changed in between, like top does.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+/* Must match GITFS_FUSE_MAX_OPCODE and GITFS_LATENCY_BUCKETS in
+ * git-fs.c */
+#define MAX_OPCODE 63
+#define LATENCY_BUCKETS 32
+
+typedef unsigned long long u64;
+
+struct proc {
+	int pid;
+	char comm[32];
+	u64 ops, bytes_read, bytes_inflated, time_ms, max_ms;
+	char cgroup[256];
+};
+
+struct path {
+	u64 opens;
+	char *path;
+};
+
+/* A single read of the statistics file, see gitfs_stats_format */
+struct snapshot {
+	double uptime;
+	unsigned inflight;
+	u64 hot_blobs, hot_bytes, cold_blobs, cold_bytes;
+	u64 hits, cold_hits, misses, uncached;
+	u64 ops[MAX_OPCODE + 1];
+	char op_names[MAX_OPCODE + 1][32];
+	u64 latency[LATENCY_BUCKETS];
+	struct path *paths;
+	size_t path_count;
+	struct proc *procs;
+	size_t proc_count;
+};
+
+static void snapshot_free(struct snapshot *s) {
+	size_t i;
+
+	for (i = 0; i < s->path_count; i++)
+		free(s->paths[i].path);
+	free(s->paths);
+	free(s->procs);
+	memset(s, 0, sizeof(*s));
+}
+
+/* Append an element to the array at *arr (of *count elements of the
+ * given size), returning the new element or NULL */
+static void *append(void *arr, size_t *count, size_t size) {
+	char **p = arr;
+	char *grown = realloc(*p, (*count + 1) * size);
+
+	if (!grown)
+		return NULL;
+	*p = grown;
+	memset(grown + *count * size, 0, size);
+	return grown + (*count)++ * size;
+}
+
+/* Read the statistics file at path into s */
+static int snapshot_read(struct snapshot *s, const char *path) {
+	char *line = NULL;
+	size_t n = 0;
+	struct proc *p;
+	struct path *pa;
+	unsigned opcode, bucket;
+	int pos;
+	u64 count;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+	if (!(f = fopen(path, "re"))) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		if (errno == ENOENT)
+			fprintf(stderr, "Was the mount made with -o stats?\n");
+		return -1;
+	}
+
+	while (getline(&line, &n, f) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		char name[32];
+
+		if (sscanf(line, "uptime %lf", &s->uptime) == 1 ||
+		    sscanf(line, "inflight %u", &s->inflight) == 1)
+			continue;
+
+		if (!strncmp(line, "cache ", 6)) {
+			sscanf(line, "cache %llu %llu %llu %llu %llu %llu %llu %llu",
+			       &s->hot_blobs, &s->hot_bytes, &s->cold_blobs, &s->cold_bytes,
+			       &s->hits, &s->cold_hits, &s->misses, &s->uncached);
+		} else if (sscanf(line, "op %u %31s %llu", &opcode, name, &count) == 3) {
+			if (opcode <= MAX_OPCODE) {
+				s->ops[opcode] = count;
+				strcpy(s->op_names[opcode], name);
+			}
+		} else if (sscanf(line, "latency %u %llu", &bucket, &count) == 2) {
+			if (bucket < LATENCY_BUCKETS)
+				s->latency[bucket] = count;
+		} else if (sscanf(line, "path %llu %n", &count, &pos) == 1) {
+			if ((pa = append(&s->paths, &s->path_count, sizeof(*pa)))) {
+				pa->opens = count;
+				pa->path = strdup(line + pos);
+			}
+		} else if (!strncmp(line, "proc ", 5)) {
+			if ((p = append(&s->procs, &s->proc_count, sizeof(*p)))) {
+				sscanf(line, "proc %d %31s %llu %llu %llu %llu %llu %255s",
+				       &p->pid, p->comm, &p->ops, &p->bytes_read, &p->bytes_inflated,
+				       &p->time_ms, &p->max_ms, p->cgroup);
+			}
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+/* Format a number of bytes in a human readable way */
+static const char *human(double bytes, char *buf, size_t size) {
+	const char *units = "BKMGT";
+
+	while (bytes >= 1024 && units[1]) {
+		bytes /= 1024;
+		units++;
+	}
+	snprintf(buf, size, "%.1f%c", bytes, *units);
+	return buf;
+}
+
+/* Returns the upper bound (in microseconds) of the latency below which
+ * the given fraction of requests in the histogram fall */
+static u64 percentile(const u64 *latency, double fraction) {
+	u64 total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		total += latency[i];
+	if (!total)
+		return 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += latency[i];
+		if (seen >= fraction * total)
+			break;
+	}
+	return 1ULL << i;
+}
+
+static const char *human_us(u64 us, char *buf, size_t size) {
+	if (us < 1000)
+		snprintf(buf, size, "%lluus", us);
+	else if (us < 1000000)
+		snprintf(buf, size, "%llums", us / 1000);
+	else
+		snprintf(buf, size, "%.1fs", us / 1e6);
+	return buf;
+}
+
+static const struct proc *find_proc(const struct snapshot *s, int pid) {
+	size_t i;
+
+	for (i = 0; i < s->proc_count; i++) {
+		if (s->procs[i].pid == pid)
+			return &s->procs[i];
+	}
+	return NULL;
+}
+
+static const struct path *find_path(const struct snapshot *s, const char *path) {
+	size_t i;
+
+	for (i = 0; i < s->path_count; i++) {
+		if (!strcmp(s->paths[i].path, path))
+			return &s->paths[i];
+	}
+	return NULL;
+}
+
+/* A process or path with its activity since the previous snapshot */
+struct delta {
+	const void *item;
+	u64 value;
+};
+
+static int delta_cmp(const void *a, const void *b) {
+	const struct delta *x = a, *y = b;
+	return x->value < y->value ? 1 : x->value > y->value ? -1 : 0;
+}
+
+/* Show the changes between prev and cur, using at most rows lines
+ * (or any number when 0) */
+static void render(const struct snapshot *prev, const struct snapshot *cur,
+		   const char *mountpoint, int rows, bool batch) {
+	double elapsed = cur->uptime - prev->uptime;
+	u64 latency[LATENCY_BUCKETS], total = 0, lookups;
+	struct delta *deltas;
+	char b1[32], b2[32];
+	size_t i, count;
+	int lines = 0;
+
+	/* Show totals (since mounting) when git-fs was restarted in the
+	 * meanwhile */
+	if (elapsed <= 0) {
+		static const struct snapshot empty;
+		prev = &empty;
+		elapsed = cur->uptime > 0 ? cur->uptime : 1;
+	}
+
+	if (!batch)
+		printf("\033[H\033[2J");
+	printf("git-fs-top - %s, up %.0fs, %u requests in flight\n", mountpoint, cur->uptime, cur->inflight);
+	lines++;
+
+	printf("\nrequests/s:");
+	for (i = 0; i <= MAX_OPCODE; i++) {
+		if (cur->ops[i] > prev->ops[i]) {
+			printf(" %s %.1f", cur->op_names[i], (cur->ops[i] - prev->ops[i]) / elapsed);
+			total += cur->ops[i] - prev->ops[i];
+		}
+	}
+	printf("%s (total %.1f)\n", total ? "" : " none", total / elapsed);
+	lines += 2;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		latency[i] = cur->latency[i] - prev->latency[i];
+	printf("latency: p50 < %s, p99 < %s\n",
+	       human_us(percentile(latency, 0.5), b1, sizeof(b1)),
+	       human_us(percentile(latency, 0.99), b2, sizeof(b2)));
+	lines++;
+
+	lookups = (cur->hits - prev->hits) + (cur->cold_hits - prev->cold_hits) + (cur->misses - prev->misses);
+	if (lookups) {
+		printf("blob cache: %.1f%% hot hits, %.1f%% cold hits, %.1f%% misses (%.1f%% not admitted)\n",
+		       100.0 * (cur->hits - prev->hits) / lookups,
+		       100.0 * (cur->cold_hits - prev->cold_hits) / lookups,
+		       100.0 * (cur->misses - prev->misses) / lookups,
+		       100.0 * (cur->uncached - prev->uncached) / lookups);
+	} else {
+		printf("blob cache: idle\n");
+	}
+	printf("memory: hot %s in %llu blobs, cold %s in %llu blobs\n",
+	       human(cur->hot_bytes, b1, sizeof(b1)), cur->hot_blobs,
+	       human(cur->cold_bytes, b2, sizeof(b2)), cur->cold_blobs);
+	lines += 2;
+
+	/* Split the remaining rows between paths and processes */
+	size_t room = 10;
+	if (rows > 0)
+		room = rows - lines - 6 > 0 ? (rows - lines - 6) / 2 : 0;
+	if (room < 3)
+		room = 3;
+
+	count = cur->path_count > cur->proc_count ? cur->path_count : cur->proc_count;
+	if (!(deltas = calloc(count ? count : 1, sizeof(*deltas))))
+		return;
+
+	for (i = 0; i < cur->path_count; i++) {
+		const struct path *old = find_path(prev, cur->paths[i].path);
+		deltas[i].item = &cur->paths[i];
+		deltas[i].value = cur->paths[i].opens - (old && old->opens <= cur->paths[i].opens ? old->opens : 0);
+	}
+	qsort(deltas, cur->path_count, sizeof(*deltas), delta_cmp);
+	printf("\n%9s  %s\n", "OPENS/S", "PATH");
+	for (i = 0; i < cur->path_count && i < room && deltas[i].value; i++)
+		printf("%9.1f  %s\n", deltas[i].value / elapsed, ((const struct path *)deltas[i].item)->path);
+
+	for (i = 0; i < cur->proc_count; i++) {
+		const struct proc *old = find_proc(prev, cur->procs[i].pid);
+		deltas[i].item = &cur->procs[i];
+		deltas[i].value = cur->procs[i].ops - (old && old->ops <= cur->procs[i].ops ? old->ops : 0);
+	}
+	qsort(deltas, cur->proc_count, sizeof(*deltas), delta_cmp);
+	printf("\n%7s %-16s %9s %9s %11s %7s  %s\n", "PID", "COMMAND", "REQ/S", "READ/S", "INFLATED/S", "BUSY%", "CGROUP");
+	for (i = 0; i < cur->proc_count && i < room && deltas[i].value; i++) {
+		const struct proc *p = deltas[i].item, *old = find_proc(prev, p->pid);
+		struct proc zero = { 0 };
+		if (!old || old->ops > p->ops)
+			old = &zero;
+		printf("%7d %-16s %9.1f %8s/s %9s/s %6.1f%%  %s\n", p->pid, p->comm,
+		       (p->ops - old->ops) / elapsed,
+		       human((p->bytes_read - old->bytes_read) / elapsed, b1, sizeof(b1)),
+		       human((p->bytes_inflated - old->bytes_inflated) / elapsed, b2, sizeof(b2)),
+		       (p->time_ms - old->time_ms) / (elapsed * 10), p->cgroup);
+	}
+	free(deltas);
+	fflush(stdout);
+}
+
+static void usage(const char *argv0, FILE *out) {
+	fprintf(out,
+		"usage: %s [options] mountpoint\n"
+		"\n"
+		"Show the activity of a git-fs mount made with -o stats.\n"
+		"\n"
+		"options:\n"
+		"    -d SECONDS\n"
+		"        Time between updates (default 2).\n"
+		"    -n COUNT\n"
+		"        Exit after COUNT updates.\n"
+		"    -b\n"
+		"        Batch mode: don't clear the screen between\n"
+		"        updates, e.g. to log to a file.\n"
+		"    -h\n"
+		"        Print help.\n",
+		argv0);
+}
+
+int main(int argc, char *argv[]) {
+	struct snapshot prev, cur;
+	double delay = 2;
+	long iterations = -1;
+	bool batch = false;
+	char path[4096];
+	struct winsize ws;
+	struct timespec interval, left;
+	int opt, rows;
+
+	while ((opt = getopt(argc, argv, "d:n:bh")) != -1) {
+		switch (opt) {
+			case 'd':
+				delay = atof(optarg);
+				if (delay <= 0)
+					return fprintf(stderr, "Invalid delay: %s\n", optarg), 1;
+				break;
+			case 'n':
+				iterations = atol(optarg);
+				break;
+			case 'b':
+				batch = true;
+				break;
+			case 'h':
+				usage(argv[0], stdout);
+				return 0;
+			default:
+				usage(argv[0], stderr);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+	/* usleep() doesn't need to support a second or more */
+	interval.tv_sec = delay;
+	interval.tv_nsec = (delay - interval.tv_sec) * 1000000000;
+	snprintf(path, sizeof(path), "%s/.git-fs-stats", argv[optind]);
+
+	if (snapshot_read(&prev, path) < 0)
+		return 1;
+
+	while (1) {
+		rows = !batch && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 ? ws.ws_row : 0;
+		if (iterations == 0)
+			break;
+
+		left = interval;
+		while (nanosleep(&left, &left) < 0 && errno == EINTR)
+			;
+		if (snapshot_read(&cur, path) < 0)
+			return 1;
+		render(&prev, &cur, argv[optind], rows, batch);
+		snapshot_free(&prev);
+		prev = cur;
+
+		if (iterations > 0)
+			iterations--;
+	}
+	snapshot_free(&prev);
+	return 0;
+}
@@ -2,19 +2,43 @@
  * fuse + libgit2 = read-only mounting of bare repos
  */
 
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 26
 #define _FILE_OFFSET_BITS 64
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <git2.h>
+#include <lz4.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <git2/sys/odb_backend.h>
+#include <zlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <signal.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/capability.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fnmatch.h>
 
 /* http://pubs.opengroup.org/onlinepubs/009695399/basedefs/limits.h.html
  */
@@ -22,6 +46,60 @@
 	#include <linux/limits.h>
 #endif
 
+/* ioctl to clone a /dev/fuse fd (from linux/fuse.h, which we can't
+ * include since it conflicts with the libfuse headers). */
+#ifndef FUSE_DEV_IOC_CLONE
+	#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+/* The parts of the kernel protocol (see linux/fuse.h) needed to
+ * recognize lookup requests and their replies, and the node ids in
+ * requests */
+#define GITFS_FUSE_LOOKUP 1
+#define GITFS_FUSE_FORGET 2
+#define GITFS_FUSE_READ 15
+#define GITFS_FUSE_BATCH_FORGET 42
+
+struct gitfs_fuse_in_header {
+	uint32_t len;
+	uint32_t opcode;
+	uint64_t unique;
+	uint64_t nodeid;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t pid;
+	uint32_t padding;
+};
+
+struct gitfs_fuse_out_header {
+	uint32_t len;
+	int32_t error;
+	uint64_t unique;
+};
+
+/* The start of struct fuse_entry_out (up to the inode number) */
+struct gitfs_fuse_entry_out {
+	uint64_t nodeid;
+	uint64_t generation;
+	uint64_t entry_valid;
+	uint64_t attr_valid;
+	uint32_t entry_valid_nsec;
+	uint32_t attr_valid_nsec;
+	uint64_t ino;
+};
+
+/* Body of batch forget requests, followed by count struct
+ * gitfs_fuse_forget_one */
+struct gitfs_fuse_batch_forget_in {
+	uint32_t count;
+	uint32_t dummy;
+};
+
+struct gitfs_fuse_forget_one {
+	uint64_t nodeid;
+	uint64_t nlookup;
+};
+
 /* Macro to get the length of a static array */
 #define lengthof(arr) (sizeof(arr) / sizeof(*arr))
 
@@ -54,38 +132,234 @@ typedef enum {
 	GITFS_DIR,
 	/* A special (virtual) file that contains an object id (hash). */
 	GITFS_OID,
+	/* A special (virtual) file with the statistics at the time it
+	 * was opened, see gitfs_stats_format */
+	GITFS_STATS,
+	/* A (virtual) directory with the results of a search, see
+	 * gitfs_lookup_search_entry */
+	GITFS_SEARCH,
+	/* A special (virtual) file with the result of a path query at
+	 * the time it was opened, see gitfs_lookup_find_entry */
+	GITFS_FIND,
+	/* A special (virtual) file with the digests of all files, see
+	 * gitfs_manifest_format */
+	GITFS_MANIFEST,
 } gitfs_entry_type;
 
+/* The state of a blob that is inflated in the background while it is
+ * being read, see gitfs_stream_main */
+struct gitfs_stream {
+	pthread_mutex_t lock;
+	/* Signalled when more of the blob is inflated, when target
+	 * grows and when the blob is no longer used by any file */
+	pthread_cond_t cond;
+	/* The pack to inflate from (a duplicate fd, so it stays
+	 * readable after a repack) and where its data continues */
+	int fd;
+	uint64_t start, offset;
+	/* The number of bytes inflated so far, and the number to
+	 * inflate before waiting for readers again */
+	size_t available, target;
+	/* How far to inflate ahead of sequential readers, see
+	 * gitfs_stream_read */
+	size_t window;
+	/* The process that opened the blob, for statistics */
+	pid_t pid;
+	/* Set (negative) when inflating failed */
+	int error;
+	bool unused;
+};
+
+/* The contents of a blob, shared by all open files (in all mounts)
+ * with the same contents. Blobs are kept in the blob cache, also
+ * while unused, until the cache needs room for others. */
+typedef struct gitfs_blob {
+	git_oid oid;
+	size_t size;
+	/* The contents, or NULL when the blob is in the cold tier of
+	 * the blob cache */
+	void *data;
+	/* The LZ4-compressed contents, when in the cold tier */
+	void *cdata;
+	size_t csize;
+	/* Set while being moved into the cold tier, see
+	 * gitfs_blob_cache_shrink */
+	bool demoting;
+	/* Set when the blob was not admitted into the cache, so it is
+	 * freed once no longer used */
+	bool uncached;
+	/* Set for blobs that are still (or were) inflated in the
+	 * background, in which case only the start of data might be
+	 * valid yet */
+	struct gitfs_stream *stream;
+	/* The number of entries using this blob */
+	unsigned refcount;
+	/* Next blob in the same hash bucket */
+	struct gitfs_blob *next;
+	/* Neighbours in the LRU list of its tier (most recently used
+	 * first) */
+	struct gitfs_blob *lru_prev, *lru_next;
+} gitfs_blob;
+
+/* A pack, as far as needed to find out where objects are stored in
+ * it (which libgit2 doesn't tell). Only version 2 pack indexes are
+ * supported, see Documentation/technical/pack-format.txt in git. */
+struct gitfs_pack {
+	/* The pack itself, used to drop its pages from the page cache
+	 * and to inflate large blobs from */
+	int fd;
+	uint64_t size;
+	/* The mmapped pack index */
+	const unsigned char *idx;
+	size_t idx_size;
+	uint32_t count;
+	/* The offsets of all objects in ascending order, to find where
+	 * each object ends. Built on first use. */
+	uint64_t *ends;
+};
+
+/* An opened instance of the object database of a repository. When
+ * the packs of the repository change (e.g. after git gc), a new
+ * instance is opened, but the old one is kept until nobody uses it
+ * anymore, since its trees might still be in use. Only then are its
+ * (possibly deleted) packs unmapped. */
+struct gitfs_odb {
+	git_repository *repo;
+	git_odb *odb;
+	/* The packs in the object database */
+	struct gitfs_pack *packs;
+	size_t pack_count;
+	/* Protects the ends arrays in packs */
+	pthread_mutex_t packs_lock;
+	/* The number of users, including the gitfs_repo as long as this
+	 * is its current instance */
+	unsigned refcount;
+};
+
+/* A repository, opened once and shared by all mounts using it */
+struct gitfs_repo {
+	/* Path as passed to git_repository_open */
+	char *path;
+	/* Set when path is a single pack (with its index next to it)
+	 * instead of a repository, see gitfs_odb_open_pack */
+	bool pack;
+	/* The alternate object directories to use instead of the
+	 * configured ones (NULL-terminated), or NULL */
+	char **alternates;
+	/* Further alternates, opened before chrooting (NULL-terminated),
+	 * or NULL */
+	struct gitfs_outside **outside;
+	/* The instance to use for new lookups, use gitfs_odb_get to
+	 * access it */
+	struct gitfs_odb *current;
+	pthread_mutex_t lock;
+	/* inotify watches on the pack directories */
+	int *watches;
+	size_t watch_count;
+	/* Set when the packs changed and current should be replaced */
+	bool packs_changed;
+	/* The number of mounts using this repository */
+	unsigned refcount;
+	struct gitfs_repo *next;
+};
+
 typedef struct gitfs_entry {
 	/** The type */
 	gitfs_entry_type type;
 	/* The tree_entry for this entry, when type is GITFS_FILE. */
 	git_tree_entry *tree_entry;
+	/* The object database instance tree was looked up in, when type
+	 * is GITFS_DIR (the tree can't outlive it) */
+	struct gitfs_odb *odb;
+	/* Where the next read starts when reading sequentially, when
+	 * type is GITFS_FILE, see gitfs_stream_read */
+	off_t read_next;
 	/* The tree, blob or oid (in string form) corresponding to this
-	 * entry */
+	 * entry. For files, blob is only loaded when the file is
+	 * opened (and is NULL otherwise). */
 	union {
 		git_tree *tree;
-		git_blob *blob;
+		gitfs_blob *blob;
 		/* Content of the file (hash in ascii form).
 		 * Must be exactly GIT_OID_HEXSZ + 1 characters
 		 * long, contain a trailing newline but no
 		 * nul-termination. */
 		char *oid;
+		/* Contents of a GITFS_STATS, GITFS_FIND or
+		 * GITFS_MANIFEST file, NULL until opened */
+		struct {
+			char *data;
+			size_t size;
+		} text;
+		/* The result shown in a GITFS_SEARCH directory (NULL
+		 * for GITFS_SEARCH_PATH and GITFS_FIND_PATH), and the
+		 * path of the directory within it (empty or with a
+		 * trailing slash) */
+		struct {
+			struct gitfs_search_result *result;
+			char *prefix;
+		} search;
 	} object;
 } gitfs_entry;
 
+/* Work to do in the background, see gitfs_task_submit */
+struct gitfs_task {
+	void (*run)(void *data);
+	void *data;
+	/* GITFS_TASK_* (lower runs first) */
+	int priority;
+	bool queued, running;
+	struct gitfs_task *next;
+};
+
 struct gitfs_data {
 	/* Options passed on the cmdline */
 	char *repo_path;
 	char *rev;
 	bool no_oid_files;
+	/* Report the recursive size of directories as their size */
+	bool dir_sizes;
+	/* Number of worker threads (0 means one per available cpu) */
+	unsigned threads;
+	/* Allow exporting the mount over NFS */
+	bool nfs_export;
+	/* Control socket to listen on in daemon mode */
+	char *daemon_socket;
+	/* Image to export the tree to instead of mounting it, and the
+	 * file listing the paths to place first in it */
+	char *export_erofs;
+	char *export_order;
+	/* Mounted by the daemon, which opens the repository without
+	 * chrooting (a single process can't chroot into multiple
+	 * repositories) */
+	bool daemon;
+	/* Set when repo_path is a single pack, see --pack */
+	bool pack;
+
+	/* Object directories of the alternates of the repository
+	 * (absolute paths, NULL-terminated) */
+	char **alternates;
+	size_t alternate_count;
+	/* Directory to chroot into: the repository, or the directory
+	 * of a single pack */
+	char *chroot_path;
 
-	/* Mounted commit / tree */
+	/* Added to the generation of every node handed to the kernel,
+	 * so file handles for another tree (where the same path can be
+	 * a different file) are rejected as stale. */
+	uint32_t generation;
+	/* With nfs_export, the node ids handed to the kernel and those
+	 * libfuse uses for the same nodes, see gitfs_node_ids_in */
+	struct gitfs_node_id **node_ids_by_ino, **node_ids_by_node;
+	size_t node_id_buckets, node_id_count;
+	pthread_mutex_t node_ids_lock;
+
+	/* Mounted commit (zero when mounting a tree) / tree */
 	time_t commit_time;
+	git_oid commit_oid;
 	git_oid tree_oid;
 
-	git_repository *repo;
-	git_tree *tree;
+	struct gitfs_repo *repo;
 
 	/* Allocate for up to two oid files (but there might be less */
 	gitfs_entry oid_entries[2];
@@ -96,11 +370,55 @@ struct gitfs_data {
 	/* The number of valid entries in oid_entries */
 	size_t oid_entry_count;
 
+	/* The content search index of the mounted tree (NULL until
+	 * built) and the most recent searches, see gitfs_search */
+	struct gitfs_search_tree *search;
+	struct gitfs_search_result *search_results;
+	pthread_mutex_t search_lock;
+	struct gitfs_task search_task;
+	bool search_stop;
+	/* All paths in the mounted tree, NULL until the first path
+	 * query, see gitfs_path_list */
+	struct gitfs_path_list *paths;
+	pthread_mutex_t paths_lock;
+	/* Computing the digests of the mounted tree in the background,
+	 * see gitfs_digest_main */
+	struct gitfs_task digest_task;
+	bool digest_stop, digests_done;
+
 	/* Value to return when fuse_main exits */
 	int retval;
 
+	/* Wakes up gitfs_loop, see gitfs_loop_exit */
+	sem_t *loop_finished;
+
 };
 
+/* 64-bit FNV-1a hash, continuing from the given hash value (pass
+ * GITFS_FNV_INIT to start a new hash) */
+#define GITFS_FNV_INIT 0xcbf29ce484222325ULL
+uint64_t gitfs_fnv1a(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* NFS clients expect inode numbers (and file handles) to stay the same
+ * over server restarts, so with nfs-export they are derived from the
+ * path (which uniquely identifies a file within the mounted tree)
+ * instead of numbering nodes in lookup order, like libfuse does */
+static uint64_t gitfs_path_ino(const char *path) {
+	uint64_t ino = gitfs_fnv1a(GITFS_FNV_INIT, path, strlen(path));
+
+	/* 0 is no node at all, 1 is reserved for the root directory */
+	if (path[1] == '\0' || ino <= 1)
+		return 1 + (path[1] != '\0');
+	return ino;
+}
+
 void debug(const char* format, ...) {
 	if (!enable_debug)
 		return;
@@ -110,525 +428,8545 @@ void debug(const char* format, ...) {
 	va_end(args);
 }
 
+/* Oids are sha1 hashes, so any part of them is a good hash value */
+static size_t gitfs_oid_hash(const git_oid *oid) {
+	size_t hash;
+	memcpy(&hash, oid->id, sizeof(hash));
+	return hash;
+}
 
-void gitfs_entry_free(gitfs_entry *e) {
-	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
-	switch (e->type) {
-		case GITFS_DIR:
-			if (e->object.tree != d->tree)
-				git_tree_free(e->object.tree);
-			break;
-		case GITFS_FILE:
-			git_tree_entry_free(e->tree_entry);
-			git_blob_free(e->object.blob);
-			break;
-		case GITFS_OID:
-			/* Don't free GITFS_OID entries, they're statically
-			 * allocated in gitfs_data. The contents stored in them
-			 * will be explicitely freed by gitfs_destroy. */
-			return;
-	}
+/* Hash table of entries keyed on their oid. The entries can be any
+ * struct with an oid and a next pointer (chaining the entries in the
+ * same bucket), see GITFS_OID_TABLE_INIT. */
+struct gitfs_oid_table {
+	void **buckets;
+	/* Always a power of two */
+	size_t bucket_count;
+	size_t count;
+	/* Where the oid and next pointer are in the entries */
+	size_t oid_offset, next_offset;
+};
 
-	free(e);
+#define GITFS_OID_TABLE_INIT(type) { .oid_offset = offsetof(type, oid), .next_offset = offsetof(type, next) }
+
+#define gitfs_oid_table_oid(t, e) ((const git_oid *)((char *)(e) + (t)->oid_offset))
+#define gitfs_oid_table_next(t, e) ((void **)((char *)(e) + (t)->next_offset))
+
+/* Returns the entry with the given oid in t, or NULL */
+static void *gitfs_oid_table_find(struct gitfs_oid_table *t, const git_oid *oid) {
+	void *e;
+
+	if (!t->bucket_count)
+		return NULL;
+	e = t->buckets[gitfs_oid_hash(oid) & (t->bucket_count - 1)];
+	while (e && git_oid_cmp(gitfs_oid_table_oid(t, e), oid))
+		e = *gitfs_oid_table_next(t, e);
+	return e;
 }
 
-int gitfs_lookup_oid_entry(gitfs_entry **out, const char *path) {
-	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
-	int i;
-	for (i = 0; i < d->oid_entry_count; i++) {
-		if (!strcmp(path, d->oid_paths[i])) {
-			*out = &d->oid_entries[i];
-			return 0;
+/* Add e to t, which must not contain its oid yet. The number of buckets
+ * is doubled once there are as many entries, but when out of memory
+ * this just keeps using longer chains. So this only fails (with
+ * -ENOMEM) when there are no buckets at all. */
+static int gitfs_oid_table_add(struct gitfs_oid_table *t, void *e) {
+	size_t i, bucket, count = t->bucket_count ? t->bucket_count * 2 : 1024;
+	void **buckets, *f, *next;
+
+	if (t->count >= t->bucket_count && (buckets = calloc(count, sizeof(*buckets)))) {
+		for (i = 0; i < t->bucket_count; i++) {
+			for (f = t->buckets[i]; f; f = next) {
+				next = *gitfs_oid_table_next(t, f);
+				bucket = gitfs_oid_hash(gitfs_oid_table_oid(t, f)) & (count - 1);
+				*gitfs_oid_table_next(t, f) = buckets[bucket];
+				buckets[bucket] = f;
+			}
 		}
+		free(t->buckets);
+		t->buckets = buckets;
+		t->bucket_count = count;
 	}
-	return -ENOENT;
+	if (!t->bucket_count)
+		return -ENOMEM;
+
+	bucket = gitfs_oid_hash(gitfs_oid_table_oid(t, e)) & (t->bucket_count - 1);
+	*gitfs_oid_table_next(t, e) = t->buckets[bucket];
+	t->buckets[bucket] = e;
+	t->count++;
+	return 0;
 }
 
-int gitfs_lookup_git_entry(gitfs_entry **out, const char *path) {
-	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
-	int retval = 0;
+/* Remove e, which must be in t */
+static void gitfs_oid_table_remove(struct gitfs_oid_table *t, void *e) {
+	void **p = &t->buckets[gitfs_oid_hash(gitfs_oid_table_oid(t, e)) & (t->bucket_count - 1)];
 
-	gitfs_entry *e = *out = calloc(1, sizeof(gitfs_entry));
-	if (!e) {
-		error("Failed to allocate memory for entry: '%s'\n", path);
-		retval = -ENOMEM;
-		goto out;
-	}
+	while (*p != e)
+		p = gitfs_oid_table_next(t, *p);
+	*p = *gitfs_oid_table_next(t, e);
+	t->count--;
+}
 
-	if (path[0] == '/' && path[1] == '\0') {
-		/* We can't use git_tree_entry_bypath for the root path,
-		 * so short circuit here. Also set out to 0 to signal
-		 * this special case (there exists no git_tree_entry for
-		 * the root path since the root path is not an entry in
-		 * any other tree). */
-		e->type = GITFS_DIR;
-		e->object.tree = d->tree;
-		return 0;
-	}
+/* A class of processes whose requests are treated the same way, see
+ * the qos option */
+struct gitfs_qos_class {
+	/* What to match processes on */
+	enum {
+		GITFS_QOS_COMM,
+		GITFS_QOS_UID,
+		GITFS_QOS_CGROUP,
+	} match;
+	/* Process name or cgroup path (prefix) to match */
+	char *value;
+	uid_t uid;
+	/* Nice value to process the requests with */
+	int nice;
+	/* Maximum number of blobs to inflate concurrently (0 for no
+	 * limit), counted by inflating */
+	unsigned inflate;
+	sem_t inflating;
+	/* Whether to add what is read to the blob cache */
+	bool cache;
+	struct gitfs_qos_class *next;
+};
 
-	git_tree_entry *tree_entry = NULL;
-	/* Fill e->tree_entry */
-	if (git_tree_entry_bypath(&tree_entry, d->tree, path + 1) < 0) {
-		retval = -ENOENT;
-		goto out;
+/* How long (in seconds) the class of a process is remembered */
+#define GITFS_QOS_TTL 5
+#define GITFS_QOS_PIDS 64
+
+static struct {
+	/* In order of the configuration file, the first match wins */
+	struct gitfs_qos_class *classes;
+	/* The nice value of the process, used for requests of no class */
+	int nice;
+	/* Whether worker threads can get back to that nice value after
+	 * raising theirs, see gitfs_qos_renice */
+	bool can_lower;
+	pthread_mutex_t lock;
+	/* Recently classified processes (hashed on pid) */
+	struct {
+		pid_t pid;
+		time_t time;
+		struct gitfs_qos_class *class;
+	} pids[GITFS_QOS_PIDS];
+} qos = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* /proc, opened before chrooting, see gitfs_proc_open */
+static int proc_fd = -1;
+
+/* The class of the request being processed by this thread, or NULL
+ * for the default class */
+static __thread struct gitfs_qos_class *current_qos;
+
+/* Open /proc for gitfs_proc_read, if not done yet. Must be called
+ * before chrooting. */
+static int gitfs_proc_open() {
+	if (proc_fd < 0 && (proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return error("Failed to open /proc: %s\n", strerror(errno)), -1;
+	return 0;
+}
+
+/* Returns whether threads can lower their nice value to nice (from a
+ * higher one), which takes CAP_SYS_NICE, or an RLIMIT_NICE of at least
+ * 20 - nice */
+static bool gitfs_qos_can_lower(int nice) {
+	struct __user_cap_header_struct hdr = { .version = _LINUX_CAPABILITY_VERSION_3 };
+	struct __user_cap_data_struct caps[_LINUX_CAPABILITY_U32S_3];
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NICE, &rl) == 0 && rl.rlim_cur >= (rlim_t)(20 - nice))
+		return true;
+	return syscall(SYS_capget, &hdr, caps) == 0 &&
+	       (caps[CAP_TO_INDEX(CAP_SYS_NICE)].effective & CAP_TO_MASK(CAP_SYS_NICE));
+}
+/* Load the QoS classes from the file at path. Each line describes a
+ * class, e.g.:
+ *
+ *   comm=kiosk-browser nice=-5
+ *   cgroup=/system.slice/updater.service nice=19 inflate=1 nocache
+ *   uid=1000 inflate=2
+ *
+ * Must be called before chrooting, since /proc is needed later on. */
+static int gitfs_qos_load(const char *path) {
+	struct gitfs_qos_class *c, **tail = &qos.classes;
+	char *line = NULL, *tok, *save, *end;
+	size_t n = 0;
+	unsigned lineno = 0;
+	int retval = -1;
+	FILE *f;
+
+	if (gitfs_proc_open() < 0)
+		return -1;
+
+	errno = 0;
+	qos.nice = getpriority(PRIO_PROCESS, 0);
+	if (errno) {
+		error("Failed to get nice value: %s\n", strerror(errno));
+		qos.nice = 0;
 	}
+	qos.can_lower = gitfs_qos_can_lower(qos.nice);
 
-	/* Fill e->type */
-	switch(git_tree_entry_type(tree_entry)) {
-		case GIT_OBJ_TREE:
-			/* Lookup the corresponding git_tree object and
-			 * store it into e->object */
-			if (git_tree_entry_to_object((git_object**)&e->object.tree, d->repo, tree_entry) < 0) {
-				error("Tree not found?!: '%s'\n", path);
-				retval = -EIO;
-				goto out;
-			}
-			e->type = GITFS_DIR;
-			break;
+	if (!(f = fopen(path, "re")))
+		return error("Failed to open %s: %s\n", path, strerror(errno)), -1;
 
-		case GIT_OBJ_BLOB:
-			/* Lookup the corresponding git_blob object and
-			 * store it into e->object */
-			if (git_tree_entry_to_object((git_object**)&e->object.blob, d->repo, tree_entry) < 0) {
-				error("Blob not found?!: '%s'\n", path);
-				retval = -EIO;
-				goto out;
-			}
-			e->type = GITFS_FILE;
-			e->tree_entry = tree_entry;
-			tree_entry = NULL;
-			break;
+	while (getline(&line, &n, f) > 0) {
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+		if (!(tok = strtok_r(line, " \t", &save)))
+			continue;
 
-		case GIT_OBJ_COMMIT:
-			debug("Ignoring submodule entry: '%s'\n", path);
-			retval = -ENOENT;
+		if (!(c = calloc(1, sizeof(*c)))) {
+			error("Failed to allocate memory for QoS class\n");
 			goto out;
+		}
+		c->cache = true;
+		/* Link it right away, so it's freed on errors too */
+		*tail = c;
+		tail = &c->next;
 
-		default:
-			debug("Ignoring unknown entry: '%s'\n", path);
-			retval = -ENOENT;
+		if (!strncmp(tok, "comm=", 5)) {
+			c->match = GITFS_QOS_COMM;
+			c->value = strdup(tok + 5);
+		} else if (!strncmp(tok, "cgroup=", 7)) {
+			c->match = GITFS_QOS_CGROUP;
+			c->value = strdup(tok + 7);
+		} else if (!strncmp(tok, "uid=", 4)) {
+			c->match = GITFS_QOS_UID;
+			c->uid = strtoul(tok + 4, &end, 10);
+			if (*end != '\0')
+				goto invalid;
+		} else {
+			goto invalid;
+		}
+		if (c->match != GITFS_QOS_UID && !c->value) {
+			error("Failed to allocate memory for QoS class\n");
 			goto out;
+		}
+
+		while ((tok = strtok_r(NULL, " \t", &save))) {
+			if (!strncmp(tok, "nice=", 5)) {
+				c->nice = strtol(tok + 5, &end, 10);
+				if (*end != '\0' || c->nice < -20 || c->nice > 19)
+					goto invalid;
+			} else if (!strncmp(tok, "inflate=", 8)) {
+				c->inflate = strtoul(tok + 8, &end, 10);
+				if (*end != '\0')
+					goto invalid;
+			} else if (!strcmp(tok, "nocache")) {
+				c->cache = false;
+			} else {
+				goto invalid;
+			}
+		}
+		if (c->inflate)
+			sem_init(&c->inflating, 0, c->inflate);
 	}
-out:
-	if (retval < 0 && e) {
-		gitfs_entry_free(e);
-		*out = 0;
-	}
-	git_tree_entry_free(tree_entry);
+	retval = 0;
+	goto out;
 
+invalid:
+	error("%s:%u: Invalid QoS class: %s\n", path, lineno, tok);
+out:
+	free(line);
+	fclose(f);
 	return retval;
 }
 
-int gitfs_lookup_entry(gitfs_entry **out, const char *path) {
-	int retval = gitfs_lookup_git_entry(out, path);
+/* Read /proc/<pid>/<file> into buf, NUL-terminated. Returns false when
+ * it can't be read (e.g. because the process exited already). */
+static bool gitfs_proc_read(pid_t pid, const char *file, char *buf, size_t size) {
+	char path[32];
+	ssize_t len;
+	int fd;
 
-	/* Path not found in git, see if it's one of the magic oid paths */
-	if (retval == -ENOENT)
-		retval = gitfs_lookup_oid_entry(out, path);
+	snprintf(path, sizeof(path), "%d/%s", (int)pid, file);
+	if ((fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return false;
+	buf[len] = '\0';
+	return true;
+}
 
-	if (retval == -ENOENT)
-		debug("File not found: '%s'\n", path);
+/* Returns whether one of the lines in /proc/<pid>/cgroup (e.g.
+ * "0::/system.slice/foo.service") is (inside) the cgroup prefix */
+static bool gitfs_cgroup_match(const char *cgroups, const char *prefix) {
+	size_t len = strlen(prefix);
+	const char *line, *next, *path;
 
-	return retval;
+	for (line = cgroups; *line; line = next) {
+		next = strchrnul(line, '\n');
+		if (*next)
+			next++;
+
+		/* The path comes after the second colon */
+		if (!(path = strchr(line, ':')) || !(path = strchr(path + 1, ':')) || path >= next)
+			continue;
+		path++;
+		if (strncmp(path, prefix, len))
+			continue;
+		/* Don't match /foo.service against /foo */
+		if (strchr("/\n", path[len]) || prefix[len - 1] == '/')
+			return true;
+	}
+	return false;
 }
 
-/**
- * Initialize an oid entry, which is a magic file inside / that contains
- * an oid. Path must be the pathname, including leading /. The pointer
- * in path must not be freed until gitfs_destroy, since it is used as is
- * (e.g., a string constant is perfect).
- */
-int gitfs_init_oid_entry(struct gitfs_data *d, const char *path, const git_oid* oid)
-{
-	/* Disabled, skip */
-	if (d->no_oid_files)
-		return 0;
+/* Find the first class matching the process pid running as uid */
+static struct gitfs_qos_class *gitfs_qos_match(pid_t pid, uid_t uid) {
+	struct gitfs_qos_class *c;
+	char comm[64], cgroups[4096];
+	bool have_comm = false, have_cgroups = false;
 
-	/* Check if the statically allocated oid_entries array is long
-	 * enough. This is a sanity check, this can only occur when the
-	 * code is (incorrectly) modified. */
-	if (d->oid_entry_count == lengthof(d->oid_entries))
-		return error("oid_entries is nog long enough?!\n"), -ENOMEM;
+	for (c = qos.classes; c; c = c->next) {
+		switch (c->match) {
+			case GITFS_QOS_UID:
+				if (c->uid == uid)
+					return c;
+				break;
 
-	/* Copy the path (pointer) */
-	d->oid_paths[d->oid_entry_count] = path;
+			case GITFS_QOS_COMM:
+				if (!have_comm) {
+					if (!gitfs_proc_read(pid, "comm", comm, sizeof(comm)))
+						comm[0] = '\0';
+					comm[strcspn(comm, "\n")] = '\0';
+					have_comm = true;
+				}
+				if (!strcmp(comm, c->value))
+					return c;
+				break;
 
-	/* Fill the entry */
-	gitfs_entry *e = &d->oid_entries[d->oid_entry_count];
-	e->tree_entry = NULL;
-	e->type = GITFS_OID;
+			case GITFS_QOS_CGROUP:
+				if (!have_cgroups) {
+					if (!gitfs_proc_read(pid, "cgroup", cgroups, sizeof(cgroups)))
+						cgroups[0] = '\0';
+					have_cgroups = true;
+				}
+				if (gitfs_cgroup_match(cgroups, c->value))
+					return c;
+				break;
+		}
+	}
+	return NULL;
+}
 
-	e->object.oid = malloc(GIT_OID_HEXSZ + 1);
-	if (!e->object.oid)
-		return error("Could not allocate memory for oid file contents (%s)\n", path), -ENOMEM;
-	git_oid_fmt(e->object.oid, oid);
-	e->object.oid[GIT_OID_HEXSZ] = '\n';
+/* Returns the class of the process pid running as uid, or NULL for
+ * the default class. Classes are remembered for a few seconds, so
+ * /proc isn't read for every request. */
+static struct gitfs_qos_class *gitfs_qos_classify(pid_t pid, uid_t uid) {
+	struct gitfs_qos_class *c;
+	time_t now;
+	size_t slot = (size_t)pid % GITFS_QOS_PIDS;
 
-	d->oid_entry_count++;
+	/* Requests made by the kernel itself have no pid */
+	if (!qos.classes || !pid)
+		return NULL;
 
-	return 0;
-}
+	now = time(NULL);
+	pthread_mutex_lock(&qos.lock);
+	if (qos.pids[slot].pid == pid && now - qos.pids[slot].time < GITFS_QOS_TTL) {
+		c = qos.pids[slot].class;
+		pthread_mutex_unlock(&qos.lock);
+		return c;
+	}
+	pthread_mutex_unlock(&qos.lock);
 
-int gitfs_open(const char *path, struct fuse_file_info *fi)
-{
-	/* Find the corresponding entry and store it inside the fh
-	 * member, for use in other operations. */
-	return gitfs_lookup_entry((gitfs_entry**)&fi->fh, path);
-}
+	c = gitfs_qos_match(pid, uid);
 
-int gitfs_release(const char *path, struct fuse_file_info *fi)
-{
-	/* Free the gitfs_entry pointer in fh */
-	if(fi->fh)
-		gitfs_entry_free(GITFS_FH(fi));
-	return 0;
+	pthread_mutex_lock(&qos.lock);
+	qos.pids[slot].pid = pid;
+	qos.pids[slot].time = now;
+	qos.pids[slot].class = c;
+	pthread_mutex_unlock(&qos.lock);
+	return c;
 }
 
-int gitfs_getattr(const char *path, struct stat *stbuf)
-{
-	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
-	int retval = 0;
-	debug("Getattr called for '%s'\n", path);
-	gitfs_entry *e = NULL;
-	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
-		goto out;
+/* The number of processes to keep statistics for. When full, the
+ * least recently active one is forgotten. */
+#define GITFS_STATS_PROCS 256
+#define GITFS_STATS_PROBES 8
 
-	memset(stbuf, 0, sizeof(struct stat));
+/* The requests made by a single process */
+struct gitfs_proc_stats {
+	pid_t pid;
+	char comm[16];
+	char cgroup[128];
+	uint64_t ops;
+	/* Bytes returned by reads */
+	uint64_t bytes_read;
+	/* Bytes inflated from packs on its behalf */
+	uint64_t bytes_inflated;
+	/* Time spent processing its requests, in nanoseconds */
+	uint64_t time;
+	uint64_t max_time;
+	time_t last;
+};
 
-	/* Set all times to the only time we (might) have available: The
-	 * time the commit we're working with was made. Note that we
-	 * _could_ search back through history to find the real times,
-	 * of files, but this is time-consuming and probably not worth
-	 * the trouble (right now). */
-	stbuf->st_atime = d->commit_time;
-	stbuf->st_ctime = d->commit_time;
-	stbuf->st_mtime = d->commit_time;
+/* The number of most opened paths to keep track of */
+#define GITFS_STATS_PATHS 64
 
-	if (e->type == GITFS_DIR) {
-		debug( "Path is a directory: '%s'\n", path);
-		stbuf->st_nlink = 2;
-		stbuf->st_mode = 040755;
-		stbuf->st_size = 4096;
-	} else if (e->type == GITFS_FILE) {
-		debug( "Path is a file: '%s'\n", path);
-		stbuf->st_nlink = 1;
-		stbuf->st_mode = git_tree_entry_filemode(e->tree_entry);
-		/* Override the permissions for links, since git just
-		 * stores the link type bit. */
-		if (S_ISLNK(stbuf->st_mode))
-			stbuf->st_mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
-		/* Note that this gives the length of the filename for
-		 * symlinks, but that's what native filesystems do as
-		 * well. */
-		stbuf->st_size = git_blob_rawsize(e->object.blob);
-	} else if (e->type == GITFS_OID) {
-		debug( "Path is a special oid file: '%s'\n", path);
-		stbuf->st_nlink = 1;
-		/* Read-only for everyone */
-		stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
-		stbuf->st_size = GIT_OID_HEXSZ + 1;
-	} else {
-		error("Unsupported type?!\n");
-		retval = -EIO;
-		goto out;
-	}
+/* A path and (an estimate of) how often it was opened */
+struct gitfs_path_stats {
+	char *path;
+	uint64_t opens;
+};
 
-	stbuf->st_gid = 0;
-	stbuf->st_uid = 0;
+/* Request latencies are counted in buckets of powers of two
+ * microseconds: bucket i holds those below 2^i us */
+#define GITFS_LATENCY_BUCKETS 32
 
-out:
-	if (e)
-		gitfs_entry_free(e);
+/* The highest opcode of the kernel protocol we keep counts for */
+#define GITFS_FUSE_MAX_OPCODE 63
 
-	return retval;
-}
+/* Process-wide statistics, shared by all mounts. Only collected with
+ * the stats option. */
+static struct {
+	bool enabled;
+	pthread_mutex_t lock;
+	struct timespec start;
+	struct gitfs_proc_stats procs[GITFS_STATS_PROCS];
+	/* Requests by opcode, and by latency */
+	uint64_t ops[GITFS_FUSE_MAX_OPCODE + 1];
+	uint64_t latency[GITFS_LATENCY_BUCKETS];
+	/* Requests being processed right now */
+	unsigned inflight;
+	struct gitfs_path_stats paths[GITFS_STATS_PATHS];
+} stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-int gitfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info *fi)
+/* Names of the opcodes of the kernel protocol, see linux/fuse.h */
+static const char *const gitfs_fuse_opcodes[] = {
+	[1] = "lookup", [2] = "forget", [3] = "getattr", [4] = "setattr",
+	[5] = "readlink", [6] = "symlink", [8] = "mknod", [9] = "mkdir",
+	[10] = "unlink", [11] = "rmdir", [12] = "rename", [13] = "link",
+	[14] = "open", [15] = "read", [16] = "write", [17] = "statfs",
+	[18] = "release", [20] = "fsync", [21] = "setxattr",
+	[22] = "getxattr", [23] = "listxattr", [24] = "removexattr",
+	[25] = "flush", [26] = "init", [27] = "opendir", [28] = "readdir",
+	[29] = "releasedir", [30] = "fsyncdir", [31] = "getlk",
+	[32] = "setlk", [33] = "setlkw", [34] = "access", [35] = "create",
+	[36] = "interrupt", [37] = "bmap", [38] = "destroy", [39] = "ioctl",
+	[40] = "poll", [41] = "notify_reply", [42] = "batch_forget",
+	[43] = "fallocate", [44] = "readdirplus", [45] = "rename2",
+	[46] = "lseek", [47] = "copy_file_range",
+};
+
+/* Returns the statistics of pid, or NULL when it is not tracked yet.
+ * When replace is not NULL, it is set to the slot to use for pid when
+ * adding it. Must be called with stats.lock held. */
+static struct gitfs_proc_stats *gitfs_stats_find(pid_t pid, struct gitfs_proc_stats **replace) {
+	struct gitfs_proc_stats *p, *oldest = NULL;
+	size_t i;
+
+	for (i = 0; i < GITFS_STATS_PROBES; i++) {
+		p = &stats.procs[((size_t)pid + i) % GITFS_STATS_PROCS];
+		if (p->pid == pid)
+			return p;
+		/* Keep the busiest of the processes active at the same
+		 * time */
+		if (!oldest || p->last < oldest->last ||
+		    (p->last == oldest->last && p->time < oldest->time))
+			oldest = p;
+	}
+	if (replace)
+		*replace = oldest;
+	return NULL;
+}
+
+/* Attribute a number of requests, the time spent on them and the
+ * bytes read and inflated for them to the process pid */
+static void gitfs_stats_add(pid_t pid, unsigned ops, uint64_t ns, size_t bytes_read, size_t bytes_inflated) {
+	struct gitfs_proc_stats *p, *replace;
+	char comm[sizeof(p->comm)] = "?", cgroups[1024], *cgroup = "?", *line;
+
+	if (!stats.enabled || !pid)
+		return;
+
+	pthread_mutex_lock(&stats.lock);
+	if (!(p = gitfs_stats_find(pid, NULL))) {
+		/* Read /proc without holding the lock */
+		pthread_mutex_unlock(&stats.lock);
+		if (gitfs_proc_read(pid, "comm", comm, sizeof(comm)))
+			comm[strcspn(comm, "\n")] = '\0';
+		if (gitfs_proc_read(pid, "cgroup", cgroups, sizeof(cgroups))) {
+			/* Use the last hierarchy, which is the unified
+			 * one (0::/path) on current systems */
+			for (line = cgroups; (line = strstr(line, "::")); line += 2)
+				cgroup = line + 2;
+			cgroup[strcspn(cgroup, "\n")] = '\0';
+		}
+
+		pthread_mutex_lock(&stats.lock);
+		if (!(p = gitfs_stats_find(pid, &replace))) {
+			p = replace;
+			memset(p, 0, sizeof(*p));
+			p->pid = pid;
+			snprintf(p->comm, sizeof(p->comm), "%s", comm);
+			snprintf(p->cgroup, sizeof(p->cgroup), "%s", cgroup);
+		}
+	}
+
+	p->ops += ops;
+	p->time += ns;
+	if (ns > p->max_time)
+		p->max_time = ns;
+	p->bytes_read += bytes_read;
+	p->bytes_inflated += bytes_inflated;
+	p->last = time(NULL);
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/* Count a request with the given opcode taking ns nanoseconds */
+static void gitfs_stats_request(uint32_t opcode, uint64_t ns) {
+	unsigned bucket = 0;
+	uint64_t us = ns / 1000;
+
+	while (us && bucket < GITFS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	pthread_mutex_lock(&stats.lock);
+	if (opcode <= GITFS_FUSE_MAX_OPCODE)
+		stats.ops[opcode]++;
+	stats.latency[bucket]++;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/* Count an open of path. Only the most opened paths are kept, using
+ * the space-saving algorithm: a path that's not tracked replaces the
+ * least opened one, inheriting its count (so counts are upper
+ * bounds). */
+static void gitfs_stats_open(const char *path) {
+	struct gitfs_path_stats *p, *min = NULL;
+	char *copy;
+	size_t i;
+
+	if (!stats.enabled)
+		return;
+
+	pthread_mutex_lock(&stats.lock);
+	for (i = 0; i < GITFS_STATS_PATHS; i++) {
+		p = &stats.paths[i];
+		if (p->path && !strcmp(p->path, path)) {
+			p->opens++;
+			pthread_mutex_unlock(&stats.lock);
+			return;
+		}
+		if (!min || p->opens < min->opens)
+			min = p;
+	}
+	if ((copy = strdup(path))) {
+		free(min->path);
+		min->path = copy;
+		min->opens++;
+	}
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/* Sort processes on the time spent on them, busiest first */
+static int gitfs_stats_cmp(const void *a, const void *b) {
+	const struct gitfs_proc_stats *x = a, *y = b;
+	return x->time < y->time ? 1 : x->time > y->time ? -1 : 0;
+}
+
+static int gitfs_path_stats_cmp(const void *a, const void *b) {
+	const struct gitfs_path_stats *x = a, *y = b;
+	return x->opens < y->opens ? 1 : x->opens > y->opens ? -1 : 0;
+}
+
+static void gitfs_blob_cache_stats(FILE *out);
+
+/* Format all statistics as text. Returns a string that must be freed,
+ * or NULL. Every line starts with its type, followed by fields
+ * separated by spaces (git-fs-top parses these):
+ *
+ *   uptime SECONDS
+ *   inflight REQUESTS
+ *   cache HOT-BLOBS HOT-BYTES COLD-BLOBS COLD-BYTES HITS COLD-HITS MISSES UNCACHED
+ *   op OPCODE NAME REQUESTS
+ *   latency BUCKET REQUESTS (requests taking less than 2^BUCKET us)
+ *   path OPENS PATH (most opened first)
+ *   proc PID COMM REQUESTS BYTES-READ BYTES-INFLATED TIME-MS MAX-MS CGROUP
+ *        (busiest first)
+ */
+static char *gitfs_stats_format(size_t *len) {
+	struct gitfs_proc_stats *procs, *p;
+	struct gitfs_path_stats paths[GITFS_STATS_PATHS];
+	uint64_t ops[GITFS_FUSE_MAX_OPCODE + 1], latency[GITFS_LATENCY_BUCKETS];
+	struct timespec now;
+	unsigned inflight;
+	char *buf = NULL, *c;
+	size_t i, count = 0, path_count = 0;
+	FILE *out;
+
+	if (!(procs = malloc(sizeof(stats.procs))))
+		return NULL;
+
+	pthread_mutex_lock(&stats.lock);
+	for (i = 0; i < GITFS_STATS_PROCS; i++) {
+		if (stats.procs[i].pid)
+			procs[count++] = stats.procs[i];
+	}
+	for (i = 0; i < GITFS_STATS_PATHS; i++) {
+		if (stats.paths[i].path && (paths[path_count].path = strdup(stats.paths[i].path)))
+			paths[path_count++].opens = stats.paths[i].opens;
+	}
+	memcpy(ops, stats.ops, sizeof(ops));
+	memcpy(latency, stats.latency, sizeof(latency));
+	inflight = stats.inflight;
+	pthread_mutex_unlock(&stats.lock);
+	qsort(procs, count, sizeof(*procs), gitfs_stats_cmp);
+	qsort(paths, path_count, sizeof(*paths), gitfs_path_stats_cmp);
+
+	if ((out = open_memstream(&buf, len))) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fprintf(out, "uptime %.3f\n", (now.tv_sec - stats.start.tv_sec) + (now.tv_nsec - stats.start.tv_nsec) / 1e9);
+		fprintf(out, "inflight %u\n", inflight);
+		gitfs_blob_cache_stats(out);
+
+		for (i = 0; i <= GITFS_FUSE_MAX_OPCODE; i++) {
+			if (ops[i])
+				fprintf(out, "op %zu %s %llu\n", i, i < lengthof(gitfs_fuse_opcodes) && gitfs_fuse_opcodes[i] ? gitfs_fuse_opcodes[i] : "unknown", (unsigned long long)ops[i]);
+		}
+		for (i = 0; i < GITFS_LATENCY_BUCKETS; i++) {
+			if (latency[i])
+				fprintf(out, "latency %zu %llu\n", i, (unsigned long long)latency[i]);
+		}
+		/* Paths go last on their line, so they can contain
+		 * spaces */
+		for (i = 0; i < path_count; i++)
+			fprintf(out, "path %llu %s\n", (unsigned long long)paths[i].opens, paths[i].path);
+
+		for (i = 0; i < count; i++) {
+			p = &procs[i];
+			/* Keep the output easy to split on whitespace */
+			for (c = p->comm; *c; c++) {
+				if (*c == ' ' || *c == '\t')
+					*c = '_';
+			}
+			fprintf(out, "proc %d %s %llu %llu %llu %llu %llu %s\n", (int)p->pid, p->comm,
+				(unsigned long long)p->ops, (unsigned long long)p->bytes_read,
+				(unsigned long long)p->bytes_inflated, (unsigned long long)(p->time / 1000000),
+				(unsigned long long)(p->max_time / 1000000), p->cgroup);
+		}
+		fclose(out);
+	}
+
+	for (i = 0; i < path_count; i++)
+		free(paths[i].path);
+	free(procs);
+	return buf;
+}
+
+/* Dimensions of the count-min sketch estimating how often blobs are
+ * used. Counters are halved after GITFS_SKETCH_SAMPLES accesses, so
+ * old popularity fades. */
+#define GITFS_SKETCH_DEPTH 4
+#define GITFS_SKETCH_WIDTH (1 << 14)
+#define GITFS_SKETCH_MAX 15
+#define GITFS_SKETCH_SAMPLES (10 * GITFS_SKETCH_WIDTH)
+
+/* The number of processes tracked to detect scanners, and the period
+ * (in seconds) over which their cache misses are counted */
+#define GITFS_SCANNER_SLOTS 64
+#define GITFS_SCAN_WINDOW 10
+
+/* A process that caused cache misses recently */
+struct gitfs_scanner {
+	pid_t pid;
+	time_t start;
+	unsigned misses;
+	/* Whether the process looks like it reads the whole tree */
+	bool scanning;
+};
+
+/* Cache misses per GITFS_SCAN_WINDOW after which a process is treated
+ * as a scanner (0 to disable), see the scan-threshold option */
+static unsigned scan_threshold;
+
+/* A tier of the blob cache, with its blobs in LRU order */
+struct gitfs_blob_lru {
+	gitfs_blob *head, *tail;
+	/* Total size of the (possibly compressed) blob contents */
+	size_t size;
+	size_t max_size;
+};
+
+/* Process-wide cache of blob contents. Entries are found through a
+ * hash table on their oid. Once the hot tier exceeds its maximum size,
+ * its least recently used blobs are compressed with LZ4 and moved into
+ * the cold tier, which inflates a lot faster than packs do. Once the
+ * cold tier is full as well, blobs are evicted from it in LRU order.
+ * Blobs that are in use are never demoted or evicted. */
+static struct {
+	pthread_mutex_t lock;
+	/* Signalled when a blob leaves the cold tier */
+	pthread_cond_t promoted;
+	struct gitfs_oid_table blobs;
+	struct gitfs_blob_lru hot, cold;
+	/* Blobs found in the hot tier, found in the cold tier,
+	 * inflated and inflated without adding them to the cache */
+	uint64_t hits, cold_hits, misses, uncached;
+	/* Access frequencies, see gitfs_blob_admit */
+	uint8_t sketch[GITFS_SKETCH_DEPTH][GITFS_SKETCH_WIDTH];
+	unsigned sketch_samples;
+	struct gitfs_scanner scanners[GITFS_SCANNER_SLOTS];
+} blob_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.promoted = PTHREAD_COND_INITIALIZER,
+	.blobs = GITFS_OID_TABLE_INIT(gitfs_blob),
+	.hot.max_size = 36 << 20,
+	.cold.max_size = 12 << 20,
+};
+
+/* Default for the cache-size option, which is split between our blob
+ * cache and the object cache of libgit2 (for trees and commits) */
+#define GITFS_DEFAULT_CACHE_SIZE (64 << 20)
+
+/* The sketch uses other parts of the oid than the hash table does */
+static size_t gitfs_sketch_index(const git_oid *oid, int row) {
+	uint32_t hash;
+	memcpy(&hash, oid->id + 4 + row * sizeof(hash), sizeof(hash));
+	return hash & (GITFS_SKETCH_WIDTH - 1);
+}
+
+/* Count a use of the blob with the given oid. Must be called with
+ * blob_cache.lock held. */
+static void gitfs_sketch_add(const git_oid *oid) {
+	size_t i, j;
+	uint8_t *c;
+
+	for (i = 0; i < GITFS_SKETCH_DEPTH; i++) {
+		c = &blob_cache.sketch[i][gitfs_sketch_index(oid, i)];
+		if (*c < GITFS_SKETCH_MAX)
+			(*c)++;
+	}
+
+	if (++blob_cache.sketch_samples < GITFS_SKETCH_SAMPLES)
+		return;
+	for (i = 0; i < GITFS_SKETCH_DEPTH; i++) {
+		for (j = 0; j < GITFS_SKETCH_WIDTH; j++)
+			blob_cache.sketch[i][j] /= 2;
+	}
+	blob_cache.sketch_samples /= 2;
+}
+
+/* Returns how often the blob with the given oid was used recently.
+ * Must be called with blob_cache.lock held. */
+static unsigned gitfs_sketch_estimate(const git_oid *oid) {
+	unsigned i, count, min = GITFS_SKETCH_MAX;
+
+	for (i = 0; i < GITFS_SKETCH_DEPTH; i++) {
+		count = blob_cache.sketch[i][gitfs_sketch_index(oid, i)];
+		if (count < min)
+			min = count;
+	}
+	return min;
+}
+
+/* Returns whether pid looks like it is reading the whole tree (e.g. a
+ * backup or updatedb), based on the number of cache misses it caused
+ * recently. Such processes are served without affecting what is
+ * cached, so they can't push out what other processes use. Pass miss
+ * to count a cache miss. Must be called with blob_cache.lock held. */
+static bool gitfs_scanner(pid_t pid, bool miss) {
+	struct gitfs_scanner *s, *oldest = NULL;
+	time_t now;
+	size_t i;
+
+	if (!scan_threshold || !pid)
+		return false;
+
+	for (i = 0; i < GITFS_SCANNER_SLOTS; i++) {
+		s = &blob_cache.scanners[i];
+		if (s->pid == pid)
+			break;
+		if (!oldest || s->start < oldest->start)
+			oldest = s;
+	}
+	if (i == GITFS_SCANNER_SLOTS) {
+		/* Processes that only hit the cache are not tracked */
+		if (!miss)
+			return false;
+		s = oldest;
+		memset(s, 0, sizeof(*s));
+		s->pid = pid;
+	}
+	if (!miss)
+		return s->scanning;
+
+	/* A scanner stays one until it slows down for a whole window */
+	now = time(NULL);
+	if (now - s->start >= GITFS_SCAN_WINDOW) {
+		s->scanning = s->misses >= scan_threshold;
+		s->start = now;
+		s->misses = 0;
+	}
+	if (++s->misses >= scan_threshold) {
+		if (!s->scanning)
+			debug("pid %d is scanning, not caching its reads\n", (int)pid);
+		s->scanning = true;
+	}
+	return s->scanning;
+}
+
+/* Returns whether a newly inflated blob should be added to the cache.
+ * Once the hot tier is full, adding it means demoting another blob, so
+ * (like TinyLFU) only admit it when it was used more often recently
+ * than the least recently used blob. This keeps blobs that are read
+ * once (as a scan of the whole tree does) from flushing the cache.
+ * Must be called with blob_cache.lock held. */
+static bool gitfs_blob_admit(const git_oid *oid, size_t size) {
+	gitfs_blob *victim = blob_cache.hot.tail;
+
+	if (!victim || blob_cache.hot.size + size <= blob_cache.hot.max_size)
+		return true;
+	return gitfs_sketch_estimate(oid) > gitfs_sketch_estimate(&victim->oid);
+}
+/* Must be called with blob_cache.lock held */
+static void gitfs_blob_lru_unlink(struct gitfs_blob_lru *lru, gitfs_blob *b) {
+	if (b->lru_prev)
+		b->lru_prev->lru_next = b->lru_next;
+	else
+		lru->head = b->lru_next;
+	if (b->lru_next)
+		b->lru_next->lru_prev = b->lru_prev;
+	else
+		lru->tail = b->lru_prev;
+	b->lru_prev = b->lru_next = NULL;
+}
+
+/* Must be called with blob_cache.lock held */
+static void gitfs_blob_lru_push(struct gitfs_blob_lru *lru, gitfs_blob *b) {
+	b->lru_next = lru->head;
+	if (lru->head)
+		lru->head->lru_prev = b;
+	else
+		lru->tail = b;
+	lru->head = b;
+}
+
+/* Free b, which is not in the cache (anymore) */
+static void gitfs_blob_free(gitfs_blob *b) {
+	if (b->stream) {
+		pthread_mutex_destroy(&b->stream->lock);
+		pthread_cond_destroy(&b->stream->cond);
+		free(b->stream);
+	}
+	free(b->data);
+	free(b->cdata);
+	free(b);
+}
+/* Remove b from the cache and free it. Must be called with
+ * blob_cache.lock held, after unlinking b from its tier. */
+static void gitfs_blob_cache_remove(gitfs_blob *b) {
+	gitfs_oid_table_remove(&blob_cache.blobs, b);
+	gitfs_blob_free(b);
+}
+
+/* Move unused blobs from the hot into the cold tier until the hot
+ * tier fits within its maximum size again, and evict unused blobs
+ * from the cold tier until that fits as well. Must be called without
+ * blob_cache.lock held, since blobs are compressed without it. */
+static void gitfs_blob_cache_shrink() {
+	gitfs_blob *b, *prev;
+	char *cdata;
+	int bound, csize;
+
+	pthread_mutex_lock(&blob_cache.lock);
+	while (blob_cache.hot.size > blob_cache.hot.max_size) {
+		for (b = blob_cache.hot.tail; b && b->refcount; b = b->lru_prev)
+			;
+		if (!b)
+			break;
+
+		/* While demoting, the blob is in no tier, but it can
+		 * still be found (and used) through the hash table */
+		gitfs_blob_lru_unlink(&blob_cache.hot, b);
+		blob_cache.hot.size -= b->size;
+		b->demoting = true;
+		pthread_mutex_unlock(&blob_cache.lock);
+
+		cdata = NULL;
+		csize = 0;
+		if (b->size <= LZ4_MAX_INPUT_SIZE) {
+			bound = LZ4_compressBound(b->size);
+			if ((cdata = malloc(bound)))
+				csize = LZ4_compress_default(b->data, cdata, b->size, bound);
+		}
+
+		pthread_mutex_lock(&blob_cache.lock);
+		b->demoting = false;
+		if (b->refcount) {
+			/* Used again in the meanwhile, so keep it hot */
+			free(cdata);
+			gitfs_blob_lru_push(&blob_cache.hot, b);
+			blob_cache.hot.size += b->size;
+		} else if (csize > 0 && (size_t)csize < b->size) {
+			free(b->data);
+			b->data = NULL;
+			/* Give back the room compression didn't need */
+			b->cdata = realloc(cdata, csize);
+			if (!b->cdata)
+				b->cdata = cdata;
+			b->csize = csize;
+			gitfs_blob_lru_push(&blob_cache.cold, b);
+			blob_cache.cold.size += csize;
+		} else {
+			/* Not worth keeping when it doesn't compress */
+			free(cdata);
+			gitfs_blob_cache_remove(b);
+		}
+	}
+
+	b = blob_cache.cold.tail;
+	for (; b && blob_cache.cold.size > blob_cache.cold.max_size; b = prev) {
+		prev = b->lru_prev;
+		if (b->refcount)
+			continue;
+
+		gitfs_blob_lru_unlink(&blob_cache.cold, b);
+		blob_cache.cold.size -= b->csize;
+		gitfs_blob_cache_remove(b);
+	}
+	pthread_mutex_unlock(&blob_cache.lock);
+}
+
+/* Move b from the cold into the hot tier, decompressing without
+ * holding the lock. Must be called with blob_cache.lock held, and with
+ * a reference to b. */
+static int gitfs_blob_promote(gitfs_blob *b) {
+	void *cdata, *data;
+	bool ok;
+
+	/* Wait when someone else is already decompressing it */
+	while (!b->data && !b->cdata)
+		pthread_cond_wait(&blob_cache.promoted, &blob_cache.lock);
+	if (b->data)
+		return 0;
+
+	cdata = b->cdata;
+	b->cdata = NULL;
+	gitfs_blob_lru_unlink(&blob_cache.cold, b);
+	blob_cache.cold.size -= b->csize;
+	pthread_mutex_unlock(&blob_cache.lock);
+
+	/* Allocate at least one byte, so data is never NULL */
+	data = malloc(b->size + 1);
+	ok = data && LZ4_decompress_safe(cdata, data, b->csize, b->size) == (int)b->size;
+
+	pthread_mutex_lock(&blob_cache.lock);
+	if (ok) {
+		free(cdata);
+		b->data = data;
+		gitfs_blob_lru_push(&blob_cache.hot, b);
+		blob_cache.hot.size += b->size;
+	} else {
+		free(data);
+		b->cdata = cdata;
+		gitfs_blob_lru_push(&blob_cache.cold, b);
+		blob_cache.cold.size += b->csize;
+	}
+	pthread_cond_broadcast(&blob_cache.promoted);
+
+	if (!ok)
+		return error("Failed to decompress blob\n"), -ENOMEM;
+	return 0;
+}
+
+/* Print the state of the blob cache for gitfs_stats_format */
+static void gitfs_blob_cache_stats(FILE *out) {
+	size_t cold_count = 0;
+	gitfs_blob *b;
+
+	pthread_mutex_lock(&blob_cache.lock);
+	for (b = blob_cache.cold.head; b; b = b->lru_next)
+		cold_count++;
+	fprintf(out, "cache %zu %zu %zu %zu %llu %llu %llu %llu\n",
+		blob_cache.blobs.count - cold_count, blob_cache.hot.size, cold_count, blob_cache.cold.size,
+		(unsigned long long)blob_cache.hits, (unsigned long long)blob_cache.cold_hits,
+		(unsigned long long)blob_cache.misses, (unsigned long long)blob_cache.uncached);
+	pthread_mutex_unlock(&blob_cache.lock);
+}
+
+/* Take a reference to the cached blob b, moving it into the hot tier
+ * when needed. Unless touch is false, b also becomes the most recently
+ * used blob. Must be called with blob_cache.lock held. */
+static int gitfs_blob_use(gitfs_blob *b, bool touch) {
+	int retval;
+
+	b->refcount++;
+	if (b->data)
+		blob_cache.hits++;
+	else
+		blob_cache.cold_hits++;
+	if (!b->data && (retval = gitfs_blob_promote(b)) < 0) {
+		b->refcount--;
+		return retval;
+	}
+	/* Blobs being demoted are put back by gitfs_blob_cache_shrink */
+	if (touch && !b->demoting) {
+		gitfs_blob_lru_unlink(&blob_cache.hot, b);
+		gitfs_blob_lru_push(&blob_cache.hot, b);
+	}
+	return 0;
+}
+
+/* Shared memory blob cache. This allows multiple git-fs processes on
+ * the same host to share inflated blobs, so each blob only needs to be
+ * inflated once. The shared memory consists of a header, a hash table
+ * of slots indexed by oid and an arena of blob contents, which is used
+ * as a ring buffer: New contents are always appended, overwriting the
+ * oldest contents. Lookups don't take any locks: slots are protected
+ * by a sequence number (odd while the slot is being written) and the
+ * arena position of the contents is checked after copying them, to
+ * see if they were not overwritten in the meanwhile. Each user gets
+ * their own shared memory, named after their uid. */
+#define GITFS_SHM_NAME "/git-fs-blobs-%u"
+#define GITFS_SHM_MAGIC 0x31306d73667467ULL /* "gtfsm01" */
+/* How many slots to try for each oid */
+#define GITFS_SHM_PROBES 8
+/* A slot that stays locked for this long (in seconds) was left locked
+ * by a process that died while writing it, and is taken over */
+#define GITFS_SHM_STUCK 2
+
+enum {
+	GITFS_SHM_UNINITIALIZED = 0,
+	GITFS_SHM_READY,
+};
+
+struct gitfs_shm_header {
+	uint64_t magic;
+	uint32_t state;
+	/* Always a power of two */
+	uint32_t slot_count;
+	uint64_t arena_offset;
+	uint64_t arena_size;
+	/* The total number of bytes ever reserved in the arena. The
+	 * next contents are stored at head % arena_size. */
+	uint64_t head;
+};
+
+struct gitfs_shm_slot {
+	/* Odd while the slot is being written, 0 when it is empty */
+	uint64_t seq;
+	unsigned char oid[GIT_OID_RAWSZ];
+	uint32_t padding;
+	/* The value of head when the contents were stored */
+	uint64_t pos;
+	uint64_t size;
+	/* When the slot was last locked, see GITFS_SHM_STUCK */
+	uint64_t locked;
+	/* Hash of the other fields (see gitfs_shm_check), so a slot
+	 * written by two processes at once (after one of them was
+	 * taken for dead) is never used */
+	uint64_t check;
+};
+
+static struct {
+	char name[32];
+	struct gitfs_shm_header *header;
+	struct gitfs_shm_slot *slots;
+	char *arena;
+	size_t map_size;
+} shm_cache;
+
+/* Open (or create) the shared blob cache, using size bytes of shared
+ * memory when creating it. Must be called before chrooting. */
+int gitfs_shm_open(size_t size)
+{
+	struct gitfs_shm_header *h = MAP_FAILED;
+	bool created = false;
+	struct stat st;
+	int fd, i;
+
+	if (size < (1 << 20))
+		return error("Shared cache size too small\n"), -1;
+
+	snprintf(shm_cache.name, sizeof(shm_cache.name), GITFS_SHM_NAME, (unsigned)getuid());
+
+	/* Only the process that creates it sizes it, others use the
+	 * size recorded in its header */
+	for (;;) {
+		if ((fd = shm_open(shm_cache.name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) >= 0) {
+			created = true;
+			break;
+		}
+		if (errno == EEXIST && (fd = shm_open(shm_cache.name, O_RDWR | O_CLOEXEC, 0)) >= 0)
+			break;
+		/* Someone else's, which is no reason not to mount */
+		if (errno == EACCES) {
+			error("Not using shared cache /dev/shm%s: %s\n", shm_cache.name, strerror(errno));
+			return 0;
+		}
+		/* ENOENT means it was removed in the meanwhile, so
+		 * try creating it again */
+		if (errno != ENOENT)
+			return error("Failed to open shared cache: %s\n", strerror(errno)), -1;
+	}
+
+	if (created) {
+		if (ftruncate(fd, size) < 0 ||
+		    (h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			error("Failed to create shared cache: %s\n", strerror(errno));
+			close(fd);
+			shm_unlink(shm_cache.name);
+			return -1;
+		}
+		close(fd);
+
+		/* Divide it into slots (at least one for every 8K of
+		 * contents) and the arena */
+		uint32_t slots = 1024;
+		while (slots * 8192ULL < size)
+			slots *= 2;
+
+		h->slot_count = slots;
+		h->arena_offset = sizeof(*h) + slots * sizeof(struct gitfs_shm_slot);
+		h->arena_offset = (h->arena_offset + 4095) & ~4095;
+		h->arena_size = size - h->arena_offset;
+		h->head = 0;
+		h->magic = GITFS_SHM_MAGIC;
+		__atomic_store_n(&h->state, GITFS_SHM_READY, __ATOMIC_RELEASE);
+	} else {
+		/* Give the creator a second to size it and fill in the
+		 * header, only mapping the header until then */
+		for (i = 0; i < 100; i++) {
+			if (h == MAP_FAILED && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*h))
+				h = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+			if (h != MAP_FAILED && __atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == GITFS_SHM_READY)
+				break;
+			usleep(10000);
+		}
+		size = 0;
+		if (h != MAP_FAILED) {
+			if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == GITFS_SHM_READY &&
+			    h->magic == GITFS_SHM_MAGIC)
+				size = h->arena_offset + h->arena_size;
+			munmap(h, sizeof(*h));
+			h = MAP_FAILED;
+		}
+		if (size > sizeof(*h) && fstat(fd, &st) == 0 && st.st_size >= (off_t)size)
+			h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (h == MAP_FAILED)
+			return error("Shared cache /dev/shm%s is invalid, remove it\n", shm_cache.name), -1;
+	}
+
+	shm_cache.header = h;
+	shm_cache.slots = (struct gitfs_shm_slot *)(h + 1);
+	shm_cache.arena = (char *)h + h->arena_offset;
+	shm_cache.map_size = size;
+	debug("using shared cache of %zu bytes\n", shm_cache.map_size);
+	return 0;
+}
+
+static struct gitfs_shm_slot *gitfs_shm_slot(const git_oid *oid, int probe) {
+	return &shm_cache.slots[(gitfs_oid_hash(oid) + probe) & (shm_cache.header->slot_count - 1)];
+}
+
+/* The check of a slot with the given fields, see struct gitfs_shm_slot */
+static uint64_t gitfs_shm_check(uint64_t seq, const unsigned char *oid, uint64_t pos, uint64_t size) {
+	uint64_t hash = gitfs_fnv1a(GITFS_FNV_INIT, &seq, sizeof(seq));
+	hash = gitfs_fnv1a(hash, oid, GIT_OID_RAWSZ);
+	hash = gitfs_fnv1a(hash, &pos, sizeof(pos));
+	return gitfs_fnv1a(hash, &size, sizeof(size));
+}
+
+/* Seconds on a clock that all processes on the host share */
+static uint64_t gitfs_shm_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* Is the (locked) slot locked for so long that its writer died? */
+static bool gitfs_shm_stuck(struct gitfs_shm_slot *slot, uint64_t now) {
+	return now > __atomic_load_n(&slot->locked, __ATOMIC_RELAXED) + GITFS_SHM_STUCK;
+}
+
+/* Have the contents stored at pos been (partly) overwritten? */
+static bool gitfs_shm_overwritten(uint64_t pos) {
+	struct gitfs_shm_header *h = shm_cache.header;
+	return __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) - pos > h->arena_size;
+}
+
+/* Look up a blob in the shared cache, returning a copy of its contents
+ * (allocated with malloc) in *data. Returns false when not found. */
+bool gitfs_shm_lookup(const git_oid *oid, void **data, size_t *size)
+{
+	struct gitfs_shm_header *h = shm_cache.header;
+	int probe;
+
+	if (!h)
+		return false;
+
+	for (probe = 0; probe < GITFS_SHM_PROBES; probe++) {
+		struct gitfs_shm_slot *slot = gitfs_shm_slot(oid, probe);
+		unsigned char slot_oid[GIT_OID_RAWSZ];
+		uint64_t seq, pos, len, check;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == 0 || seq & 1)
+			continue;
+		memcpy(slot_oid, slot->oid, sizeof(slot_oid));
+		pos = __atomic_load_n(&slot->pos, __ATOMIC_RELAXED);
+		len = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+		check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (memcmp(slot_oid, oid->id, sizeof(slot_oid)) ||
+		    check != gitfs_shm_check(seq, slot_oid, pos, len))
+			continue;
+		if (len > h->arena_size || gitfs_shm_overwritten(pos))
+			return false;
+
+		void *copy = malloc(len + 1);
+		if (!copy)
+			return false;
+		memcpy(copy, shm_cache.arena + pos % h->arena_size, len);
+
+		/* Check that nobody started overwriting the contents
+		 * while we were copying them */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (gitfs_shm_overwritten(pos)) {
+			free(copy);
+			return false;
+		}
+
+		*data = copy;
+		*size = len;
+		return true;
+	}
+	return false;
+}
+
+/* Store a blob in the shared cache. This can silently fail (e.g. when
+ * another process is writing the same slot), which is fine for a
+ * cache. */
+void gitfs_shm_insert(const git_oid *oid, const void *data, size_t size)
+{
+	struct gitfs_shm_header *h = shm_cache.header;
+	struct gitfs_shm_slot *slot = NULL;
+	uint64_t head, pos, seq, now;
+	int probe;
+
+	/* Don't let a single blob push out a big part of the cache */
+	if (!h || size > h->arena_size / 8)
+		return;
+
+	/* Reserve room in the arena. Contents must be contiguous, so
+	 * skip the end of the arena when it is too small. */
+	head = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+	do {
+		pos = head;
+		if (pos % h->arena_size + size > h->arena_size)
+			pos += h->arena_size - pos % h->arena_size;
+	} while (!__atomic_compare_exchange_n(&h->head, &head, pos + size, true,
+					      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	memcpy(shm_cache.arena + pos % h->arena_size, data, size);
+
+	/* Prefer an empty slot, one pointing to overwritten contents
+	 * or one left locked by a process that died, otherwise replace
+	 * the first one */
+	now = gitfs_shm_now();
+	for (probe = 0; probe < GITFS_SHM_PROBES; probe++) {
+		struct gitfs_shm_slot *s = gitfs_shm_slot(oid, probe);
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1 && !gitfs_shm_stuck(s, now))
+			continue;
+		if (!slot)
+			slot = s;
+		if (seq == 0 || seq & 1 || !memcmp(s->oid, oid->id, sizeof(s->oid)) ||
+		    gitfs_shm_overwritten(__atomic_load_n(&s->pos, __ATOMIC_RELAXED))) {
+			slot = s;
+			break;
+		}
+	}
+	if (!slot)
+		return;
+
+	/* Lock the slot by making its sequence number odd (or taking
+	 * over the lock of a stuck one) */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1 && !gitfs_shm_stuck(slot, now))
+		return;
+	if (!__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1 + (seq & 1), false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	seq += 1 + (seq & 1);
+	__atomic_store_n(&slot->locked, now, __ATOMIC_RELAXED);
+
+	memcpy(slot->oid, oid->id, sizeof(slot->oid));
+	__atomic_store_n(&slot->pos, pos, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->size, size, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->check, gitfs_shm_check(seq + 1, oid->id, pos, size), __ATOMIC_RELAXED);
+	/* This fails when the slot was taken over in the meanwhile,
+	 * its check then tells it apart from what we wrote */
+	__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* Whether to drop pack data from the page cache once inflated */
+static bool drop_pack_cache;
+
+/* libgit2 pack window settings used with drop-pack-cache */
+#define GITFS_MWINDOW_SIZE (1 << 20)
+#define GITFS_MWINDOW_MAPPED_LIMIT (32 << 20)
+
+/* Offsets into a version 2 pack index */
+#define GITFS_IDX_FANOUT 8
+#define GITFS_IDX_OIDS (GITFS_IDX_FANOUT + 256 * 4)
+#define GITFS_IDX_OFFSETS(count) (GITFS_IDX_OIDS + (size_t)(count) * (GIT_OID_RAWSZ + 4))
+#define GITFS_IDX_LARGE_OFFSETS(count) (GITFS_IDX_OFFSETS(count) + (size_t)(count) * 4)
+/* Both the pack and the index end with checksums */
+#define GITFS_PACK_TRAILER (2 * GIT_OID_RAWSZ)
+
+static uint32_t gitfs_be32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Open the pack index at idx_path (and its pack), and add it to
+ * o->packs. Packs that can't be used are skipped, their objects are
+ * just left to libgit2 entirely. */
+static void gitfs_pack_open(struct gitfs_odb *o, const char *idx_path) {
+	struct gitfs_pack p = { .fd = -1 }, *packs;
+	char pack_path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	if ((fd = open(idx_path, O_RDONLY | O_CLOEXEC)) < 0)
+		goto err;
+	if (fstat(fd, &st) < 0 || st.st_size < GITFS_IDX_OIDS + GITFS_PACK_TRAILER) {
+		close(fd);
+		goto err;
+	}
+	p.idx_size = st.st_size;
+	p.idx = mmap(NULL, p.idx_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p.idx == MAP_FAILED) {
+		p.idx = NULL;
+		goto err;
+	}
+
+	if (memcmp(p.idx, "\377tOc", 4) || gitfs_be32(p.idx + 4) != 2)
+		goto err;
+	p.count = gitfs_be32(p.idx + GITFS_IDX_FANOUT + 255 * 4);
+	if (p.idx_size < GITFS_IDX_LARGE_OFFSETS(p.count) + GITFS_PACK_TRAILER)
+		goto err;
+
+	snprintf(pack_path, sizeof(pack_path), "%.*s.pack", (int)(strlen(idx_path) - strlen(".idx")), idx_path);
+	if ((p.fd = open(pack_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(p.fd, &st) < 0)
+		goto err;
+	p.size = st.st_size;
+
+	if (!(packs = realloc(o->packs, (o->pack_count + 1) * sizeof(*packs))))
+		goto err;
+	o->packs = packs;
+	o->packs[o->pack_count++] = p;
+	return;
+
+err:
+	debug("Not using pack index %s\n", idx_path);
+	if (p.idx) munmap((void *)p.idx, p.idx_size);
+	if (p.fd >= 0) close(p.fd);
+}
+
+static bool gitfs_local_pack(char *idx_path, const char *objects_dir, const char *idx_name, bool copy);
+
+/* Add all packs in objects_dir to the gitfs_odb in data (using their
+ * copies in the local cache, when there are) */
+static void gitfs_odb_load_packs(void *data, const char *objects_dir) {
+	char path[PATH_MAX];
+	struct dirent *de;
+	size_t len;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/pack", objects_dir);
+	if (!(dir = opendir(path)))
+		return;
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len > 4 && !strcmp(de->d_name + len - 4, ".idx")) {
+			if (!gitfs_local_pack(path, objects_dir, de->d_name, false))
+				snprintf(path, sizeof(path), "%s/pack/%s", objects_dir, de->d_name);
+			gitfs_pack_open(data, path);
+		}
+	}
+	closedir(dir);
+}
+
+/* Returns the position of oid in the index of p, or -1 */
+static int64_t gitfs_pack_find(struct gitfs_pack *p, const git_oid *oid) {
+	const unsigned char *fanout = p->idx + GITFS_IDX_FANOUT;
+	const unsigned char *oids = p->idx + GITFS_IDX_OIDS;
+	uint32_t lo = oid->id[0] ? gitfs_be32(fanout + (oid->id[0] - 1) * 4) : 0;
+	uint32_t hi = gitfs_be32(fanout + oid->id[0] * 4);
+	uint32_t mid;
+	int cmp;
+
+	/* Don't trust a corrupted index */
+	if (hi > p->count)
+		hi = p->count;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(oids + (size_t)mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+		if (!cmp)
+			return mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+/* Returns the offset in the pack of the object at pos in the index */
+static uint64_t gitfs_pack_offset(struct gitfs_pack *p, uint32_t pos) {
+	const unsigned char *large;
+	uint32_t offset = gitfs_be32(p->idx + GITFS_IDX_OFFSETS(p->count) + (size_t)pos * 4);
+
+	/* The msb means the offset is stored in the table of 64-bit
+	 * offsets */
+	if (!(offset & 0x80000000))
+		return offset;
+
+	large = p->idx + GITFS_IDX_LARGE_OFFSETS(p->count) + (size_t)(offset & 0x7fffffff) * 8;
+	if (large + 8 > p->idx + p->idx_size - GITFS_PACK_TRAILER)
+		return p->size;
+	return (uint64_t)gitfs_be32(large) << 32 | gitfs_be32(large + 4);
+}
+
+static int gitfs_offset_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Returns where the object at offset ends in p (i.e. where the next
+ * object starts), or 0 when unknown. Must be called with packs_lock
+ * held. */
+static uint64_t gitfs_pack_end(struct gitfs_pack *p, uint64_t offset) {
+	uint32_t i, lo = 0, hi = p->count, mid;
+
+	if (!p->ends) {
+		if (!p->count || !(p->ends = malloc(p->count * sizeof(*p->ends))))
+			return 0;
+		for (i = 0; i < p->count; i++)
+			p->ends[i] = gitfs_pack_offset(p, i);
+		qsort(p->ends, p->count, sizeof(*p->ends), gitfs_offset_cmp);
+	}
+
+	/* Find the first offset after the given one */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (p->ends[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < p->count ? p->ends[lo] : p->size - GIT_OID_RAWSZ;
+}
+
+/* Drop the pack data of the object with the given oid from the page
+ * cache. Once it is inflated into the blob cache (and from there into
+ * the page cache of the mounted file), keeping the compressed data
+ * around as well just costs memory. Note that pages still mapped by
+ * libgit2 are not dropped, see drop-pack-cache in gitfs_opt_proc. */
+static void gitfs_odb_drop_cached(struct gitfs_odb *o, const git_oid *oid) {
+	struct gitfs_pack *p;
+	uint64_t start, end;
+	int64_t pos;
+	size_t i;
+
+	for (i = 0; i < o->pack_count; i++) {
+		p = &o->packs[i];
+		if ((pos = gitfs_pack_find(p, oid)) < 0)
+			continue;
+
+		start = gitfs_pack_offset(p, pos);
+		pthread_mutex_lock(&o->packs_lock);
+		end = gitfs_pack_end(p, start);
+		pthread_mutex_unlock(&o->packs_lock);
+
+		/* The kernel only drops whole pages, so objects sharing
+		 * a page with this one are not affected */
+		if (end > start && end <= p->size)
+			posix_fadvise(p->fd, start, end - start, POSIX_FADV_DONTNEED);
+		return;
+	}
+}
+
+/* Returns the current object database instance of repo, which must
+ * be released with gitfs_odb_put */
+struct gitfs_odb *gitfs_odb_get(struct gitfs_repo *repo) {
+	struct gitfs_odb *o;
+
+	pthread_mutex_lock(&repo->lock);
+	o = repo->current;
+	__atomic_add_fetch(&o->refcount, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&repo->lock);
+	return o;
+}
+
+void gitfs_odb_put(struct gitfs_odb *o) {
+	size_t i;
+
+	if (__atomic_sub_fetch(&o->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 0; i < o->pack_count; i++) {
+		munmap((void *)o->packs[i].idx, o->packs[i].idx_size);
+		close(o->packs[i].fd);
+		free(o->packs[i].ends);
+	}
+	free(o->packs);
+	pthread_mutex_destroy(&o->packs_lock);
+	git_odb_free(o->odb);
+	git_repository_free(o->repo);
+	free(o);
+}
+
+/* Blobs of at least this size are inflated in the background while
+ * being read, instead of completely when opened (0 disables this), see
+ * the stream-size option */
+static size_t stream_size = 8 << 20;
+
+/* The amount of compressed data read (and inflated) at once */
+#define GITFS_STREAM_CHUNK (64 << 10)
+
+/* Each blob inflated in the background has a thread of its own (which
+ * mostly waits for its readers), so at most this many are, counted by
+ * stream_count. Further large blobs are inflated completely when
+ * opened, like small ones. */
+#define GITFS_STREAM_MAX 16
+static unsigned stream_count;
+
+/* Limits to how far to inflate ahead of sequential readers */
+#define GITFS_READAHEAD_MIN (1 << 20)
+#define GITFS_READAHEAD_MAX (64 << 20)
+
+/* Object type of non-delta blobs in packs */
+#define GITFS_PACK_BLOB 3
+
+/* Prepare b for inflating the blob with the given oid in the
+ * background, when it is stored as a whole (not as a delta) in one of
+ * the packs of o and is large enough. Returns whether it is, in which
+ * case b->size, b->data and b->stream are set and gitfs_stream_start
+ * must be called. */
+static bool gitfs_stream_open(gitfs_blob *b, struct gitfs_odb *o, const git_oid *oid, pid_t pid) {
+	unsigned char header[16];
+	struct gitfs_stream *s;
+	struct gitfs_pack *p;
+	uint64_t offset, size;
+	int64_t pos;
+	ssize_t len;
+	int shift, i;
+
+	if (!stream_size)
+		return false;
+
+	for (i = 0; i < (int)o->pack_count; i++) {
+		p = &o->packs[i];
+		if ((pos = gitfs_pack_find(p, oid)) >= 0)
+			break;
+	}
+	if (i == (int)o->pack_count)
+		return false;
+
+	/* Each object starts with its type and (variable length) size,
+	 * followed by its zlib-compressed data */
+	offset = gitfs_pack_offset(p, pos);
+	if ((len = pread(p->fd, header, sizeof(header), offset)) <= 0)
+		return false;
+	size = header[0] & 0x0f;
+	for (i = 0, shift = 4; header[i] & 0x80; shift += 7) {
+		if (++i == len || shift > 57)
+			return false;
+		size |= (uint64_t)(header[i] & 0x7f) << shift;
+	}
+
+	/* Deltas need their base, so those are left to libgit2 */
+	if ((header[0] >> 4 & 0x07) != GITFS_PACK_BLOB || size < stream_size || size > SIZE_MAX - 1)
+		return false;
+
+	if (__atomic_add_fetch(&stream_count, 1, __ATOMIC_RELAXED) > GITFS_STREAM_MAX) {
+		__atomic_sub_fetch(&stream_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	if (!(s = calloc(1, sizeof(*s)))) {
+		__atomic_sub_fetch(&stream_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	/* Allocate at least one byte, so data is never NULL */
+	if (!(b->data = malloc(size + 1)) || (s->fd = fcntl(p->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		free(b->data);
+		b->data = NULL;
+		free(s);
+		__atomic_sub_fetch(&stream_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->start = offset;
+	s->offset = offset + i + 1;
+	s->window = GITFS_READAHEAD_MIN;
+	s->pid = pid;
+	b->size = size;
+	b->stream = s;
+	return true;
+}
+
+/* Take b out of the cache, so it isn't found by new lookups. When
+ * unless_used is set, this is only done when no file uses b (the
+ * caller holding the only reference). Returns whether b was taken
+ * out. */
+static bool gitfs_stream_uncache(gitfs_blob *b, bool unless_used) {
+	bool retval = true;
+
+	pthread_mutex_lock(&blob_cache.lock);
+	if (unless_used && b->refcount > 1) {
+		retval = false;
+	} else if (!b->uncached) {
+		/* In use, so in the hot tier */
+		gitfs_blob_lru_unlink(&blob_cache.hot, b);
+		blob_cache.hot.size -= b->size;
+		gitfs_oid_table_remove(&blob_cache.blobs, b);
+		b->uncached = true;
+	}
+	pthread_mutex_unlock(&blob_cache.lock);
+	return retval;
+}
+
+void gitfs_blob_put(gitfs_blob *b);
+
+/* Close the pack of b, which is no longer inflated (or never started
+ * to be) in the background, giving its place to another blob */
+static void gitfs_stream_close(gitfs_blob *b) {
+	close(b->stream->fd);
+	b->stream->fd = -1;
+	__atomic_sub_fetch(&stream_count, 1, __ATOMIC_RELAXED);
+}
+
+/* Finish inflating b in the background, with retval being the result
+ * (negative on errors). Releases the reference the background thread
+ * held. */
+static void gitfs_stream_end(gitfs_blob *b, int retval) {
+	struct gitfs_stream *s = b->stream;
+
+	/* A failed blob shouldn't be found again, so the next open
+	 * tries again */
+	if (retval < 0 && retval != -ECANCELED)
+		gitfs_stream_uncache(b, false);
+
+	pthread_mutex_lock(&s->lock);
+	s->error = retval;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	if (retval == 0 && drop_pack_cache)
+		posix_fadvise(s->fd, s->start, s->offset - s->start, POSIX_FADV_DONTNEED);
+	gitfs_stream_close(b);
+	gitfs_blob_put(b);
+}
+
+/* Inflate the blob passed (whose stream is set up by gitfs_stream_open)
+ * from its pack, up to the target set by its readers. Inflating stops
+ * when the blob is no longer used by any file before it is complete,
+ * in which case it is taken out of the cache (since a partial blob is
+ * of no use to others), or when the blob is complete. */
+static void *gitfs_stream_main(void *data) {
+	gitfs_blob *b = data;
+	struct gitfs_stream *s = b->stream;
+	unsigned char in[GITFS_STREAM_CHUNK];
+	size_t available = 0, target, out;
+	z_stream z;
+	ssize_t len;
+	bool unused;
+	int retval = 0, ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) {
+		error("Failed to initialize zlib\n");
+		gitfs_stream_end(b, -ENOMEM);
+		return NULL;
+	}
+
+	while (available < b->size) {
+		pthread_mutex_lock(&s->lock);
+		while (s->available >= s->target && !s->unused)
+			pthread_cond_wait(&s->cond, &s->lock);
+		unused = s->unused;
+		s->unused = false;
+		target = s->target;
+		pthread_mutex_unlock(&s->lock);
+
+		if (unused && gitfs_stream_uncache(b, true)) {
+			retval = -ECANCELED;
+			break;
+		}
+		if (available >= target)
+			continue;
+
+		if (!z.avail_in) {
+			if ((len = pread(s->fd, in, sizeof(in), s->offset)) <= 0) {
+				error("Failed to read pack: %s\n", len ? strerror(errno) : "truncated");
+				retval = -EIO;
+				break;
+			}
+			s->offset += len;
+			z.next_in = in;
+			z.avail_in = len;
+		}
+
+		/* Don't hold readers up for too long */
+		out = b->size - available;
+		if (out > 4 * GITFS_STREAM_CHUNK)
+			out = 4 * GITFS_STREAM_CHUNK;
+		z.next_out = (unsigned char *)b->data + available;
+		z.avail_out = out;
+		ret = inflate(&z, Z_NO_FLUSH);
+		if ((ret != Z_OK && ret != Z_STREAM_END) ||
+		    (ret == Z_STREAM_END && available + out - z.avail_out != b->size)) {
+			error("Failed to inflate blob: %s\n", z.msg ? z.msg : "wrong size");
+			retval = -EIO;
+			break;
+		}
+		out -= z.avail_out;
+		available += out;
+		/* Adjust for the bytes of the next object read along */
+		if (ret == Z_STREAM_END)
+			s->offset -= z.avail_in;
+
+		/* Readers check for complete blobs without locking */
+		pthread_mutex_lock(&s->lock);
+		__atomic_store_n(&s->available, available, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		gitfs_stats_add(s->pid, 0, 0, 0, out);
+	}
+
+	inflateEnd(&z);
+	gitfs_stream_end(b, retval);
+	return NULL;
+}
+
+/* Start inflating b in the background, after gitfs_stream_open. The
+ * background thread takes over the extra reference gitfs_blob_get
+ * took for it. */
+static int gitfs_stream_start(gitfs_blob *b) {
+	pthread_attr_t attr;
+	pthread_t thread;
+	int retval;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	retval = pthread_create(&thread, &attr, gitfs_stream_main, b);
+	pthread_attr_destroy(&attr);
+	if (retval) {
+		gitfs_stream_end(b, -EAGAIN);
+		return error("Failed to start inflating blob: %s\n", strerror(retval)), -EAGAIN;
+	}
+	return 0;
+}
+
+/* Wait until the bytes from offset up to end of b are available, on
+ * behalf of a reader. When reading sequentially (next being where the
+ * previous read on the same file ended, NULL when unknown), the blob is
+ * inflated ahead of the reader, by a window that grows whenever the
+ * reader has to wait (it is faster than inflating) and shrinks when
+ * inflating ran idle ahead of it. */
+static int gitfs_stream_read(gitfs_blob *b, off_t *next, off_t offset, size_t end) {
+	struct gitfs_stream *s = b->stream;
+	bool sequential;
+	size_t target;
+	int retval;
+
+	if (end > b->size)
+		end = b->size;
+	if (!s || __atomic_load_n(&s->available, __ATOMIC_ACQUIRE) == b->size)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	/* The kernel might have several reads (of its own readahead)
+	 * in flight, so these don't arrive strictly in order */
+	sequential = next && offset + s->window >= *next && offset <= *next + s->window;
+	if (next)
+		*next = end;
+
+	target = end;
+	if (sequential) {
+		if (s->available < end && s->window < GITFS_READAHEAD_MAX)
+			s->window *= 2;
+		else if (s->available == s->target && s->window > GITFS_READAHEAD_MIN)
+			s->window /= 2;
+		target = end + s->window < b->size ? end + s->window : b->size;
+	}
+	if (target > s->target) {
+		s->target = target;
+		pthread_cond_broadcast(&s->cond);
+	}
+
+	while (s->available < end && !s->error)
+		pthread_cond_wait(&s->cond, &s->lock);
+	retval = s->available < end ? -EIO : 0;
+	pthread_mutex_unlock(&s->lock);
+	return retval;
+}
+
+/* Inflate the blob with the given oid from repo into b (see
+ * gitfs_blob_get) */
+static int gitfs_blob_inflate(gitfs_blob *b, struct gitfs_repo *repo, const git_oid *oid, pid_t pid) {
+	struct gitfs_odb *o;
+	git_odb_object *obj;
+	int retval;
+
+	/* Inflate without holding the lock, so other lookups
+	 * can continue in the meanwhile */
+	if (current_qos && current_qos->inflate) {
+		while (sem_wait(&current_qos->inflating) < 0 && errno == EINTR)
+			;
+	}
+	o = gitfs_odb_get(repo);
+	retval = git_odb_read(&obj, o->odb, oid);
+	if (retval == 0 && drop_pack_cache)
+		gitfs_odb_drop_cached(o, oid);
+	gitfs_odb_put(o);
+	if (current_qos && current_qos->inflate)
+		sem_post(&current_qos->inflating);
+	if (retval < 0)
+		return error("Blob not found?!: %s\n", giterr_last()->message), -EIO;
+	if (git_odb_object_type(obj) != GIT_OBJ_BLOB) {
+		git_odb_object_free(obj);
+		return error("Object is not a blob?!\n"), -EIO;
+	}
+
+	b->size = git_odb_object_size(obj);
+	/* Allocate at least one byte, so data is never NULL */
+	b->data = malloc(b->size + 1);
+	if (!b->data) {
+		git_odb_object_free(obj);
+		return error("Failed to allocate memory for blob\n"), -ENOMEM;
+	}
+	memcpy(b->data, git_odb_object_data(obj), b->size);
+	git_odb_object_free(obj);
+	gitfs_stats_add(pid, 0, 0, 0, b->size);
+
+	gitfs_shm_insert(oid, b->data, b->size);
+	return 0;
+}
+
+/* Find the blob with the given oid in the cache, or inflate it from
+ * repo and add it. pid is the process reading the blob (or 0 when
+ * unknown), see gitfs_scanner. The blob returned must be released with
+ * gitfs_blob_put. */
+int gitfs_blob_get(gitfs_blob **out, struct gitfs_repo *repo, const git_oid *oid, pid_t pid) {
+	gitfs_blob *b, *found;
+	struct gitfs_odb *o;
+	bool scanner, nocache, streamed;
+	int retval;
+
+	/* Classes that shouldn't affect the cache are treated like
+	 * scanners */
+	nocache = current_qos && !current_qos->cache;
+
+	pthread_mutex_lock(&blob_cache.lock);
+	if ((b = gitfs_oid_table_find(&blob_cache.blobs, oid))) {
+		scanner = nocache || gitfs_scanner(pid, false);
+		if (!scanner)
+			gitfs_sketch_add(oid);
+		retval = gitfs_blob_use(b, !scanner);
+		pthread_mutex_unlock(&blob_cache.lock);
+		if (retval == 0)
+			*out = b;
+		return retval;
+	}
+	scanner = nocache || gitfs_scanner(pid, true);
+	if (!scanner)
+		gitfs_sketch_add(oid);
+	blob_cache.misses++;
+	pthread_mutex_unlock(&blob_cache.lock);
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return error("Failed to allocate memory for blob\n"), -ENOMEM;
+
+	/* Maybe another process inflated it already. If not, large
+	 * blobs are inflated in the background, so they can be read
+	 * before being inflated completely. */
+	if (!gitfs_shm_lookup(oid, &b->data, &b->size)) {
+		o = gitfs_odb_get(repo);
+		streamed = gitfs_stream_open(b, o, oid, pid);
+		gitfs_odb_put(o);
+		if (!streamed && (retval = gitfs_blob_inflate(b, repo, oid, pid)) < 0) {
+			free(b);
+			return retval;
+		}
+	}
+	git_oid_cpy(&b->oid, oid);
+	/* The background thread inflating it holds a reference too */
+	b->refcount = b->stream ? 2 : 1;
+
+	pthread_mutex_lock(&blob_cache.lock);
+
+
+	/* Someone else might have added the same blob while we were
+	 * inflating it, in which case we use theirs */
+	if ((found = gitfs_oid_table_find(&blob_cache.blobs, oid))) {
+		retval = gitfs_blob_use(found, !scanner);
+		pthread_mutex_unlock(&blob_cache.lock);
+		if (b->stream)
+			gitfs_stream_close(b);
+		gitfs_blob_free(b);
+		if (retval == 0)
+			*out = found;
+		return retval;
+	}
+
+	if (scanner || !gitfs_blob_admit(oid, b->size)) {
+		blob_cache.uncached++;
+		pthread_mutex_unlock(&blob_cache.lock);
+		b->uncached = true;
+	} else if (gitfs_oid_table_add(&blob_cache.blobs, b) < 0) {
+		pthread_mutex_unlock(&blob_cache.lock);
+		if (b->stream)
+			gitfs_stream_close(b);
+		gitfs_blob_free(b);
+		return error("Failed to allocate memory for blob cache\n"), -ENOMEM;
+	} else {
+		gitfs_blob_lru_push(&blob_cache.hot, b);
+		blob_cache.hot.size += b->size;
+		pthread_mutex_unlock(&blob_cache.lock);
+		gitfs_blob_cache_shrink();
+	}
+
+	if (b->stream && (retval = gitfs_stream_start(b)) < 0) {
+		gitfs_blob_put(b);
+		return retval;
+	}
+	*out = b;
+	return 0;
+}
+
+/* Release a blob returned by gitfs_blob_get. It stays in the cache
+ * until evicted. */
+void gitfs_blob_put(gitfs_blob *b) {
+	bool unused, uncached;
+
+	pthread_mutex_lock(&blob_cache.lock);
+	unused = --b->refcount == 0;
+	/* Might change at any time while b is inflated in the background,
+	 * see gitfs_stream_uncache */
+	uncached = b->uncached;
+	/* When only the background thread inflating it is left, it
+	 * can stop. This is done with the lock held, since the thread
+	 * could otherwise free b when done in the meanwhile. */
+	if (b->stream && b->refcount == 1) {
+		pthread_mutex_lock(&b->stream->lock);
+		b->stream->unused = true;
+		pthread_cond_broadcast(&b->stream->cond);
+		pthread_mutex_unlock(&b->stream->lock);
+	}
+	pthread_mutex_unlock(&blob_cache.lock);
+
+	if (uncached) {
+		if (unused)
+			gitfs_blob_free(b);
+		return;
+	}
+	gitfs_blob_cache_shrink();
+}
+
+/* Set the total memory budget for cached objects */
+void gitfs_set_cache_size(size_t size) {
+	size_t blobs = size - size / 4;
+
+	/* Trees and commits are cached by libgit2, which needs much
+	 * less room than blob contents. A quarter of the room for blobs
+	 * holds compressed ones, which is often enough to keep several
+	 * times as many. */
+	pthread_mutex_lock(&blob_cache.lock);
+	blob_cache.cold.max_size = blobs / 4;
+	blob_cache.hot.max_size = blobs - blobs / 4;
+	pthread_mutex_unlock(&blob_cache.lock);
+	gitfs_blob_cache_shrink();
+	git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)(size / 4));
+}
+
+static struct gitfs_repo *repos;
+static pthread_mutex_t repos_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* inotify instance watching the pack directories of all repositories
+ * (-1 when not started yet, or not available) */
+static int pack_watch_fd = -1;
+
+/* How long to wait for a repack to finish (i.e. for the pack directory
+ * to be quiet) before switching to the new packs, in milliseconds */
+#define GITFS_REPACK_DELAY 500
+
+/* The priorities libgit2 uses for its default backends (packs are
+ * tried first) */
+#define GITFS_LOOSE_PRIORITY 1
+#define GITFS_PACKED_PRIORITY 2
+
+/* An alternate outside of the repository, and so outside of our
+ * chroot. libgit2 opens objects by path (and packs only on their first
+ * lookup), so its packs and objects directory are opened before
+ * chrooting instead, and shared by all instances of the object
+ * database. Packs added to it after mounting are not seen. */
+struct gitfs_outside {
+	char *objects_dir;
+	/* The objects directory, to read loose objects from */
+	int dir_fd;
+	/* Single pack backends, with their index and pack opened */
+	git_odb_backend **packs;
+	size_t pack_count;
+	unsigned refcount;
+};
+
+/* Wraps a gitfs_outside for a single instance of the object database,
+ * since libgit2 doesn't allow sharing backends between them */
+struct gitfs_outside_backend {
+	git_odb_backend parent;
+	struct gitfs_outside *a;
+};
+
+/* Read the loose object oid from the objects directory of a (just its
+ * type and size when data is NULL), the way git_odb_backend_loose
+ * would read it by path */
+static int gitfs_outside_loose_read(void **data, size_t *len, git_otype *type, git_odb_backend *backend,
+				    const git_oid *oid) {
+	struct gitfs_outside *a = ((struct gitfs_outside_backend *)backend)->a;
+	char path[GIT_OID_HEXSZ + 2], hdr[64], *space, *end;
+	unsigned long size;
+	unsigned char *map, *buf = NULL;
+	size_t copied;
+	struct stat st;
+	z_stream z;
+	int fd, ret;
+
+	git_oid_pathfmt(path, oid);
+	path[GIT_OID_HEXSZ + 1] = '\0';
+	if ((fd = openat(a->dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+		return GIT_ENOTFOUND;
+	if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return GIT_ENOTFOUND;
+	}
+	close(fd);
+
+	memset(&z, 0, sizeof(z));
+	z.next_in = map;
+	z.avail_in = st.st_size;
+	z.next_out = (unsigned char *)hdr;
+	z.avail_out = sizeof(hdr);
+	if (inflateInit(&z) != Z_OK) {
+		munmap(map, st.st_size);
+		return GIT_ENOTFOUND;
+	}
+	/* The header (e.g. "blob 123\0") comes first, possibly followed by
+	 * the start of the data */
+	do
+		ret = inflate(&z, Z_SYNC_FLUSH);
+	while (ret == Z_OK && z.avail_out && !memchr(hdr, '\0', sizeof(hdr) - z.avail_out));
+	if ((ret != Z_OK && ret != Z_STREAM_END) ||
+	    !(end = memchr(hdr, '\0', sizeof(hdr) - z.avail_out)) || !(space = memchr(hdr, ' ', end - hdr)))
+		goto corrupt;
+	*space = '\0';
+	*type = git_object_string2type(hdr);
+	size = strtoul(space + 1, &space, 10);
+	if (*type == GIT_OBJ_BAD || space != end)
+		goto corrupt;
+	*len = size;
+
+	if (data) {
+		/* NUL-terminated, like libgit2 does */
+		if (!(buf = git_odb_backend_malloc(backend, size + 1)))
+			goto err;
+		copied = sizeof(hdr) - z.avail_out - (end + 1 - hdr);
+		if (copied > size)
+			goto corrupt;
+		memcpy(buf, end + 1, copied);
+		z.next_out = buf + copied;
+		z.avail_out = size - copied;
+		while (ret == Z_OK && z.avail_out)
+			ret = inflate(&z, Z_SYNC_FLUSH);
+		if ((ret != Z_OK && ret != Z_STREAM_END) || z.avail_out)
+			goto corrupt;
+		buf[size] = '\0';
+		*data = buf;
+	}
+	inflateEnd(&z);
+	munmap(map, st.st_size);
+	return 0;
+
+corrupt:
+	error("%s/%s: Corrupt loose object\n", a->objects_dir, path);
+err:
+	free(buf);
+	inflateEnd(&z);
+	munmap(map, st.st_size);
+	return GIT_ENOTFOUND;
+}
+
+/* Find the loose object starting with prefix, or return GIT_EAMBIGUOUS
+ * when found is set and a different one matches as well */
+static int gitfs_outside_loose_find(git_oid *found, bool *any, struct gitfs_outside *a,
+				    const git_oid *prefix, size_t prefix_len) {
+	char name[3], hex[GIT_OID_HEXSZ + 1];
+	struct dirent *de;
+	git_oid oid;
+	DIR *dir;
+	int fd, retval = 0;
+
+	snprintf(name, sizeof(name), "%02x", prefix->id[0]);
+	if ((fd = openat(a->dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return 0;
+	if (!(dir = fdopendir(fd))) {
+		close(fd);
+		return 0;
+	}
+	while (retval == 0 && (de = readdir(dir))) {
+		if (strlen(de->d_name) != GIT_OID_HEXSZ - 2)
+			continue;
+		snprintf(hex, sizeof(hex), "%s%s", name, de->d_name);
+		if (git_oid_fromstr(&oid, hex) < 0 || git_oid_ncmp(&oid, prefix, prefix_len))
+			continue;
+		if (*any && !git_oid_equal(found, &oid))
+			retval = GIT_EAMBIGUOUS;
+		git_oid_cpy(found, &oid);
+		*any = true;
+	}
+	closedir(dir);
+	return retval;
+}
+
+static int gitfs_outside_read(void **data, size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid) {
+	struct gitfs_outside *a = ((struct gitfs_outside_backend *)backend)->a;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < a->pack_count; i++) {
+		if ((ret = a->packs[i]->read(data, len, type, a->packs[i], oid)) != GIT_ENOTFOUND)
+			return ret;
+	}
+	return gitfs_outside_loose_read(data, len, type, backend, oid);
+}
+
+static int gitfs_outside_read_header(size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid) {
+	struct gitfs_outside *a = ((struct gitfs_outside_backend *)backend)->a;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < a->pack_count; i++) {
+		if ((ret = a->packs[i]->read_header(len, type, a->packs[i], oid)) != GIT_ENOTFOUND)
+			return ret;
+	}
+	return gitfs_outside_loose_read(NULL, len, type, backend, oid);
+}
+
+static int gitfs_outside_exists(git_odb_backend *backend, const git_oid *oid) {
+	struct gitfs_outside *a = ((struct gitfs_outside_backend *)backend)->a;
+	char path[GIT_OID_HEXSZ + 2];
+	size_t i;
+
+	for (i = 0; i < a->pack_count; i++) {
+		if (a->packs[i]->exists(a->packs[i], oid))
+			return 1;
+	}
+	git_oid_pathfmt(path, oid);
+	path[GIT_OID_HEXSZ + 1] = '\0';
+	return faccessat(a->dir_fd, path, F_OK, 0) == 0;
+}
+
+static int gitfs_outside_exists_prefix(git_oid *out, git_odb_backend *backend, const git_oid *prefix, size_t prefix_len) {
+	struct gitfs_outside *a = ((struct gitfs_outside_backend *)backend)->a;
+	git_oid found, oid;
+	bool any = false;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < a->pack_count; i++) {
+		if ((ret = a->packs[i]->exists_prefix(&oid, a->packs[i], prefix, prefix_len)) == GIT_ENOTFOUND)
+			continue;
+		if (ret < 0)
+			return ret;
+		if (any && !git_oid_equal(&found, &oid))
+			return GIT_EAMBIGUOUS;
+		git_oid_cpy(&found, &oid);
+		any = true;
+	}
+	if ((ret = gitfs_outside_loose_find(&found, &any, a, prefix, prefix_len)) < 0)
+		return ret;
+	if (!any)
+		return GIT_ENOTFOUND;
+	git_oid_cpy(out, &found);
+	return 0;
+}
+
+static int gitfs_outside_read_prefix(git_oid *out, void **data, size_t *len, git_otype *type, git_odb_backend *backend,
+		const git_oid *prefix, size_t prefix_len) {
+	int ret;
+
+	if ((ret = gitfs_outside_exists_prefix(out, backend, prefix, prefix_len)) < 0)
+		return ret;
+	return gitfs_outside_read(data, len, type, backend, out);
+}
+
+static void gitfs_outside_put(struct gitfs_outside *a) {
+	size_t i;
+
+	if (__atomic_sub_fetch(&a->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+	for (i = 0; i < a->pack_count; i++)
+		a->packs[i]->free(a->packs[i]);
+	free(a->packs);
+	if (a->dir_fd >= 0)
+		close(a->dir_fd);
+	free(a->objects_dir);
+	free(a);
+}
+
+static void gitfs_outside_free(git_odb_backend *backend) {
+	struct gitfs_outside_backend *ob = (struct gitfs_outside_backend *)backend;
+
+	gitfs_outside_put(ob->a);
+	free(ob);
+}
+
+static int gitfs_outside_first_oid(const git_oid *oid, void *payload) {
+	git_oid_cpy(payload, oid);
+	/* Stop after the first one */
+	return 1;
+}
+
+/* Open the alternate objects_dir outside of the repository. This must
+ * happen before chrooting, after which only gitfs_outside_add can use
+ * it. Returns NULL on errors. */
+static struct gitfs_outside *gitfs_outside_open(const char *objects_dir) {
+	char path[PATH_MAX];
+	git_odb_backend *packed, **packs;
+	struct gitfs_outside *a;
+	struct dirent *de;
+	git_oid oid;
+	size_t len;
+	DIR *dir;
+
+	if (!(a = calloc(1, sizeof(*a))) || !(a->objects_dir = strdup(objects_dir))) {
+		free(a);
+		return error("Failed to allocate memory for alternate\n"), NULL;
+	}
+	a->refcount = 1;
+	if ((a->dir_fd = open(objects_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		error("%s: Failed to open alternate: %s\n", objects_dir, strerror(errno));
+		goto err;
+	}
+
+	snprintf(path, sizeof(path), "%s/pack", objects_dir);
+	if (!(dir = opendir(path))) {
+		if (errno == ENOENT)
+			return a;
+		error("Failed to list %s: %s\n", path, strerror(errno));
+		goto err;
+	}
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len <= 4 || strcmp(de->d_name + len - 4, ".idx"))
+			continue;
+		snprintf(path, sizeof(path), "%s/pack/%s", objects_dir, de->d_name);
+		/* Like libgit2, skip indexes without a pack (e.g. while
+		 * a pack is being written) */
+		if (git_odb_backend_one_pack(&packed, path) < 0) {
+			debug("%s: Skipping pack: %s\n", path, giterr_last()->message);
+			continue;
+		}
+		if (!(packs = realloc(a->packs, (a->pack_count + 1) * sizeof(*packs)))) {
+			packed->free(packed);
+			error("Failed to allocate memory for alternate\n");
+			closedir(dir);
+			goto err;
+		}
+		a->packs = packs;
+		a->packs[a->pack_count++] = packed;
+
+		/* Looking up an object opens both the index and the pack,
+		 * which stay open from then on */
+		memset(&oid, 0, sizeof(oid));
+		packed->foreach(packed, gitfs_outside_first_oid, &oid);
+		if (!git_oid_iszero(&oid) && !packed->exists(packed, &oid)) {
+			error("%s: Cannot open pack\n", path);
+			closedir(dir);
+			goto err;
+		}
+	}
+	closedir(dir);
+	debug("Opened %zu packs in %s\n", a->pack_count, objects_dir);
+	return a;
+
+err:
+	gitfs_outside_put(a);
+	return NULL;
+}
+
+/* Add a backend for the alternate a (opened with gitfs_outside_open) to
+ * odb */
+static int gitfs_outside_add(git_odb *odb, struct gitfs_outside *a) {
+	struct gitfs_outside_backend *ob;
+
+	if (!(ob = calloc(1, sizeof(*ob))))
+		return error("Failed to allocate memory for alternate\n"), -1;
+	ob->parent.version = GIT_ODB_BACKEND_VERSION;
+	ob->parent.read = gitfs_outside_read;
+	ob->parent.read_header = gitfs_outside_read_header;
+	ob->parent.read_prefix = gitfs_outside_read_prefix;
+	ob->parent.exists = gitfs_outside_exists;
+	ob->parent.exists_prefix = gitfs_outside_exists_prefix;
+	ob->parent.free = gitfs_outside_free;
+	ob->a = a;
+	__atomic_add_fetch(&a->refcount, 1, __ATOMIC_RELAXED);
+
+	if (git_odb_add_alternate(odb, &ob->parent, GITFS_PACKED_PRIORITY) < 0) {
+		gitfs_outside_free(&ob->parent);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Loose objects of an objects directory, indexed in memory. Lookups
+ * of objects that aren't loose (most of them, even when thousands of
+ * loose objects pile up between gcs) are then answered without probing
+ * the objects/xx directories. New objects are picked up through inotify
+ * whenever libgit2 refreshes the object database, which it does when an
+ * object isn't found anywhere. */
+struct gitfs_loose_object {
+	git_oid oid;
+	struct gitfs_loose_object *next;
+};
+
+struct gitfs_loose_backend {
+	git_odb_backend parent;
+	/* libgit2's loose backend, which reads the objects found */
+	git_odb_backend *loose;
+	char *objects_dir;
+	/* Protects everything below */
+	pthread_mutex_t lock;
+	/* Cleared when the index couldn't be kept up to date, all
+	 * lookups go to loose then */
+	bool indexed;
+	struct gitfs_oid_table objects;
+	/* Non-blocking inotify instance watching objects_dir (dir_wd)
+	 * and its fan-out directories (-1 for those that don't exist) */
+	int watch_fd;
+	int dir_wd;
+	int watches[256];
+};
+
+#define GITFS_LOOSE_EVENTS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+/* Must be called with lb->lock held */
+static int gitfs_loose_add(struct gitfs_loose_backend *lb, const git_oid *oid) {
+	struct gitfs_loose_object *l;
+
+	if (gitfs_oid_table_find(&lb->objects, oid))
+		return 0;
+
+	if (!(l = malloc(sizeof(*l))))
+		return error("Failed to allocate memory for loose object index\n"), -ENOMEM;
+	git_oid_cpy(&l->oid, oid);
+	if (gitfs_oid_table_add(&lb->objects, l) < 0) {
+		free(l);
+		return error("Failed to allocate memory for loose object index\n"), -ENOMEM;
+	}
+	return 0;
+}
+
+/* Must be called with lb->lock held */
+static void gitfs_loose_remove(struct gitfs_loose_backend *lb, const git_oid *oid) {
+	struct gitfs_loose_object *l = gitfs_oid_table_find(&lb->objects, oid);
+
+	if (l) {
+		gitfs_oid_table_remove(&lb->objects, l);
+		free(l);
+	}
+}
+
+static void gitfs_loose_clear(struct gitfs_loose_backend *lb) {
+	struct gitfs_loose_object *l, *next;
+	size_t i;
+
+	for (i = 0; i < lb->objects.bucket_count; i++) {
+		for (l = lb->objects.buckets[i]; l; l = next) {
+			next = l->next;
+			free(l);
+		}
+		lb->objects.buckets[i] = NULL;
+	}
+	lb->objects.count = 0;
+}
+
+/* Parse the oid of the loose object named name in fan-out directory
+ * fanout, returns -1 for other files (e.g. temporary ones) */
+static int gitfs_loose_oid(git_oid *oid, int fanout, const char *name) {
+	char hex[GIT_OID_HEXSZ];
+
+	if (strlen(name) != GIT_OID_HEXSZ - 2 || strspn(name, "0123456789abcdef") != GIT_OID_HEXSZ - 2)
+		return -1;
+	hex[0] = "0123456789abcdef"[fanout >> 4];
+	hex[1] = "0123456789abcdef"[fanout & 15];
+	memcpy(hex + 2, name, GIT_OID_HEXSZ - 2);
+	return git_oid_fromstrn(oid, hex, GIT_OID_HEXSZ);
+}
+
+/* Returns the fan-out directory named name, or -1 */
+static int gitfs_loose_fanout(const char *name) {
+	if (strlen(name) != 2 || strspn(name, "0123456789abcdef") != 2)
+		return -1;
+	return strtol(name, NULL, 16);
+}
+
+/* Add the objects in fan-out directory fanout to the index, watching it
+ * for changes first so no object added meanwhile is missed. Must be
+ * called with lb->lock held. */
+static int gitfs_loose_scan(struct gitfs_loose_backend *lb, int fanout) {
+	char path[PATH_MAX];
+	struct dirent *de;
+	git_oid oid;
+	DIR *dir;
+	int wd;
+
+	snprintf(path, sizeof(path), "%s/%02x", lb->objects_dir, fanout);
+	/* A directory that was removed and created again gets a new
+	 * watch */
+	if ((wd = inotify_add_watch(lb->watch_fd, path, GITFS_LOOSE_EVENTS)) < 0) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return 0;
+		return error("Failed to watch %s, not indexing loose objects: %s\n", path, strerror(errno)), -1;
+	}
+	lb->watches[fanout] = wd;
+
+	if (!(dir = opendir(path)))
+		return errno == ENOENT ? 0 : (error("Failed to list %s: %s\n", path, strerror(errno)), -1);
+	while ((de = readdir(dir))) {
+		if (gitfs_loose_oid(&oid, fanout, de->d_name) == 0 && gitfs_loose_add(lb, &oid) < 0) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+/* (Re)build the index of all loose objects. Must be called with
+ * lb->lock held. */
+static int gitfs_loose_index(struct gitfs_loose_backend *lb) {
+	int i;
+
+	gitfs_loose_clear(lb);
+	for (i = 0; i < 256; i++) {
+		if (gitfs_loose_scan(lb, i) < 0)
+			return -1;
+	}
+	debug("Indexed %zu loose objects in %s\n", lb->objects.count, lb->objects_dir);
+	return 0;
+}
+
+/* Apply the changes to the loose objects since the last call. Must be
+ * called with lb->lock held. */
+static void gitfs_loose_update(struct gitfs_loose_backend *lb) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	git_oid oid;
+	ssize_t len;
+	char *p;
+	int i;
+
+	while (lb->indexed && (len = read(lb->watch_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; lb->indexed && p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Changes were lost, so start over */
+				debug("Too many changes in %s, indexing loose objects again\n", lb->objects_dir);
+				lb->indexed = gitfs_loose_index(lb) == 0;
+			} else if (ev->wd == lb->dir_wd) {
+				if (ev->len && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && (i = gitfs_loose_fanout(ev->name)) >= 0)
+					lb->indexed = gitfs_loose_scan(lb, i) == 0;
+			} else {
+				for (i = 0; i < 256 && lb->watches[i] != ev->wd; i++)
+					;
+				if (i == 256)
+					continue;
+				if (ev->mask & IN_IGNORED)
+					lb->watches[i] = -1;
+				else if (ev->len && gitfs_loose_oid(&oid, i, ev->name) == 0) {
+					if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+						lb->indexed = gitfs_loose_add(lb, &oid) == 0;
+					else
+						gitfs_loose_remove(lb, &oid);
+				}
+			}
+		}
+	}
+}
+
+/* Returns whether oid might be a loose object */
+static bool gitfs_loose_has(struct gitfs_loose_backend *lb, const git_oid *oid) {
+	bool found;
+
+	pthread_mutex_lock(&lb->lock);
+	found = !lb->indexed || gitfs_oid_table_find(&lb->objects, oid);
+	pthread_mutex_unlock(&lb->lock);
+	return found;
+}
+
+static int gitfs_loose_read(void **data, size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	if (!gitfs_loose_has(lb, oid))
+		return GIT_ENOTFOUND;
+	return lb->loose->read(data, len, type, lb->loose, oid);
+}
+
+static int gitfs_loose_read_header(size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *oid) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	if (!gitfs_loose_has(lb, oid))
+		return GIT_ENOTFOUND;
+	return lb->loose->read_header(len, type, lb->loose, oid);
+}
+
+static int gitfs_loose_exists(git_odb_backend *backend, const git_oid *oid) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	return gitfs_loose_has(lb, oid) && lb->loose->exists(lb->loose, oid);
+}
+
+/* Abbreviated oids are rare (only when resolving revisions), so these
+ * just list the fan-out directory */
+static int gitfs_loose_read_prefix(git_oid *out, void **data, size_t *len, git_otype *type, git_odb_backend *backend,
+		const git_oid *prefix, size_t prefix_len) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	return lb->loose->read_prefix(out, data, len, type, lb->loose, prefix, prefix_len);
+}
+
+static int gitfs_loose_exists_prefix(git_oid *out, git_odb_backend *backend, const git_oid *prefix, size_t prefix_len) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	return lb->loose->exists_prefix(out, lb->loose, prefix, prefix_len);
+}
+
+static int gitfs_loose_foreach(git_odb_backend *backend, git_odb_foreach_cb cb, void *payload) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	return lb->loose->foreach(lb->loose, cb, payload);
+}
+
+static int gitfs_loose_refresh(git_odb_backend *backend) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	pthread_mutex_lock(&lb->lock);
+	gitfs_loose_update(lb);
+	pthread_mutex_unlock(&lb->lock);
+	return 0;
+}
+
+static void gitfs_loose_free(git_odb_backend *backend) {
+	struct gitfs_loose_backend *lb = (struct gitfs_loose_backend *)backend;
+
+	if (lb->loose)
+		lb->loose->free(lb->loose);
+	gitfs_loose_clear(lb);
+	if (lb->watch_fd >= 0)
+		close(lb->watch_fd);
+	pthread_mutex_destroy(&lb->lock);
+	free(lb->objects.buckets);
+	free(lb->objects_dir);
+	free(lb);
+}
+
+/* Open a backend for the loose objects in objects_dir, indexing them
+ * when possible */
+static int gitfs_loose_open(git_odb_backend **out, git_odb *odb, const char *objects_dir) {
+	struct gitfs_loose_backend *lb;
+	git_odb_backend *loose;
+
+	if (git_odb_backend_loose(&loose, objects_dir, -1, 0, 0, 0) < 0)
+		return -1;
+	loose->odb = odb;
+	*out = loose;
+
+	if (!(lb = calloc(1, sizeof(*lb)))) {
+		error("Failed to allocate memory for loose object index\n");
+		return 0;
+	}
+	lb->objects = (struct gitfs_oid_table)GITFS_OID_TABLE_INIT(struct gitfs_loose_object);
+	lb->parent.version = GIT_ODB_BACKEND_VERSION;
+	lb->parent.read = gitfs_loose_read;
+	lb->parent.read_header = gitfs_loose_read_header;
+	lb->parent.read_prefix = gitfs_loose_read_prefix;
+	lb->parent.exists = gitfs_loose_exists;
+	lb->parent.exists_prefix = gitfs_loose_exists_prefix;
+	lb->parent.foreach = gitfs_loose_foreach;
+	lb->parent.refresh = gitfs_loose_refresh;
+	lb->parent.free = gitfs_loose_free;
+	pthread_mutex_init(&lb->lock, NULL);
+	lb->watch_fd = -1;
+
+	/* Without the index, lookups just go to disk again */
+	if (!(lb->objects_dir = strdup(objects_dir))) {
+		error("Failed to allocate memory for loose object index\n");
+	} else if ((lb->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+		   (lb->dir_wd = inotify_add_watch(lb->watch_fd, objects_dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)) < 0) {
+		error("Failed to watch %s, not indexing loose objects: %s\n", objects_dir, strerror(errno));
+	} else if (gitfs_loose_index(lb) == 0) {
+		lb->loose = loose;
+		lb->indexed = true;
+		*out = &lb->parent;
+		return 0;
+	}
+	gitfs_loose_free(&lb->parent);
+	return 0;
+}
+
+static void gitfs_local_add_packs(git_odb *odb, const char *objects_dir, bool alternate);
+
+/* Add backends for the loose objects and packs in objects_dir to odb */
+static int gitfs_odb_add_objects(git_odb *odb, const char *objects_dir, bool alternate) {
+	int (*add)(git_odb *, git_odb_backend *, int) = alternate ? git_odb_add_alternate : git_odb_add_backend;
+	git_odb_backend *loose, *packed;
+
+	if (gitfs_loose_open(&loose, odb, objects_dir) < 0)
+		return -1;
+	if (add(odb, loose, GITFS_LOOSE_PRIORITY) < 0) {
+		loose->free(loose);
+		return -1;
+	}
+
+	if (git_odb_backend_pack(&packed, objects_dir) < 0)
+		return -1;
+	if (add(odb, packed, GITFS_PACKED_PRIORITY) < 0) {
+		packed->free(packed);
+		return -1;
+	}
+
+	gitfs_local_add_packs(odb, objects_dir, alternate);
+	return 0;
+}
+
+/* Open a repository with an explicit list of alternate object
+ * directories (and already opened ones in outside), without looking at
+ * objects/info/alternates (whose paths might not be valid inside our
+ * chroot). Only objects are needed after chrooting, so this just wraps
+ * an object database. */
+static int gitfs_odb_open_objects(struct gitfs_odb *o, const char *path, char *const *alternates,
+				  struct gitfs_outside *const *outside) {
+	char objects_dir[PATH_MAX];
+	git_odb *odb;
+
+	snprintf(objects_dir, sizeof(objects_dir), "%s/objects", strcmp(path, "/") ? path : "");
+
+	if (git_odb_new(&odb) < 0)
+		return -1;
+
+	if (gitfs_odb_add_objects(odb, objects_dir, false) < 0)
+		goto err;
+	for (; *alternates; alternates++) {
+		debug("using alternate %s\n", *alternates);
+		if (gitfs_odb_add_objects(odb, *alternates, true) < 0)
+			goto err;
+	}
+	for (; outside && *outside; outside++) {
+		debug("using alternate %s (opened before chrooting)\n", (*outside)->objects_dir);
+		if (gitfs_outside_add(odb, *outside) < 0)
+			goto err;
+	}
+
+	if (git_repository_wrap_odb(&o->repo, odb) < 0)
+		goto err;
+	o->odb = odb;
+	return 0;
+
+err:
+	git_odb_free(odb);
+	return -1;
+}
+
+/* Open the single pack at path as an object database, without any
+ * repository (so no discovery, config or refs): just its index */
+static int gitfs_odb_open_pack(struct gitfs_odb *o, const char *path) {
+	char idx_path[PATH_MAX];
+	git_odb_backend *packed;
+	size_t len = strlen(path);
+	git_odb *odb;
+
+	if (len <= 5 || strcmp(path + len - 5, ".pack"))
+		return error("%s: Not a pack\n", path), -1;
+	snprintf(idx_path, sizeof(idx_path), "%.*s.idx", (int)(len - 5), path);
+	/* libgit2 only opens the index on the first lookup */
+	if (access(idx_path, R_OK) < 0)
+		return error("%s: Cannot open pack index (create it with git index-pack): %s\n", idx_path,
+			     strerror(errno)), -1;
+
+	if (git_odb_new(&odb) < 0)
+		return error("Cannot open pack: %s\n", giterr_last()->message), -1;
+	if (git_odb_backend_one_pack(&packed, idx_path) < 0) {
+		error("Cannot open pack: %s\n", giterr_last()->message);
+		goto err;
+	}
+	if (git_odb_add_backend(odb, packed, GITFS_PACKED_PRIORITY) < 0) {
+		error("Cannot open pack: %s\n", giterr_last()->message);
+		packed->free(packed);
+		goto err;
+	}
+	if (git_repository_wrap_odb(&o->repo, odb) < 0) {
+		error("Cannot open pack: %s\n", giterr_last()->message);
+		goto err;
+	}
+	o->odb = odb;
+
+	/* Our own view of it, see gitfs_odb_open */
+	gitfs_pack_open(o, idx_path);
+	return 0;
+
+err:
+	git_odb_free(odb);
+	return -1;
+}
+
+/* Call fn for every objects directory used by r, opened as repo */
+static void gitfs_objects_dirs(struct gitfs_repo *r, git_repository *repo,
+			       void (*fn)(void *data, const char *objects_dir), void *data) {
+	char objects_dir[PATH_MAX];
+	char **alternate;
+
+	/* A single pack is not in any (and never changes) */
+	if (r->pack)
+		return;
+
+	if (r->alternates) {
+		snprintf(objects_dir, sizeof(objects_dir), "%s/objects", strcmp(r->path, "/") ? r->path : "");
+		fn(data, objects_dir);
+		for (alternate = r->alternates; *alternate; alternate++)
+			fn(data, *alternate);
+	} else {
+		/* Alternates are handled by libgit2 here, so only the
+		 * repository itself is known (git_repository_path
+		 * includes a trailing slash) */
+		snprintf(objects_dir, sizeof(objects_dir), "%sobjects", git_repository_path(repo));
+		fn(data, objects_dir);
+	}
+}
+
+/* Open a new instance of the object database of r, which picks up
+ * the packs currently in the repository */
+static struct gitfs_odb *gitfs_odb_open(struct gitfs_repo *r) {
+	struct gitfs_odb *o = calloc(1, sizeof(*o));
+
+	if (!o)
+		return error("Failed to allocate memory for repository\n"), NULL;
+
+	if (r->pack) {
+		if (gitfs_odb_open_pack(o, r->path) < 0)
+			goto err;
+	} else if (r->alternates) {
+		if (gitfs_odb_open_objects(o, r->path, r->alternates, r->outside) < 0) {
+			error("Cannot open git repository: %s\n", giterr_last()->message);
+			goto err;
+		}
+	} else if (git_repository_open(&o->repo, r->path) < 0) {
+		error("Cannot open git repository: %s\n", giterr_last()->message);
+		goto err;
+	} else if (git_repository_odb(&o->odb, o->repo) < 0) {
+		error("Cannot open object database: %s\n", giterr_last()->message);
+		goto err;
+	}
+
+	/* Our own view of the packs, to find where objects are stored
+	 * (for drop-pack-cache and gitfs_stream_open) */
+	pthread_mutex_init(&o->packs_lock, NULL);
+	gitfs_objects_dirs(r, o->repo, gitfs_odb_load_packs, o);
+
+	o->refcount = 1;
+	return o;
+
+err:
+	if (o->odb) git_odb_free(o->odb);
+	if (o->repo) git_repository_free(o->repo);
+	free(o);
+	return NULL;
+}
+
+/* Returns whether name is the name of a pack or pack index */
+static bool gitfs_is_pack_file(const char *name) {
+	size_t len = strlen(name);
+
+	return (len > 5 && !strcmp(name + len - 5, ".pack")) ||
+	       (len > 4 && !strcmp(name + len - 4, ".idx"));
+}
+
+void gitfs_repo_close(struct gitfs_repo *r);
+
+/* Replace the object database instances of all repositories whose
+ * packs changed. Entries still using the old instance keep it alive,
+ * so its packs are only unmapped once they are all released. */
+static void gitfs_repos_refresh() {
+	struct gitfs_repo *r;
+	struct gitfs_odb *o, *old;
+
+	while (1) {
+		pthread_mutex_lock(&repos_lock);
+		for (r = repos; r && !r->packs_changed; r = r->next)
+			;
+		if (r) {
+			r->packs_changed = false;
+			r->refcount++;
+		}
+		pthread_mutex_unlock(&repos_lock);
+
+		if (!r)
+			return;
+
+		debug("packs of %s changed, reopening\n", r->path);
+		/* On failure, just keep using the old packs */
+		if ((o = gitfs_odb_open(r))) {
+			pthread_mutex_lock(&r->lock);
+			old = r->current;
+			r->current = o;
+			pthread_mutex_unlock(&r->lock);
+			gitfs_odb_put(old);
+		}
+		gitfs_repo_close(r);
+	}
+}
+
+/* Thread that waits for changes in the pack directories */
+static void *gitfs_watch_main(void *data) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = pack_watch_fd, .events = POLLIN };
+	struct inotify_event *ev;
+	struct gitfs_repo *r;
+	bool changed = false;
+	ssize_t len;
+	size_t i;
+	char *p;
+	int n;
+
+	while (1) {
+		/* A repack adds and removes several files, so wait until
+		 * things have been quiet for a bit before reopening */
+		n = poll(&pfd, 1, changed ? GITFS_REPACK_DELAY : -1);
+		if (n < 0 && errno != EINTR) {
+			error("Failed to wait for pack changes: %s\n", strerror(errno));
+			return NULL;
+		}
+		if (n == 0) {
+			changed = false;
+			gitfs_repos_refresh();
+			continue;
+		}
+		if (n < 0 || (len = read(pack_watch_fd, buf, sizeof(buf))) <= 0)
+			continue;
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (!ev->len || !gitfs_is_pack_file(ev->name))
+				continue;
+
+			/* The same directory can be watched for multiple
+			 * repositories (e.g. a shared alternate) */
+			pthread_mutex_lock(&repos_lock);
+			for (r = repos; r; r = r->next) {
+				for (i = 0; i < r->watch_count; i++) {
+					if (r->watches[i] == ev->wd)
+						r->packs_changed = true;
+				}
+			}
+			pthread_mutex_unlock(&repos_lock);
+			changed = true;
+		}
+	}
+	return NULL;
+}
+
+/* Start watching for pack changes, if not done yet. Must be called
+ * with repos_lock held. */
+static void gitfs_watch_start() {
+	pthread_t thread;
+	sigset_t all, old;
+
+	if (pack_watch_fd >= 0)
+		return;
+
+	if ((pack_watch_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		error("Failed to start watching for repacks: %s\n", strerror(errno));
+		return;
+	}
+
+	/* Signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&thread, NULL, gitfs_watch_main, NULL) != 0) {
+		error("Failed to start watching for repacks\n");
+		close(pack_watch_fd);
+		pack_watch_fd = -1;
+	} else {
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Watch the pack directory inside objects_dir for changes, for the
+ * gitfs_repo in data. Must be called with repos_lock held. */
+static void gitfs_repo_watch(void *data, const char *objects_dir) {
+	struct gitfs_repo *r = data;
+	char path[PATH_MAX];
+	int wd, *watches;
+
+	snprintf(path, sizeof(path), "%s/pack", objects_dir);
+	wd = inotify_add_watch(pack_watch_fd, path, IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR);
+	if (wd < 0) {
+		error("Failed to watch %s, repacks will go unnoticed: %s\n", path, strerror(errno));
+		return;
+	}
+
+	watches = realloc(r->watches, (r->watch_count + 1) * sizeof(*watches));
+	if (!watches) {
+		error("Failed to allocate memory for watch\n");
+		return;
+	}
+	r->watches = watches;
+	r->watches[r->watch_count++] = wd;
+}
+
+/* Watch all pack directories used by r. Must be called with
+ * repos_lock held. */
+static void gitfs_repo_watch_packs(struct gitfs_repo *r) {
+	gitfs_watch_start();
+	if (pack_watch_fd >= 0)
+		gitfs_objects_dirs(r, r->current->repo, gitfs_repo_watch, r);
+}
+
+/* Stop watching the pack directories of r, except the ones still
+ * watched for other repositories. Must be called with repos_lock
+ * held, after removing r from repos. */
+static void gitfs_repo_unwatch(struct gitfs_repo *r) {
+	struct gitfs_repo *other;
+	size_t i, j;
+
+	for (i = 0; i < r->watch_count; i++) {
+		for (other = repos; other; other = other->next) {
+			for (j = 0; j < other->watch_count; j++) {
+				if (other->watches[j] == r->watches[i])
+					break;
+			}
+			if (j < other->watch_count)
+				break;
+		}
+		if (!other)
+			inotify_rm_watch(pack_watch_fd, r->watches[i]);
+	}
+}
+
+static void gitfs_repo_free(struct gitfs_repo *r) {
+	struct gitfs_outside **outside;
+	char **alternate;
+
+	if (r->current)
+		gitfs_odb_put(r->current);
+	if (r->alternates) {
+		for (alternate = r->alternates; *alternate; alternate++)
+			free(*alternate);
+		free(r->alternates);
+	}
+	if (r->outside) {
+		for (outside = r->outside; *outside; outside++)
+			gitfs_outside_put(*outside);
+		free(r->outside);
+	}
+	pthread_mutex_destroy(&r->lock);
+	free(r->watches);
+	free(r->path);
+	free(r);
+}
+
+/* Open the repository at path, or return the already opened one. The
+ * repository must be released with gitfs_repo_close. When alternates
+ * is not NULL, it lists the alternate object directories to use
+ * instead of the ones configured in the repository, and outside (when
+ * not NULL) lists more of them, opened with gitfs_outside_open. */
+struct gitfs_repo *gitfs_repo_open(const char *path, const char *const *alternates,
+				   struct gitfs_outside *const *outside) {
+	struct gitfs_repo *r;
+	size_t i, count = 0;
+	struct stat st;
+
+	pthread_mutex_lock(&repos_lock);
+	for (r = repos; r; r = r->next) {
+		if (!strcmp(r->path, path)) {
+			r->refcount++;
+			goto out;
+		}
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		error("Failed to allocate memory for repository\n");
+		goto out;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+
+	/* Keep our own copies, to reopen the repository after a
+	 * repack */
+	if (alternates) {
+		while (alternates[count])
+			count++;
+		if (!(r->alternates = calloc(count + 1, sizeof(*r->alternates))))
+			goto nomem;
+		for (i = 0; i < count; i++) {
+			if (!(r->alternates[i] = strdup(alternates[i])))
+				goto nomem;
+		}
+	}
+	if (outside) {
+		for (count = 0; outside[count]; count++)
+			;
+		if (!(r->outside = calloc(count + 1, sizeof(*r->outside))))
+			goto nomem;
+		for (i = 0; i < count; i++) {
+			r->outside[i] = outside[i];
+			__atomic_add_fetch(&outside[i]->refcount, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (!(r->path = strdup(path)))
+		goto nomem;
+	r->pack = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+
+	if (!(r->current = gitfs_odb_open(r)))
+		goto err;
+
+	if (!r->pack)
+		gitfs_repo_watch_packs(r);
+
+	r->refcount = 1;
+	r->next = repos;
+	repos = r;
+out:
+	pthread_mutex_unlock(&repos_lock);
+	return r;
+
+nomem:
+	error("Failed to allocate memory for repository\n");
+err:
+	gitfs_repo_free(r);
+	pthread_mutex_unlock(&repos_lock);
+	return NULL;
+}
+
+void gitfs_repo_close(struct gitfs_repo *r) {
+	struct gitfs_repo **p;
+
+	pthread_mutex_lock(&repos_lock);
+	if (--r->refcount == 0) {
+		for (p = &repos; *p != r; p = &(*p)->next)
+			;
+		*p = r->next;
+
+		gitfs_repo_unwatch(r);
+		gitfs_repo_free(r);
+	}
+	pthread_mutex_unlock(&repos_lock);
+}
+
+void gitfs_search_put(struct gitfs_search_result *r);
+
+void gitfs_entry_free(gitfs_entry *e) {
+	switch (e->type) {
+		case GITFS_DIR:
+			git_tree_free(e->object.tree);
+			if (e->odb)
+				gitfs_odb_put(e->odb);
+			break;
+		case GITFS_FILE:
+			git_tree_entry_free(e->tree_entry);
+			if (e->object.blob)
+				gitfs_blob_put(e->object.blob);
+			break;
+		case GITFS_OID:
+			/* Don't free GITFS_OID entries, they're statically
+			 * allocated in gitfs_data. The contents stored in them
+			 * will be explicitely freed by gitfs_destroy. */
+			return;
+		case GITFS_STATS:
+		case GITFS_FIND:
+		case GITFS_MANIFEST:
+			free(e->object.text.data);
+			break;
+		case GITFS_SEARCH:
+			if (e->object.search.result)
+				gitfs_search_put(e->object.search.result);
+			free(e->object.search.prefix);
+			break;
+	}
+
+	free(e);
+}
+
+int gitfs_lookup_oid_entry(gitfs_entry **out, const char *path) {
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+	int i;
+	for (i = 0; i < d->oid_entry_count; i++) {
+		if (!strcmp(path, d->oid_paths[i])) {
+			*out = &d->oid_entries[i];
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+int gitfs_lookup_git_entry(gitfs_entry **out, const char *path) {
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+	git_tree_entry *tree_entry = NULL;
+	git_tree *root = NULL;
+	int retval = 0;
+
+	/* Trees are looked up in the current object database instance
+	 * (which changes after a repack) and keep it alive. The root
+	 * tree is usually still cached by libgit2, so looking it up
+	 * every time is cheap. */
+	struct gitfs_odb *o = gitfs_odb_get(d->repo);
+
+	gitfs_entry *e = *out = calloc(1, sizeof(gitfs_entry));
+	if (!e) {
+		error("Failed to allocate memory for entry: '%s'\n", path);
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	if (git_tree_lookup(&root, o->repo, &d->tree_oid) < 0) {
+		error("Failed to lookup root tree: %s\n", giterr_last()->message);
+		retval = -EIO;
+		goto out;
+	}
+
+	if (path[0] == '/' && path[1] == '\0') {
+		/* We can't use git_tree_entry_bypath for the root path,
+		 * so short circuit here. Also set out to 0 to signal
+		 * this special case (there exists no git_tree_entry for
+		 * the root path since the root path is not an entry in
+		 * any other tree). */
+		e->type = GITFS_DIR;
+		e->object.tree = root;
+		e->odb = o;
+		return 0;
+	}
+
+	/* Fill e->tree_entry */
+	if (git_tree_entry_bypath(&tree_entry, root, path + 1) < 0) {
+		retval = -ENOENT;
+		goto out;
+	}
+
+	/* Fill e->type */
+	switch(git_tree_entry_type(tree_entry)) {
+		case GIT_OBJ_TREE:
+			/* Lookup the corresponding git_tree object and
+			 * store it into e->object */
+			if (git_tree_entry_to_object((git_object**)&e->object.tree, o->repo, tree_entry) < 0) {
+				error("Tree not found?!: '%s'\n", path);
+				retval = -EIO;
+				goto out;
+			}
+			e->type = GITFS_DIR;
+			e->odb = o;
+			o = NULL;
+			break;
+
+		case GIT_OBJ_BLOB:
+			/* Don't load the blob contents yet, since most
+			 * lookups (e.g. getattr) don't need them. See
+			 * gitfs_entry_load_blob. */
+			e->type = GITFS_FILE;
+			e->tree_entry = tree_entry;
+			tree_entry = NULL;
+			break;
+
+		case GIT_OBJ_COMMIT:
+			debug("Ignoring submodule entry: '%s'\n", path);
+			retval = -ENOENT;
+			goto out;
+
+		default:
+			debug("Ignoring unknown entry: '%s'\n", path);
+			retval = -ENOENT;
+			goto out;
+	}
+out:
+	if (retval < 0 && e) {
+		gitfs_entry_free(e);
+		*out = 0;
+	}
+	git_tree_entry_free(tree_entry);
+	git_tree_free(root);
+	if (o)
+		gitfs_odb_put(o);
+
+	return retval;
+}
+
+/* The path of the magic statistics file. It's not listed by readdir,
+ * so walks over the tree don't read it. */
+#define GITFS_STATS_PATH "/.git-fs-stats"
+
+int gitfs_lookup_stats_entry(gitfs_entry **out, const char *path) {
+	if (!stats.enabled || strcmp(path, GITFS_STATS_PATH))
+		return -ENOENT;
+
+	if (!(*out = calloc(1, sizeof(gitfs_entry))))
+		return error("Failed to allocate memory for entry: '%s'\n", path), -ENOMEM;
+	(*out)->type = GITFS_STATS;
+	return 0;
+}
+
+/* Background tasks, such as building the search index (see
+ * gitfs_search_main), computing digests (see gitfs_digest_main) and
+ * tree sizes (see gitfs_tree_size_run).
+ * All of them run on a single process-wide pool of threads, which run
+ * with idle cpu and io priority, so the kernel only gives them what
+ * requests leave unused. On top of that, tasks call gitfs_task_yield
+ * regularly, which waits while any request is being processed, and
+ * keeps each thread within background_cpu percent of a cpu. */
+
+/* Task priorities. Indexes come first, since queries wait for them,
+ * then tree sizes, which are small and asked for by users. */
+#define GITFS_TASK_INDEX 0
+#define GITFS_TASK_SIZE 1
+#define GITFS_TASK_DIGEST 2
+#define GITFS_TASK_LOCAL_CACHE 3
+#define GITFS_TASK_PRIORITIES 4
+
+/* From linux/ioprio.h, which isn't always installed */
+#define GITFS_IOPRIO_WHO_PROCESS 1
+#define GITFS_IOPRIO_CLASS_IDLE (3 << 13)
+
+/* Length of the window over which background_cpu is enforced */
+#define GITFS_TASK_WINDOW_NS 100000000ULL
+/* Longest a task sleeps at a time to stay within background_cpu,
+ * before checking whether it should stop */
+#define GITFS_TASK_SLICE_NS 10000000ULL
+
+static struct {
+	pthread_mutex_t lock;
+	/* Signaled when a task is queued, and when one finishes */
+	pthread_cond_t cond;
+	/* Queued tasks, first in first out per priority */
+	struct gitfs_task *head[GITFS_TASK_PRIORITIES], *tail[GITFS_TASK_PRIORITIES];
+	/* Number of threads to run tasks on (0 means a quarter of the
+	 * available cpus), and whether they were started */
+	unsigned threads;
+	bool started;
+	/* Percentage of a cpu each thread may use (100 for no limit) */
+	unsigned cpu;
+	/* Number of requests being processed, see gitfs_worker_main,
+	 * and of tasks waiting for it to drop to 0 */
+	unsigned foreground, waiting;
+	/* Signaled when foreground drops to 0 with tasks waiting, and
+	 * when a task is cancelled */
+	pthread_cond_t idle;
+} tasks = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.cpu = 100,
+};
+
+/* Start of the current window of gitfs_task_yield, in wall-clock and
+ * cpu time of this thread */
+static __thread uint64_t task_window_start, task_window_cpu;
+
+static uint64_t gitfs_clock_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called by tasks between units of work (e.g. each file). Waits while
+ * requests are being processed, and while this thread used more than
+ * its share of cpu time. Stops waiting when *stop is set, since the
+ * task might be cancelled from a request (stop is NULL for tasks that
+ * are never cancelled). */
+static void gitfs_task_yield(const bool *stop) {
+	uint64_t now, elapsed, used, wait;
+	struct timespec ts;
+
+	/* Requests are counted without taking the lock, so waiting
+	 * must be visible to them before foreground is checked, see
+	 * gitfs_task_foreground_done */
+	if (__atomic_load_n(&tasks.foreground, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&tasks.lock);
+		__atomic_add_fetch(&tasks.waiting, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&tasks.foreground, __ATOMIC_SEQ_CST) && !(stop && __atomic_load_n(stop, __ATOMIC_RELAXED)))
+			pthread_cond_wait(&tasks.idle, &tasks.lock);
+		__atomic_sub_fetch(&tasks.waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&tasks.lock);
+	}
+
+	if (tasks.cpu >= 100)
+		return;
+	now = gitfs_clock_ns(CLOCK_MONOTONIC);
+	elapsed = now - task_window_start;
+	used = gitfs_clock_ns(CLOCK_THREAD_CPUTIME_ID) - task_window_cpu;
+	if (used * 100 > elapsed * tasks.cpu) {
+		/* Sleep until the cpu time used is within the share
+		 * again, in slices so that a cancelled task doesn't
+		 * keep the request cancelling it waiting */
+		wait = used * 100 / tasks.cpu - elapsed;
+		while (wait && !(stop && __atomic_load_n(stop, __ATOMIC_RELAXED))) {
+			ts.tv_sec = 0;
+			ts.tv_nsec = wait < GITFS_TASK_SLICE_NS ? wait : GITFS_TASK_SLICE_NS;
+			nanosleep(&ts, NULL);
+			wait -= ts.tv_nsec;
+		}
+		now = gitfs_clock_ns(CLOCK_MONOTONIC);
+	}
+	if (now - task_window_start >= GITFS_TASK_WINDOW_NS) {
+		task_window_start = now;
+		task_window_cpu += used;
+	}
+}
+
+/* Called by gitfs_worker_main when done with a request, to let
+ * waiting tasks go on once no requests are left */
+static void gitfs_task_foreground_done() {
+	if (__atomic_sub_fetch(&tasks.foreground, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&tasks.waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&tasks.lock);
+		pthread_cond_broadcast(&tasks.idle);
+		pthread_mutex_unlock(&tasks.lock);
+	}
+}
+
+static void *gitfs_task_main(void *data) {
+	struct sched_param param = { .sched_priority = 0 };
+	struct gitfs_task *task;
+	int i;
+
+	/* Only run when the cpu would be idle otherwise, or at least
+	 * at the lowest priority, and only do io when the disk would
+	 * be idle otherwise */
+	if (sched_setscheduler(0, SCHED_IDLE, &param) < 0)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	syscall(SYS_ioprio_set, GITFS_IOPRIO_WHO_PROCESS, 0, GITFS_IOPRIO_CLASS_IDLE);
+
+	pthread_mutex_lock(&tasks.lock);
+	while (true) {
+		for (i = 0; i < GITFS_TASK_PRIORITIES && !tasks.head[i]; i++)
+			;
+		if (i == GITFS_TASK_PRIORITIES) {
+			pthread_cond_wait(&tasks.cond, &tasks.lock);
+			continue;
+		}
+		task = tasks.head[i];
+		if (!(tasks.head[i] = task->next))
+			tasks.tail[i] = NULL;
+		task->queued = false;
+		task->running = true;
+		pthread_mutex_unlock(&tasks.lock);
+
+		task_window_start = gitfs_clock_ns(CLOCK_MONOTONIC);
+		task_window_cpu = gitfs_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		task->run(task->data);
+
+		pthread_mutex_lock(&tasks.lock);
+		task->running = false;
+		pthread_cond_broadcast(&tasks.cond);
+	}
+	return NULL;
+}
+
+static unsigned gitfs_cpu_count();
+
+/* Queue task, to run run(data) on a background thread. The task must
+ * stay valid until it finished, see gitfs_task_cancel. */
+static int gitfs_task_submit(struct gitfs_task *task, void (*run)(void *), void *data, int priority) {
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	unsigned i, started = 0;
+	int retval = 0;
+
+	pthread_mutex_lock(&tasks.lock);
+	if (!tasks.started) {
+		if (!tasks.threads)
+			tasks.threads = gitfs_cpu_count() / 4 ? gitfs_cpu_count() / 4 : 1;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		/* Signals are handled by the main thread */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		for (i = 0; i < tasks.threads; i++) {
+			if ((retval = pthread_create(&thread, &attr, gitfs_task_main, NULL)) == 0)
+				started++;
+		}
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		pthread_attr_destroy(&attr);
+		/* Fewer threads is fine, none is not */
+		if (!started) {
+			pthread_mutex_unlock(&tasks.lock);
+			return error("Failed to start background threads: %s\n", strerror(retval)), -retval;
+		}
+		tasks.started = true;
+	}
+
+	task->run = run;
+	task->data = data;
+	task->priority = priority;
+	task->queued = true;
+	task->next = NULL;
+	if (tasks.tail[priority])
+		tasks.tail[priority]->next = task;
+	else
+		tasks.head[priority] = task;
+	tasks.tail[priority] = task;
+	pthread_cond_broadcast(&tasks.cond);
+	pthread_mutex_unlock(&tasks.lock);
+	return 0;
+}
+
+/* Make sure task is not queued or running anymore: remove it from the
+ * queue, or wait for it to finish. A running task must be told to stop
+ * (if needed) before. */
+static void gitfs_task_cancel(struct gitfs_task *task) {
+	struct gitfs_task **p;
+
+	pthread_mutex_lock(&tasks.lock);
+	if (task->queued) {
+		for (p = &tasks.head[task->priority]; *p != task; p = &(*p)->next)
+			;
+		*p = task->next;
+		if (tasks.tail[task->priority] == task) {
+			/* Find the new last task, if any */
+			for (tasks.tail[task->priority] = tasks.head[task->priority];
+			     tasks.tail[task->priority] && tasks.tail[task->priority]->next;
+			     tasks.tail[task->priority] = tasks.tail[task->priority]->next)
+				;
+		}
+		task->queued = false;
+	}
+	/* Wake it up if it's waiting in gitfs_task_yield, so it sees it
+	 * must stop */
+	pthread_cond_broadcast(&tasks.idle);
+	while (task->running)
+		pthread_cond_wait(&tasks.cond, &tasks.lock);
+	pthread_mutex_unlock(&tasks.lock);
+}
+
+/* Local pack cache. With the local-cache option, the packs of the
+ * repository (and its alternates) are copied to a local directory in
+ * the background, and used from there once complete, so later reads
+ * and mounts don't need the storage the repository lives on (e.g. NFS
+ * or USB). Copies are used by libgit2, through a backend for each that
+ * is tried before the original packs, and by gitfs_stream_open. Packs
+ * end with their checksum, so a copy is only made when its contents
+ * match it, and only used while it matches the one of the original.
+ * When the copies would get too big, the ones used least recently are
+ * removed, unless still in use. */
+
+/* Tried before libgit2's own backends, see GITFS_PACKED_PRIORITY */
+#define GITFS_LOCAL_PRIORITY 3
+
+/* The amount of data copied at once */
+#define GITFS_LOCAL_CHUNK (1 << 20)
+
+struct gitfs_local_copy {
+	struct gitfs_task task;
+	/* The pack directory of the original, and the name of the pack
+	 * (without extension) */
+	char *pack_dir;
+	char *name;
+	/* Whether it was copied (or tried to), and whether the copy was
+	 * handed to libgit2 or gitfs_pack_open, see gitfs_local_in_use */
+	bool submitted, used;
+	struct gitfs_local_copy *next;
+};
+
+static struct {
+	/* The directory holding the copies, opened before chrooting (-1
+	 * when not used) */
+	int dir_fd;
+	/* Its path, for libgit2 and gitfs_pack_open (which only open
+	 * files by path): "." after chrooting, see gitfs_init */
+	char *path;
+	/* The size of all copies together to stay below (0 for no
+	 * limit) */
+	uint64_t max_size;
+	pthread_mutex_t lock;
+	/* The packs copied (or tried to) or used since starting, so
+	 * each is only copied once */
+	struct gitfs_local_copy *copies;
+} local_cache = {
+	.dir_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Copies are never cancelled */
+static const bool local_copy_stop = false;
+
+/* Read the checksum at the end of the pack (or pack index) at path
+ * (relative to dir_fd, like openat). Returns its size, or 0 when it
+ * can't be read. */
+static uint64_t gitfs_pack_checksum(int dir_fd, const char *path, unsigned char *checksum) {
+	uint64_t size = 0;
+	struct stat st;
+	int fd;
+
+	if ((fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &st) == 0 && st.st_size > GITFS_PACK_TRAILER &&
+	    pread(fd, checksum, GIT_OID_RAWSZ, st.st_size - GIT_OID_RAWSZ) == GIT_OID_RAWSZ)
+		size = st.st_size;
+	close(fd);
+	return size;
+}
+
+/* Copy the file at from to the new file to in the local cache. Returns
+ * its size (0 on errors), with the checksum at its end in checksum and
+ * the SHA-1 of everything before it (which should be the same) in
+ * sum. */
+static uint64_t gitfs_local_copy_file(const char *from, const char *to, unsigned char *sum, unsigned char *checksum) {
+	uint64_t size = 0, offset, hashed;
+	EVP_MD_CTX *ctx = NULL;
+	unsigned char *buf;
+	int in, out = -1;
+	struct stat st;
+	ssize_t len;
+
+	if (!(buf = malloc(GITFS_LOCAL_CHUNK)))
+		return error("Failed to allocate memory for copying %s\n", from), 0;
+	if ((in = open(from, O_RDONLY | O_CLOEXEC)) < 0 || fstat(in, &st) < 0) {
+		error("Failed to open %s: %s\n", from, strerror(errno));
+		goto out;
+	}
+	if (st.st_size <= GITFS_PACK_TRAILER)
+		goto out;
+	if ((out = openat(local_cache.dir_fd, to, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		error("Failed to create %s in local cache: %s\n", to, strerror(errno));
+		goto out;
+	}
+	if (!(ctx = EVP_MD_CTX_new()) || !EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)) {
+		error("Failed to initialize SHA-1\n");
+		goto out;
+	}
+
+	for (offset = 0; offset < (uint64_t)st.st_size; offset += len) {
+		len = st.st_size - offset < GITFS_LOCAL_CHUNK ? st.st_size - offset : GITFS_LOCAL_CHUNK;
+		if ((len = pread(in, buf, len, offset)) <= 0) {
+			error("Failed to read %s: %s\n", from, len ? strerror(errno) : "truncated");
+			goto out;
+		}
+		if (write(out, buf, len) != len) {
+			error("Failed to write %s in local cache: %s\n", to, strerror(errno));
+			goto out;
+		}
+		if (offset < st.st_size - GIT_OID_RAWSZ) {
+			hashed = st.st_size - GIT_OID_RAWSZ - offset;
+			EVP_DigestUpdate(ctx, buf, hashed < (uint64_t)len ? hashed : (uint64_t)len);
+		}
+		gitfs_task_yield(&local_copy_stop);
+	}
+
+	/* Only renamed into place once complete, which must survive a
+	 * crash */
+	if (!EVP_DigestFinal_ex(ctx, sum, NULL) || fdatasync(out) < 0 ||
+	    pread(out, checksum, GIT_OID_RAWSZ, st.st_size - GIT_OID_RAWSZ) != GIT_OID_RAWSZ) {
+		error("Failed to write %s in local cache: %s\n", to, strerror(errno));
+		goto out;
+	}
+	size = st.st_size;
+
+out:
+	EVP_MD_CTX_free(ctx);
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	free(buf);
+	return size;
+}
+
+struct gitfs_local_users {
+	const char *pack_dir;
+	bool found;
+};
+
+static void gitfs_local_user(void *data, const char *objects_dir) {
+	struct gitfs_local_users *u = data;
+	size_t len = strlen(objects_dir);
+
+	if (!strncmp(u->pack_dir, objects_dir, len) && !strcmp(u->pack_dir + len, "/pack"))
+		u->found = true;
+}
+
+/* Whether the copy of the pack named name may still be opened: libgit2
+ * only opens a pack on its first lookup, so a copy handed to it can't
+ * be removed while any repository still has the original. Only the
+ * copies used by this process are known, not those of other processes
+ * sharing the directory. */
+static bool gitfs_local_in_use(const char *name) {
+	struct gitfs_local_users u = { 0 };
+	char path[PATH_MAX];
+	struct gitfs_local_copy *c;
+	struct gitfs_repo *r;
+
+	pthread_mutex_lock(&local_cache.lock);
+	for (c = local_cache.copies; c && strcmp(c->name, name); c = c->next)
+		;
+	if (c && c->used)
+		u.pack_dir = c->pack_dir;
+	pthread_mutex_unlock(&local_cache.lock);
+	if (!u.pack_dir)
+		return false;
+
+	snprintf(path, sizeof(path), "%s/%s.pack", u.pack_dir, name);
+	if (access(path, F_OK) < 0)
+		return false;
+	pthread_mutex_lock(&repos_lock);
+	for (r = repos; r && !u.found; r = r->next)
+		gitfs_objects_dirs(r, r->current->repo, gitfs_local_user, &u);
+	pthread_mutex_unlock(&repos_lock);
+	return u.found;
+}
+
+struct gitfs_local_used {
+	char name[NAME_MAX + 1];
+	time_t mtime;
+	uint64_t size;
+};
+
+static int gitfs_local_used_cmp(const void *a, const void *b) {
+	const struct gitfs_local_used *x = a, *y = b;
+	return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* Remove the copies used least recently (see gitfs_local_pack), until
+ * size more bytes fit. Copies still in use are kept. Returns whether
+ * there is room now. */
+static bool gitfs_local_evict(uint64_t size) {
+	struct gitfs_local_used *used = NULL, *grown;
+	size_t count = 0, i, len;
+	char path[NAME_MAX + 1];
+	uint64_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int fd;
+
+	if (!local_cache.max_size)
+		return true;
+	/* A new open directory, since copies can be made concurrently */
+	if ((fd = openat(local_cache.dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return false;
+	if (!(dir = fdopendir(fd))) {
+		close(fd);
+		return false;
+	}
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len <= 5 || strcmp(de->d_name + len - 5, ".pack"))
+			continue;
+		if (fstatat(local_cache.dir_fd, de->d_name, &st, 0) < 0 ||
+		    !(grown = realloc(used, (count + 1) * sizeof(*used))))
+			continue;
+		used = grown;
+		snprintf(used[count].name, sizeof(used[count].name), "%.*s", (int)(len - 5), de->d_name);
+		used[count].mtime = st.st_mtime;
+		used[count].size = st.st_size;
+		snprintf(path, sizeof(path), "%s.idx", used[count].name);
+		if (fstatat(local_cache.dir_fd, path, &st, 0) == 0)
+			used[count].size += st.st_size;
+		total += used[count++].size;
+	}
+	closedir(dir);
+
+	qsort(used, count, sizeof(*used), gitfs_local_used_cmp);
+	for (i = 0; i < count && total + size > local_cache.max_size; i++) {
+		if (gitfs_local_in_use(used[i].name))
+			continue;
+		debug("Removing copy of %s from local cache\n", used[i].name);
+		/* Without its index, a copy is not used anymore */
+		snprintf(path, sizeof(path), "%s.idx", used[i].name);
+		unlinkat(local_cache.dir_fd, path, 0);
+		snprintf(path, sizeof(path), "%s.pack", used[i].name);
+		unlinkat(local_cache.dir_fd, path, 0);
+		total -= used[i].size;
+	}
+	free(used);
+	return total + size <= local_cache.max_size;
+}
+
+/* Reopen the repositories using the packs in pack_dir, so they use the
+ * copies made of them */
+static void gitfs_local_reopen(const char *pack_dir) {
+	struct gitfs_local_users u = { .pack_dir = pack_dir };
+	struct gitfs_repo *r;
+
+	pthread_mutex_lock(&repos_lock);
+	for (r = repos; r; r = r->next) {
+		u.found = false;
+		gitfs_objects_dirs(r, r->current->repo, gitfs_local_user, &u);
+		if (u.found)
+			r->packs_changed = true;
+	}
+	pthread_mutex_unlock(&repos_lock);
+	gitfs_repos_refresh();
+}
+
+/* Copy the pack (and its index) passed to the local cache */
+static void gitfs_local_copy_main(void *data) {
+	unsigned char sum[GIT_OID_RAWSZ], checksum[GIT_OID_RAWSZ], idx_sum[GIT_OID_RAWSZ];
+	unsigned char idx_checksum[GIT_OID_RAWSZ], idx_pack_checksum[GIT_OID_RAWSZ];
+	char from[PATH_MAX], pack_tmp[NAME_MAX + 1], idx_tmp[NAME_MAX + 1], path[NAME_MAX + 1];
+	struct gitfs_local_copy *c = data;
+	uint64_t size, idx_size;
+	int fd;
+
+	debug("Copying %s/%s to local cache\n", c->pack_dir, c->name);
+	snprintf(from, sizeof(from), "%s/%s.pack", c->pack_dir, c->name);
+	snprintf(pack_tmp, sizeof(pack_tmp), "%s.pack.tmp%d", c->name, (int)getpid());
+	snprintf(idx_tmp, sizeof(idx_tmp), "%s.idx.tmp%d", c->name, (int)getpid());
+	if (!(size = gitfs_local_copy_file(from, pack_tmp, sum, checksum)))
+		goto err;
+	if (memcmp(sum, checksum, GIT_OID_RAWSZ)) {
+		error("%s doesn't match its checksum, not copying it\n", from);
+		goto err;
+	}
+
+	/* The index ends with the checksum of its pack, followed by its
+	 * own */
+	snprintf(from, sizeof(from), "%s/%s.idx", c->pack_dir, c->name);
+	if (!(idx_size = gitfs_local_copy_file(from, idx_tmp, idx_sum, idx_checksum)))
+		goto err;
+	if ((fd = openat(local_cache.dir_fd, idx_tmp, O_RDONLY | O_CLOEXEC)) < 0 ||
+	    pread(fd, idx_pack_checksum, GIT_OID_RAWSZ, idx_size - GITFS_PACK_TRAILER) != GIT_OID_RAWSZ) {
+		if (fd >= 0)
+			close(fd);
+		error("Failed to read %s in local cache: %s\n", idx_tmp, strerror(errno));
+		goto err;
+	}
+	close(fd);
+	if (memcmp(idx_sum, idx_checksum, GIT_OID_RAWSZ) || memcmp(idx_pack_checksum, checksum, GIT_OID_RAWSZ)) {
+		error("%s doesn't match its checksum, not copying it\n", from);
+		goto err;
+	}
+
+	if (!gitfs_local_evict(size + idx_size)) {
+		debug("No room for %s/%s in local cache\n", c->pack_dir, c->name);
+		goto err;
+	}
+	/* A copy is only used once its index is there */
+	snprintf(path, sizeof(path), "%s.pack", c->name);
+	if (renameat(local_cache.dir_fd, pack_tmp, local_cache.dir_fd, path) < 0) {
+		error("Failed to rename %s in local cache: %s\n", pack_tmp, strerror(errno));
+		goto err;
+	}
+	snprintf(path, sizeof(path), "%s.idx", c->name);
+	if (renameat(local_cache.dir_fd, idx_tmp, local_cache.dir_fd, path) < 0) {
+		error("Failed to rename %s in local cache: %s\n", idx_tmp, strerror(errno));
+		goto err;
+	}
+	debug("Copied %s/%s to local cache\n", c->pack_dir, c->name);
+	gitfs_local_reopen(c->pack_dir);
+	return;
+
+err:
+	unlinkat(local_cache.dir_fd, pack_tmp, 0);
+	unlinkat(local_cache.dir_fd, idx_tmp, 0);
+}
+
+/* Returns the copy of the pack named name in objects_dir, adding it
+ * when needed (NULL when out of memory). Must be called with
+ * local_cache.lock held. */
+static struct gitfs_local_copy *gitfs_local_copy_get(const char *objects_dir, const char *name) {
+	struct gitfs_local_copy *c;
+	char pack_dir[PATH_MAX];
+
+	for (c = local_cache.copies; c && strcmp(c->name, name); c = c->next)
+		;
+	if (c)
+		return c;
+	snprintf(pack_dir, sizeof(pack_dir), "%s/pack", objects_dir);
+	if (!(c = calloc(1, sizeof(*c))) || !(c->pack_dir = strdup(pack_dir)) || !(c->name = strdup(name))) {
+		if (c)
+			free(c->pack_dir);
+		free(c);
+		return error("Failed to allocate memory for local cache\n"), NULL;
+	}
+	c->next = local_cache.copies;
+	local_cache.copies = c;
+	return c;
+}
+
+/* Copy the pack named name (of size bytes) in objects_dir to the local
+ * cache in the background, unless done (or tried) before */
+static void gitfs_local_submit(const char *objects_dir, const char *name, uint64_t size) {
+	struct gitfs_local_copy *c;
+
+	/* Copies that can never fit are not even tried */
+	if (local_cache.max_size && size > local_cache.max_size)
+		return;
+
+	pthread_mutex_lock(&local_cache.lock);
+	if ((c = gitfs_local_copy_get(objects_dir, name)) && !c->submitted) {
+		c->submitted = true;
+		gitfs_task_submit(&c->task, gitfs_local_copy_main, c, GITFS_TASK_LOCAL_CACHE);
+	}
+	pthread_mutex_unlock(&local_cache.lock);
+}
+
+/* Find the copy in the local cache of the pack whose index is named
+ * idx_name in objects_dir. Returns whether there is a valid one, in
+ * which case its index is stored in idx_path (PATH_MAX bytes). When
+ * there isn't and copy is set, one is made in the background. */
+static bool gitfs_local_pack(char *idx_path, const char *objects_dir, const char *idx_name, bool copy) {
+	unsigned char checksum[GIT_OID_RAWSZ], copy_checksum[GIT_OID_RAWSZ];
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	struct gitfs_local_copy *c;
+	uint64_t size;
+
+	if (local_cache.dir_fd < 0)
+		return false;
+
+	snprintf(name, sizeof(name), "%.*s", (int)(strlen(idx_name) - strlen(".idx")), idx_name);
+	snprintf(path, sizeof(path), "%s/pack/%s.pack", objects_dir, name);
+	if (!(size = gitfs_pack_checksum(AT_FDCWD, path, checksum)))
+		return false;
+
+	snprintf(path, sizeof(path), "%s.pack", name);
+	if (gitfs_pack_checksum(local_cache.dir_fd, path, copy_checksum) == size &&
+	    !memcmp(checksum, copy_checksum, GIT_OID_RAWSZ) && faccessat(local_cache.dir_fd, idx_name, R_OK, 0) == 0) {
+		/* Remember it was used, see gitfs_local_evict. Without
+		 * memory, the original is used instead, since the copy
+		 * could be removed before it is opened. */
+		pthread_mutex_lock(&local_cache.lock);
+		if ((c = gitfs_local_copy_get(objects_dir, name)))
+			c->used = true;
+		pthread_mutex_unlock(&local_cache.lock);
+		if (!c)
+			return false;
+		utimensat(local_cache.dir_fd, path, NULL, 0);
+		snprintf(idx_path, PATH_MAX, "%s/%s", local_cache.path, idx_name);
+		return true;
+	}
+
+	if (copy)
+		gitfs_local_submit(objects_dir, name, size);
+	return false;
+}
+
+/* Add a backend for each valid copy of the packs in objects_dir to
+ * odb, see gitfs_odb_add_objects */
+static void gitfs_local_add_packs(git_odb *odb, const char *objects_dir, bool alternate) {
+	int (*add)(git_odb *, git_odb_backend *, int) = alternate ? git_odb_add_alternate : git_odb_add_backend;
+	char path[PATH_MAX], idx_path[PATH_MAX];
+	git_odb_backend *packed;
+	struct dirent *de;
+	size_t len;
+	DIR *dir;
+
+	if (local_cache.dir_fd < 0)
+		return;
+
+	snprintf(path, sizeof(path), "%s/pack", objects_dir);
+	if (!(dir = opendir(path)))
+		return;
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len <= 4 || strcmp(de->d_name + len - 4, ".idx") ||
+		    !gitfs_local_pack(idx_path, objects_dir, de->d_name, true))
+			continue;
+		/* Just use the original when the copy can't be */
+		if (git_odb_backend_one_pack(&packed, idx_path) < 0) {
+			debug("Not using %s: %s\n", idx_path, giterr_last()->message);
+		} else if (add(odb, packed, GITFS_LOCAL_PRIORITY) < 0) {
+			packed->free(packed);
+		} else {
+			debug("Using %s\n", idx_path);
+		}
+	}
+	closedir(dir);
+}
+
+/* Content search. With the search-index option, the text files of each
+ * mounted tree are indexed in the background: for each blob, a bloom
+ * filter of the trigrams (sequences of three bytes) it contains is
+ * stored. Filters are stored by blob oid, in a single store shared by
+ * all trees (and mounts, and runs), so each blob is only indexed once.
+ * The text files and subtrees of each tree are stored as well, once per
+ * distinct tree (just like git stores trees), so mounting a tree again
+ * doesn't need a walk, and a tree sharing subtrees with one indexed
+ * before (e.g. a vendored library under several paths, or the previous
+ * release) only needs a walk of the trees that are new. Searching for a
+ * string then only needs to read the files whose filter has all
+ * trigrams of the string, see gitfs_search_run. Results are shown in GITFS_SEARCH_PATH, see
+ * gitfs_lookup_search_entry. */
+
+#define GITFS_SEARCH_PATH "/.git-fs-search"
+
+/* Start of the store, and of each stored tree (trees used to be
+ * stored with all files below them, which is not valid anymore) */
+#define GITFS_SEARCH_MAGIC "gfsidx1\n"
+#define GITFS_SEARCH_TREE_MAGIC "gfsidx2\n"
+#define GITFS_SEARCH_SNAPSHOT_MAGIC "gfsidx3\n"
+#define GITFS_SEARCH_MAGIC_LEN 8
+/* Appended to the oid of a tree for the name of its snapshot, see
+ * gitfs_search_save_snapshot */
+#define GITFS_SEARCH_SNAPSHOT_SUFFIX ".snapshot"
+/* The number of commits to look back for an index to derive from */
+#define GITFS_SEARCH_BASE_DEPTH 64
+
+/* Bigger files are not indexed, but always searched */
+#define GITFS_SEARCH_MAX_SIZE (16 << 20)
+/* Files with a nul byte in the first this many bytes are binary (and
+ * not searched), like git decides as well */
+#define GITFS_SEARCH_BINARY_CHECK 8000
+/* Bits in a filter per trigram, and the number of bits set for each
+ * trigram, for a false positive rate of about 2% per trigram */
+#define GITFS_SEARCH_FILTER_BITS 10
+#define GITFS_SEARCH_HASHES 3
+/* The number of searches remembered per mount */
+#define GITFS_SEARCH_RESULTS 8
+
+/* Kinds of entries of a tree in the index */
+#define GITFS_SEARCH_TEXT 1
+#define GITFS_SEARCH_LARGE 2
+#define GITFS_SEARCH_SUBTREE 3
+
+/* The filter of a blob in the store. Each is stored as the oid, the
+ * size of the filter in bits (32 bits, 0 for binary blobs) and the
+ * filter itself. */
+struct gitfs_search_blob {
+	git_oid oid;
+	/* Where the filter starts in the store */
+	uint64_t offset;
+	uint32_t bits;
+	struct gitfs_search_blob *next;
+};
+
+#define GITFS_SEARCH_RECORD (GIT_OID_RAWSZ + 4)
+
+/* The store of filters, which is only ever appended to */
+static struct {
+	/* The search-index directory, opened before chrooting */
+	int dir_fd;
+	int fd;
+	uint64_t size;
+	pthread_mutex_t lock;
+	/* All filters in the store */
+	struct gitfs_oid_table blobs;
+} search_store = {
+	.dir_fd = -1,
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.blobs = GITFS_OID_TABLE_INIT(struct gitfs_search_blob),
+};
+
+/* An entry of a tree in the index: a file to search, or a subtree */
+struct gitfs_search_entry {
+	git_oid oid;
+	char *name;
+	uint8_t kind;
+	/* The subtree, for GITFS_SEARCH_SUBTREE entries */
+	struct gitfs_search_node *tree;
+};
+
+/* A tree in the index. Each distinct tree is only there once, however
+ * many paths it is found under. */
+struct gitfs_search_node {
+	git_oid oid;
+	/* Entries in tree order */
+	struct gitfs_search_entry *entries;
+	size_t count;
+	/* Numbers the nodes of a gitfs_search_tree, from 0 */
+	size_t index;
+	struct gitfs_search_node *next;
+};
+
+/* The index of a mounted tree, with a hash table of all distinct trees
+ * in it */
+struct gitfs_search_tree {
+	struct gitfs_search_node *root;
+	struct gitfs_oid_table nodes;
+};
+
+struct gitfs_search_result {
+	char *pattern;
+	/* The paths of the files containing pattern (pointing into
+	 * buf), in tree order (so the files in a directory are next to
+	 * each other) */
+	const char **paths;
+	size_t count;
+	char *buf;
+	unsigned refcount;
+	struct gitfs_search_result *next;
+};
+
+/* Returns the filter of the blob with the given oid, or NULL. Must be
+ * called with search_store.lock held. */
+static struct gitfs_search_blob *gitfs_search_find_blob(const git_oid *oid) {
+	return gitfs_oid_table_find(&search_store.blobs, oid);
+}
+
+/* Add a filter stored at offset to the hash table. Must be called with
+ * search_store.lock held. */
+static int gitfs_search_insert_blob(const git_oid *oid, uint64_t offset, uint32_t bits) {
+	struct gitfs_search_blob *b;
+
+	if (!(b = malloc(sizeof(*b))))
+		return error("Failed to allocate memory for search index\n"), -ENOMEM;
+	git_oid_cpy(&b->oid, oid);
+	b->offset = offset;
+	b->bits = bits;
+	if (gitfs_oid_table_add(&search_store.blobs, b) < 0) {
+		free(b);
+		return error("Failed to allocate memory for search index\n"), -ENOMEM;
+	}
+	return 0;
+}
+
+/* Load the filters in the store from offset up to size (the size of
+ * the file). Returns the end of the last complete one, or -1 on
+ * errors. */
+static int64_t gitfs_search_load_blobs(uint64_t offset, uint64_t size) {
+	unsigned char record[GITFS_SEARCH_RECORD];
+	uint64_t next;
+	uint32_t bits;
+	git_oid oid;
+
+	for (; offset < size; offset = next) {
+		if (pread(search_store.fd, record, sizeof(record), offset) != sizeof(record))
+			break;
+		memcpy(oid.id, record, GIT_OID_RAWSZ);
+		memcpy(&bits, record + GIT_OID_RAWSZ, sizeof(bits));
+		next = offset + sizeof(record) + bits / 8;
+		/* Filters are empty or a power of two of at least 64
+		 * bits, anything else is garbage */
+		if ((bits && (bits < 64 || (bits & (bits - 1)))) || next > size)
+			break;
+		if (!gitfs_search_find_blob(&oid) && gitfs_search_insert_blob(&oid, offset + sizeof(record), bits) < 0)
+			return -1;
+	}
+	return offset;
+}
+
+/* Open the search index in dir (creating it when needed) and load the
+ * filters in its store. Must be called before chrooting. */
+static int gitfs_search_open(const char *dir) {
+	char magic[GITFS_SEARCH_MAGIC_LEN];
+	int64_t offset;
+	struct stat st;
+
+	if ((search_store.dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return error("%s: Failed to open search index: %s\n", dir, strerror(errno)), -1;
+	if ((search_store.fd = openat(search_store.dir_fd, "blobs", O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+	    fstat(search_store.fd, &st) < 0)
+		return error("%s: Failed to open search index: %s\n", dir, strerror(errno)), -1;
+
+	if (st.st_size == 0) {
+		if (pwrite(search_store.fd, GITFS_SEARCH_MAGIC, GITFS_SEARCH_MAGIC_LEN, 0) != GITFS_SEARCH_MAGIC_LEN)
+			return error("%s: Failed to write search index: %s\n", dir, strerror(errno)), -1;
+		search_store.size = GITFS_SEARCH_MAGIC_LEN;
+		return 0;
+	}
+	if (pread(search_store.fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+	    memcmp(magic, GITFS_SEARCH_MAGIC, sizeof(magic)))
+		return error("%s: Not a search index\n", dir), -1;
+
+	if ((offset = gitfs_search_load_blobs(GITFS_SEARCH_MAGIC_LEN, st.st_size)) < 0)
+		return -1;
+
+	/* A partially written filter (e.g. after a crash) is just
+	 * overwritten by the next one */
+	if (offset != st.st_size)
+		debug("Ignoring the end of the search index after %llu bytes\n", (unsigned long long)offset);
+	search_store.size = offset;
+	return 0;
+}
+
+/* Returns the index of bit i for trigram in a filter of the given
+ * size */
+static uint32_t gitfs_search_bit(uint32_t trigram, int i, uint32_t bits) {
+	uint64_t hash = (trigram + 1) * 0x9e3779b97f4a7c15ULL;
+	return ((uint32_t)hash + i * ((uint32_t)(hash >> 32) | 1)) & (bits - 1);
+}
+
+static uint32_t gitfs_trigram(const unsigned char *p) {
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+/* Build the filter of data, using seen (a zeroed bitmap of all 1 << 24
+ * trigrams, which is zeroed again afterwards) to find the distinct
+ * trigrams. Returns NULL when out of memory. */
+static uint8_t *gitfs_search_filter(const unsigned char *data, size_t size, uint8_t *seen, uint32_t *bits_out) {
+	uint32_t t, bits = 64;
+	size_t i, distinct = 0;
+	uint8_t *filter;
+	int j;
+
+	for (i = 0; i + 2 < size; i++) {
+		t = gitfs_trigram(data + i);
+		if (!(seen[t / 8] & 1 << t % 8)) {
+			seen[t / 8] |= 1 << t % 8;
+			distinct++;
+		}
+	}
+	while (bits < distinct * GITFS_SEARCH_FILTER_BITS)
+		bits *= 2;
+
+	filter = calloc(bits / 8, 1);
+	/* Clear seen in a second pass, which is a lot cheaper than
+	 * clearing all of it */
+	for (i = 0; i + 2 < size; i++) {
+		t = gitfs_trigram(data + i);
+		if (!(seen[t / 8] & 1 << t % 8))
+			continue;
+		seen[t / 8] &= ~(1 << t % 8);
+		for (j = 0; filter && j < GITFS_SEARCH_HASHES; j++)
+			filter[gitfs_search_bit(t, j, bits) / 8] |= 1 << gitfs_search_bit(t, j, bits) % 8;
+	}
+
+	*bits_out = bits;
+	return filter;
+}
+
+/* Append the filter of the blob with the given oid to the store (a
+ * NULL filter for binary blobs) */
+static int gitfs_search_add_blob(const git_oid *oid, const uint8_t *filter, uint32_t bits) {
+	unsigned char record[GITFS_SEARCH_RECORD];
+	struct iovec iov[2] = {
+		{ .iov_base = record, .iov_len = sizeof(record) },
+		{ .iov_base = (void *)filter, .iov_len = bits / 8 },
+	};
+	struct stat st;
+	int64_t end;
+	int retval = 0;
+
+	memcpy(record, oid->id, GIT_OID_RAWSZ);
+	memcpy(record + GIT_OID_RAWSZ, &bits, sizeof(bits));
+
+	pthread_mutex_lock(&search_store.lock);
+	/* Other processes using the same index append to it as well, so
+	 * appending takes a lock on the file, and what they appended
+	 * since is loaded first */
+	if (flock(search_store.fd, LOCK_EX) < 0 || fstat(search_store.fd, &st) < 0) {
+		error("Failed to lock search index: %s\n", strerror(errno));
+		pthread_mutex_unlock(&search_store.lock);
+		return -EIO;
+	}
+	end = search_store.size;
+	if ((uint64_t)st.st_size > search_store.size)
+		end = gitfs_search_load_blobs(search_store.size, st.st_size);
+
+	if (end < 0) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	search_store.size = end;
+
+	/* Another mount might have indexed it in the meanwhile */
+	if (!gitfs_search_find_blob(oid)) {
+		if (pwritev(search_store.fd, iov, 2, search_store.size) != (ssize_t)(sizeof(record) + bits / 8)) {
+			error("Failed to write search index: %s\n", strerror(errno));
+			retval = -EIO;
+		} else if ((retval = gitfs_search_insert_blob(oid, search_store.size + sizeof(record), bits)) == 0) {
+			search_store.size += sizeof(record) + bits / 8;
+		}
+	}
+out:
+	flock(search_store.fd, LOCK_UN);
+	pthread_mutex_unlock(&search_store.lock);
+	return retval;
+}
+
+/* Index the blob with the given oid, unless already done. Returns its
+ * kind, 0 for binary blobs (which are not searched) or a negative error
+ * code. */
+static int gitfs_search_index_blob(struct gitfs_odb *o, const git_oid *oid, uint8_t *seen) {
+	struct gitfs_search_blob *b;
+	git_odb_object *obj;
+	const unsigned char *data;
+	uint8_t *filter = NULL;
+	uint32_t bits = 0;
+	git_otype type;
+	size_t size;
+	int retval;
+
+	pthread_mutex_lock(&search_store.lock);
+	b = gitfs_search_find_blob(oid);
+	retval = b ? (b->bits ? GITFS_SEARCH_TEXT : 0) : -ENOENT;
+	pthread_mutex_unlock(&search_store.lock);
+	if (retval != -ENOENT)
+		return retval;
+
+	if (git_odb_read_header(&size, &type, o->odb, oid) < 0)
+		return error("Blob not found?!: %s\n", giterr_last()->message), -EIO;
+	if (size > GITFS_SEARCH_MAX_SIZE)
+		return GITFS_SEARCH_LARGE;
+
+	/* Read past the blob cache, so indexing doesn't push out what
+	 * is actually used */
+	if (git_odb_read(&obj, o->odb, oid) < 0)
+		return error("Blob not found?!: %s\n", giterr_last()->message), -EIO;
+	if (drop_pack_cache)
+		gitfs_odb_drop_cached(o, oid);
+
+	data = git_odb_object_data(obj);
+	size = git_odb_object_size(obj);
+	if (!memchr(data, '\0', size < GITFS_SEARCH_BINARY_CHECK ? size : GITFS_SEARCH_BINARY_CHECK)) {
+		if (!(filter = gitfs_search_filter(data, size, seen, &bits))) {
+			git_odb_object_free(obj);
+			return error("Failed to allocate memory for search index\n"), -ENOMEM;
+		}
+	}
+	git_odb_object_free(obj);
+
+	retval = gitfs_search_add_blob(oid, filter, bits);
+	free(filter);
+	if (retval < 0)
+		return retval;
+	return bits ? GITFS_SEARCH_TEXT : 0;
+}
+
+static void gitfs_search_node_free(struct gitfs_search_node *n) {
+	size_t i;
+
+	if (!n)
+		return;
+	for (i = 0; i < n->count; i++)
+		free(n->entries[i].name);
+	free(n->entries);
+	free(n);
+}
+
+static void gitfs_search_tree_free(struct gitfs_search_tree *t) {
+	struct gitfs_search_node *n, *next;
+	size_t i;
+
+	if (!t)
+		return;
+	for (i = 0; i < t->nodes.bucket_count; i++) {
+		for (n = t->nodes.buckets[i]; n; n = next) {
+			next = n->next;
+			gitfs_search_node_free(n);
+		}
+	}
+	free(t->nodes.buckets);
+	free(t);
+}
+
+/* Add a (complete) node to t */
+static int gitfs_search_insert_node(struct gitfs_search_tree *t, struct gitfs_search_node *n) {
+	n->index = t->nodes.count;
+	if (gitfs_oid_table_add(&t->nodes, n) < 0)
+		return error("Failed to allocate memory for search index\n"), -ENOMEM;
+	return 0;
+}
+
+/* Add an entry to n */
+static int gitfs_search_node_add(struct gitfs_search_node *n, const git_oid *oid, const char *name, int kind,
+		struct gitfs_search_node *tree) {
+	struct gitfs_search_entry *entries, *e;
+
+	/* Grow by doubling, whenever the count reaches a power of two */
+	if (!(n->count & (n->count - 1))) {
+		if (!(entries = realloc(n->entries, (n->count ? n->count * 2 : 1) * sizeof(*entries))))
+			return error("Failed to allocate memory for search index\n"), -ENOMEM;
+		n->entries = entries;
+	}
+	e = &n->entries[n->count];
+	if (!(e->name = strdup(name)))
+		return error("Failed to allocate memory for search index\n"), -ENOMEM;
+	git_oid_cpy(&e->oid, oid);
+	e->kind = kind;
+	e->tree = tree;
+	n->count++;
+	return 0;
+}
+
+/* State of building the index of a tree, see gitfs_search_node_get */
+struct gitfs_search_build {
+	struct gitfs_data *d;
+	struct gitfs_odb *o;
+	struct gitfs_search_tree *tree;
+	/* The index this one is derived from (NULL when none), see
+	 * gitfs_search_load_base. Nodes are moved to tree when found
+	 * there. */
+	struct gitfs_search_tree *base;
+	uint8_t *seen;
+};
+
+/* Store the entries of n (but not those of its subtrees, which are
+ * stored by themselves). Each entry is stored as its oid, kind and
+ * nul-terminated name. */
+static void gitfs_search_save(struct gitfs_search_node *n) {
+	char name[GIT_OID_HEXSZ + 1], tmp[GIT_OID_HEXSZ + 16];
+	FILE *out;
+	size_t i;
+	int fd;
+
+	git_oid_fmt(name, &n->oid);
+	name[GIT_OID_HEXSZ] = '\0';
+	snprintf(tmp, sizeof(tmp), "%s.tmp%d", name, (int)getpid());
+
+	/* Written to a temporary file first, so a partial tree is
+	 * never found */
+	if ((fd = openat(search_store.dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+	    !(out = fdopen(fd, "w"))) {
+		if (fd >= 0)
+			close(fd);
+		error("Failed to write search index: %s\n", strerror(errno));
+		return;
+	}
+	fwrite(GITFS_SEARCH_TREE_MAGIC, GITFS_SEARCH_MAGIC_LEN, 1, out);
+	for (i = 0; i < n->count; i++) {
+		fwrite(n->entries[i].oid.id, GIT_OID_RAWSZ, 1, out);
+		fputc(n->entries[i].kind, out);
+		fwrite(n->entries[i].name, strlen(n->entries[i].name) + 1, 1, out);
+	}
+	if (fclose(out) != 0 || renameat(search_store.dir_fd, tmp, search_store.dir_fd, name) < 0) {
+		error("Failed to write search index: %s\n", strerror(errno));
+		unlinkat(search_store.dir_fd, tmp, 0);
+	}
+}
+
+/* Load the stored entries of the tree with the given oid, if any. The
+ * nodes of its subtrees are left NULL. */
+static struct gitfs_search_node *gitfs_search_load(const git_oid *oid) {
+	char name[GIT_OID_HEXSZ + 1], magic[GITFS_SEARCH_MAGIC_LEN];
+	struct gitfs_search_node *n;
+	char *entry = NULL;
+	size_t len = 0;
+	git_oid file;
+	FILE *in;
+	int fd, kind;
+
+	git_oid_fmt(name, oid);
+	name[GIT_OID_HEXSZ] = '\0';
+	if ((fd = openat(search_store.dir_fd, name, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (!(in = fdopen(fd, "r"))) {
+		close(fd);
+		return NULL;
+	}
+	if (!(n = calloc(1, sizeof(*n))) || fread(magic, sizeof(magic), 1, in) != 1 ||
+	    memcmp(magic, GITFS_SEARCH_TREE_MAGIC, sizeof(magic)))
+		goto err;
+	git_oid_cpy(&n->oid, oid);
+
+	while (fread(file.id, GIT_OID_RAWSZ, 1, in) == 1) {
+		if ((kind = fgetc(in)) == EOF || kind < GITFS_SEARCH_TEXT || kind > GITFS_SEARCH_SUBTREE ||
+		    getdelim(&entry, &len, '\0', in) <= 0 ||
+		    gitfs_search_node_add(n, &file, entry, kind, NULL) < 0)
+			goto err;
+	}
+	if (ferror(in))
+		goto err;
+	free(entry);
+	fclose(in);
+	return n;
+
+err:
+	debug("Ignoring invalid search index of tree %s\n", name);
+	free(entry);
+	fclose(in);
+	gitfs_search_node_free(n);
+	return NULL;
+}
+
+/* Move n from b->base to b->tree, along with the nodes of its subtrees
+ * (which are all in either of them) */
+static int gitfs_search_adopt(struct gitfs_search_build *b, struct gitfs_search_node *n) {
+	size_t i;
+	int retval = 0;
+
+	gitfs_oid_table_remove(&b->base->nodes, n);
+
+	for (i = 0; i < n->count && retval == 0; i++) {
+		if (n->entries[i].kind == GITFS_SEARCH_SUBTREE && !gitfs_oid_table_find(&b->tree->nodes, &n->entries[i].oid))
+			retval = gitfs_search_adopt(b, n->entries[i].tree);
+	}
+	if (retval == 0)
+		retval = gitfs_search_insert_node(b->tree, n);
+	if (retval < 0)
+		gitfs_search_node_free(n);
+	return retval;
+}
+
+/* Write n and (before it) the nodes of its subtrees to out, unless
+ * written already */
+static void gitfs_search_snapshot_node(FILE *out, struct gitfs_search_node *n, uint8_t *written) {
+	uint32_t count = n->count;
+	size_t i;
+
+	if (written[n->index])
+		return;
+	written[n->index] = 1;
+	for (i = 0; i < n->count; i++) {
+		if (n->entries[i].kind == GITFS_SEARCH_SUBTREE)
+			gitfs_search_snapshot_node(out, n->entries[i].tree, written);
+	}
+	fwrite(n->oid.id, GIT_OID_RAWSZ, 1, out);
+	fwrite(&count, sizeof(count), 1, out);
+	for (i = 0; i < n->count; i++) {
+		fwrite(n->entries[i].oid.id, GIT_OID_RAWSZ, 1, out);
+		fputc(n->entries[i].kind, out);
+		fwrite(n->entries[i].name, strlen(n->entries[i].name) + 1, 1, out);
+	}
+}
+
+/* Store all of t in a single file, so it can be loaded again in one go
+ * (instead of reading each of its trees), either when mounted again or
+ * to derive the index of a later commit from. Each node is stored as
+ * its oid, number of entries and the entries (as in
+ * gitfs_search_save), after the nodes of its subtrees. */
+static void gitfs_search_save_snapshot(struct gitfs_search_tree *t) {
+	char name[GIT_OID_HEXSZ + 16], tmp[GIT_OID_HEXSZ + 32];
+	uint8_t *written;
+	FILE *out;
+	int fd;
+
+	git_oid_fmt(name, &t->root->oid);
+	strcpy(name + GIT_OID_HEXSZ, GITFS_SEARCH_SNAPSHOT_SUFFIX);
+	snprintf(tmp, sizeof(tmp), "%s.tmp%d", name, (int)getpid());
+
+	if (!(written = calloc(t->nodes.count, 1)))
+		return;
+	if ((fd = openat(search_store.dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+	    !(out = fdopen(fd, "w"))) {
+		if (fd >= 0)
+			close(fd);
+		error("Failed to write search index: %s\n", strerror(errno));
+		free(written);
+		return;
+	}
+	fwrite(GITFS_SEARCH_SNAPSHOT_MAGIC, GITFS_SEARCH_MAGIC_LEN, 1, out);
+	gitfs_search_snapshot_node(out, t->root, written);
+	free(written);
+	if (fclose(out) != 0 || renameat(search_store.dir_fd, tmp, search_store.dir_fd, name) < 0) {
+		error("Failed to write search index: %s\n", strerror(errno));
+		unlinkat(search_store.dir_fd, tmp, 0);
+	}
+}
+
+/* Load the stored snapshot of the index of the tree with the given
+ * oid, if any */
+static struct gitfs_search_tree *gitfs_search_load_snapshot(const git_oid *oid) {
+	char name[GIT_OID_HEXSZ + 16], magic[GITFS_SEARCH_MAGIC_LEN];
+	struct gitfs_search_node *n = NULL;
+	struct gitfs_search_entry *e;
+	struct gitfs_search_tree *t;
+	char *entry = NULL;
+	size_t len = 0;
+	uint32_t count;
+	git_oid node, file;
+	FILE *in;
+	int fd, kind;
+
+	git_oid_fmt(name, oid);
+	strcpy(name + GIT_OID_HEXSZ, GITFS_SEARCH_SNAPSHOT_SUFFIX);
+	if ((fd = openat(search_store.dir_fd, name, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (!(in = fdopen(fd, "r"))) {
+		close(fd);
+		return NULL;
+	}
+	if (!(t = calloc(1, sizeof(*t))) || fread(magic, sizeof(magic), 1, in) != 1 ||
+	    memcmp(magic, GITFS_SEARCH_SNAPSHOT_MAGIC, sizeof(magic)))
+		goto err;
+	t->nodes = (struct gitfs_oid_table)GITFS_OID_TABLE_INIT(struct gitfs_search_node);
+
+	while (fread(node.id, GIT_OID_RAWSZ, 1, in) == 1) {
+		if (fread(&count, sizeof(count), 1, in) != 1 || gitfs_oid_table_find(&t->nodes, &node) ||
+		    !(n = calloc(1, sizeof(*n))))
+			goto err;
+		git_oid_cpy(&n->oid, &node);
+		while (n->count < count) {
+			if (fread(file.id, GIT_OID_RAWSZ, 1, in) != 1 || (kind = fgetc(in)) == EOF ||
+			    kind < GITFS_SEARCH_TEXT || kind > GITFS_SEARCH_SUBTREE ||
+			    getdelim(&entry, &len, '\0', in) <= 0 ||
+			    gitfs_search_node_add(n, &file, entry, kind, NULL) < 0)
+				goto err;
+			/* Subtrees come first */
+			e = &n->entries[n->count - 1];
+			if (kind == GITFS_SEARCH_SUBTREE && !(e->tree = gitfs_oid_table_find(&t->nodes, &file)))
+				goto err;
+		}
+		if (gitfs_search_insert_node(t, n) < 0)
+			goto err;
+		t->root = n;
+		n = NULL;
+	}
+	/* The root comes last */
+	if (ferror(in) || !t->root || git_oid_cmp(&t->root->oid, oid))
+		goto err;
+	free(entry);
+	fclose(in);
+	return t;
+
+err:
+	debug("Ignoring invalid search index snapshot of tree %s\n", name);
+	gitfs_search_node_free(n);
+	gitfs_search_tree_free(t);
+	free(entry);
+	fclose(in);
+	return NULL;
+}
+
+/* Find the snapshot to derive the index of the mounted tree from: that
+ * of the nearest commit before the mounted one (following first
+ * parents), which is usually the previous release */
+static struct gitfs_search_tree *gitfs_search_load_base(struct gitfs_search_build *b) {
+	struct gitfs_search_tree *t = NULL;
+	git_commit *commit;
+	git_oid oid;
+	int i;
+
+	if (git_oid_iszero(&b->d->commit_oid))
+		return NULL;
+	git_oid_cpy(&oid, &b->d->commit_oid);
+	for (i = 0; !t && i < GITFS_SEARCH_BASE_DEPTH; i++) {
+		if (git_commit_lookup(&commit, b->o->repo, &oid) < 0)
+			break;
+		if (git_commit_parentcount(commit) == 0) {
+			git_commit_free(commit);
+			break;
+		}
+		git_oid_cpy(&oid, git_commit_parent_id(commit, 0));
+		git_commit_free(commit);
+
+		if (git_commit_lookup(&commit, b->o->repo, &oid) < 0)
+			break;
+		t = gitfs_search_load_snapshot(git_commit_tree_id(commit));
+		git_commit_free(commit);
+	}
+	if (t)
+		debug("Deriving search index from that of commit %d before\n", i);
+	return t;
+}
+
+/* Find the node of the tree with the given oid in b->tree, adding it
+ * (and the nodes of its subtrees) when needed: taken from the index it
+ * is derived from or loaded when stored before, built by indexing its
+ * files otherwise. So only distinct trees are ever walked, and only
+ * those that are new. */
+static int gitfs_search_node_get(struct gitfs_search_build *b, const git_oid *oid, struct gitfs_search_node **out) {
+	struct gitfs_search_node *n, *sub;
+	const git_tree_entry *te;
+	git_tree *tree;
+	size_t i;
+	int retval = 0, kind;
+
+	if ((*out = gitfs_oid_table_find(&b->tree->nodes, oid)))
+		return 0;
+
+	/* Unchanged since the index derived from, along with everything
+	 * below it */
+	if (b->base && (n = gitfs_oid_table_find(&b->base->nodes, oid))) {
+		if ((retval = gitfs_search_adopt(b, n)) == 0)
+			*out = n;
+		return retval;
+	}
+
+	if ((n = gitfs_search_load(oid))) {
+		/* Only the subtrees are left to find */
+		for (i = 0; i < n->count && retval == 0; i++) {
+			if (n->entries[i].kind == GITFS_SEARCH_SUBTREE)
+				retval = gitfs_search_node_get(b, &n->entries[i].oid, &n->entries[i].tree);
+		}
+	} else {
+		if (!(n = calloc(1, sizeof(*n))))
+			return error("Failed to allocate memory for search index\n"), -ENOMEM;
+		git_oid_cpy(&n->oid, oid);
+		if (git_tree_lookup(&tree, b->o->repo, oid) < 0) {
+			gitfs_search_node_free(n);
+			return error("Tree not found?!: %s\n", giterr_last()->message), -EIO;
+		}
+		for (i = 0; i < git_tree_entrycount(tree) && retval == 0; i++) {
+			te = git_tree_entry_byindex(tree, i);
+			gitfs_task_yield(&b->d->search_stop);
+			if (__atomic_load_n(&b->d->search_stop, __ATOMIC_RELAXED)) {
+				retval = -ECANCELED;
+			} else if (git_tree_entry_type(te) == GIT_OBJ_TREE) {
+				if ((retval = gitfs_search_node_get(b, git_tree_entry_id(te), &sub)) == 0)
+					retval = gitfs_search_node_add(n, git_tree_entry_id(te), git_tree_entry_name(te),
+						GITFS_SEARCH_SUBTREE, sub);
+			} else if (git_tree_entry_type(te) == GIT_OBJ_BLOB && S_ISREG(git_tree_entry_filemode(te))) {
+				/* Only regular files, symlinks just point
+				 * elsewhere */
+				if ((kind = gitfs_search_index_blob(b->o, git_tree_entry_id(te), b->seen)) > 0)
+					retval = gitfs_search_node_add(n, git_tree_entry_id(te), git_tree_entry_name(te),
+						kind, NULL);
+				else
+					retval = kind;
+			}
+		}
+		git_tree_free(tree);
+		if (retval == 0)
+			gitfs_search_save(n);
+	}
+
+	if (retval == 0)
+		retval = gitfs_search_insert_node(b->tree, n);
+	if (retval < 0) {
+		gitfs_search_node_free(n);
+		return retval;
+	}
+	*out = n;
+	return 0;
+}
+
+/* Build the search index of the mounted tree (loading what was built
+ * before), in the background */
+static void gitfs_search_main(void *data) {
+	struct gitfs_search_build b = { .d = data };
+	struct gitfs_search_node *root;
+	int retval;
+
+	if ((b.tree = gitfs_search_load_snapshot(&b.d->tree_oid))) {
+		__atomic_store_n(&b.d->search, b.tree, __ATOMIC_RELEASE);
+		return;
+	}
+
+	b.o = gitfs_odb_get(b.d->repo);
+	if (!(b.tree = calloc(1, sizeof(*b.tree))) || !(b.seen = calloc(1 << 24 >> 3, 1))) {
+		error("Failed to allocate memory for search index\n");
+		goto out;
+	}
+	b.tree->nodes = (struct gitfs_oid_table)GITFS_OID_TABLE_INIT(struct gitfs_search_node);
+	b.base = gitfs_search_load_base(&b);
+	if ((retval = gitfs_search_node_get(&b, &b.d->tree_oid, &root)) == 0) {
+		debug("Search index has %zu distinct trees\n", b.tree->nodes.count);
+		b.tree->root = root;
+		gitfs_search_save_snapshot(b.tree);
+		__atomic_store_n(&b.d->search, b.tree, __ATOMIC_RELEASE);
+		b.tree = NULL;
+	} else if (retval != -ECANCELED) {
+		error("Failed to build search index\n");
+	}
+
+out:
+	gitfs_search_tree_free(b.tree);
+	gitfs_search_tree_free(b.base);
+	free(b.seen);
+	gitfs_odb_put(b.o);
+}
+
+/* Start building the search index of d, when enabled */
+static void gitfs_search_start(struct gitfs_data *d) {
+	if (search_store.fd < 0)
+		return;
+	pthread_mutex_init(&d->search_lock, NULL);
+	gitfs_task_submit(&d->search_task, gitfs_search_main, d, GITFS_TASK_INDEX);
+}
+
+/* Stop building the search index of d, and free it */
+static void gitfs_search_stop(struct gitfs_data *d) {
+	struct gitfs_search_result *r, *next;
+
+	__atomic_store_n(&d->search_stop, true, __ATOMIC_RELAXED);
+	gitfs_task_cancel(&d->search_task);
+	for (r = d->search_results; r; r = next) {
+		next = r->next;
+		gitfs_search_put(r);
+	}
+	d->search_results = NULL;
+	gitfs_search_tree_free(d->search);
+	d->search = NULL;
+}
+
+static int gitfs_oid_qsort_cmp(const void *a, const void *b) {
+	return git_oid_cmp(a, b);
+}
+
+/* State of listing the paths of the files found by a search, see
+ * gitfs_search_paths */
+struct gitfs_search_paths {
+	/* The blobs containing the pattern, sorted */
+	git_oid *matches;
+	size_t match_count;
+	/* Per node (by index): 0 when not known yet whether any file
+	 * below it contains the pattern, 1 when none does, 2 when one
+	 * does */
+	uint8_t *found;
+	FILE *out;
+	size_t count;
+	char dir[PATH_MAX];
+};
+
+/* Returns whether any file below n contains the pattern, so trees
+ * without any are skipped (however often they occur) */
+static bool gitfs_search_found(struct gitfs_search_paths *s, struct gitfs_search_node *n) {
+	bool found = false;
+	size_t i;
+
+	if (s->found[n->index])
+		return s->found[n->index] == 2;
+	for (i = 0; i < n->count && !found; i++) {
+		if (n->entries[i].kind == GITFS_SEARCH_SUBTREE)
+			found = gitfs_search_found(s, n->entries[i].tree);
+		else
+			found = bsearch(&n->entries[i].oid, s->matches, s->match_count, sizeof(git_oid), gitfs_oid_qsort_cmp);
+	}
+	s->found[n->index] = found ? 2 : 1;
+	return found;
+}
+
+/* Write the paths of the files containing the pattern below n (which
+ * is at s->dir, which is len long) to s->out, each nul-terminated */
+static void gitfs_search_paths(struct gitfs_search_paths *s, struct gitfs_search_node *n, size_t len) {
+	struct gitfs_search_entry *e;
+	size_t i, name_len;
+
+	for (i = 0; i < n->count; i++) {
+		e = &n->entries[i];
+		name_len = strlen(e->name);
+		if (e->kind == GITFS_SEARCH_SUBTREE) {
+			if (len + name_len + 1 < sizeof(s->dir) && gitfs_search_found(s, e->tree)) {
+				sprintf(s->dir + len, "%s/", e->name);
+				gitfs_search_paths(s, e->tree, len + name_len + 1);
+			}
+		} else if (bsearch(&e->oid, s->matches, s->match_count, sizeof(git_oid), gitfs_oid_qsort_cmp)) {
+			fwrite(s->dir, len, 1, s->out);
+			fwrite(e->name, name_len + 1, 1, s->out);
+			s->count++;
+		}
+	}
+}
+
+/* Search the files of t for pattern (a plain string), filling r. Each
+ * distinct tree is only looked at once, and each distinct blob only
+ * read once. */
+static int gitfs_search_run(struct gitfs_data *d, struct gitfs_search_tree *t, const char *pattern,
+		struct gitfs_search_result *r) {
+	struct gitfs_search_paths *s = NULL;
+	size_t len = strlen(pattern), i, j, l, count = 0, capacity = 0, size;
+	const struct gitfs_search_blob *sb;
+	const struct gitfs_search_entry *e;
+	struct gitfs_search_node *n;
+	git_oid *candidates = NULL, *grown;
+	const uint8_t *store = NULL;
+	pid_t pid = fuse_get_context()->pid;
+	uint64_t store_size;
+	uint32_t trigram;
+	struct gitfs_odb *o;
+	git_odb_object *obj;
+	const char *p;
+	bool found;
+	int retval = 0, k;
+
+	/* Find the blobs that might contain pattern, by looking for its
+	 * trigrams in their filters. Blobs without a filter (too big,
+	 * or indexed while the store was unusable) must be read
+	 * anyway. */
+	pthread_mutex_lock(&search_store.lock);
+	store_size = search_store.size;
+	if (store_size)
+		store = mmap(NULL, store_size, PROT_READ, MAP_SHARED, search_store.fd, 0);
+	if (store == MAP_FAILED)
+		store = NULL;
+	for (i = 0; i < t->nodes.bucket_count && retval == 0; i++) {
+		for (n = t->nodes.buckets[i]; n && retval == 0; n = n->next) {
+			for (j = 0; j < n->count; j++) {
+				e = &n->entries[j];
+				if (e->kind == GITFS_SEARCH_SUBTREE)
+					continue;
+				sb = store && e->kind == GITFS_SEARCH_TEXT ? gitfs_search_find_blob(&e->oid) : NULL;
+				found = true;
+				for (l = 0; sb && sb->bits && found && l + 2 < len; l++) {
+					trigram = gitfs_trigram((const unsigned char *)pattern + l);
+					for (k = 0; found && k < GITFS_SEARCH_HASHES; k++)
+						found = store[sb->offset + gitfs_search_bit(trigram, k, sb->bits) / 8] &
+							1 << gitfs_search_bit(trigram, k, sb->bits) % 8;
+				}
+				if (!found)
+					continue;
+				if (count == capacity) {
+					capacity = capacity ? capacity * 2 : 64;
+					if (!(grown = realloc(candidates, capacity * sizeof(*candidates)))) {
+						retval = -ENOMEM;
+						break;
+					}
+					candidates = grown;
+				}
+				git_oid_cpy(&candidates[count++], &e->oid);
+			}
+		}
+	}
+	pthread_mutex_unlock(&search_store.lock);
+	if (store)
+		munmap((void *)store, store_size);
+	if (retval < 0) {
+		free(candidates);
+		return error("Failed to allocate memory for search\n"), -ENOMEM;
+	}
+
+	/* The same blob can be in any number of trees */
+	qsort(candidates, count, sizeof(*candidates), gitfs_oid_qsort_cmp);
+	for (i = 0, j = 0; i < count; i++) {
+		if (j == 0 || git_oid_cmp(&candidates[i], &candidates[j - 1]))
+			git_oid_cpy(&candidates[j++], &candidates[i]);
+	}
+	count = j;
+	debug("Searching %zu blobs for '%s'\n", count, pattern);
+
+	/* Then check the candidates, keeping those containing pattern
+	 * (still sorted). They are read straight from the object
+	 * database, not through the blob cache, which would otherwise
+	 * fill up with files nobody opened. */
+	o = gitfs_odb_get(d->repo);
+	for (i = 0, j = 0; i < count; i++) {
+		if (git_odb_read(&obj, o->odb, &candidates[i]) < 0) {
+			error("Blob not found?!: %s\n", giterr_last()->message);
+			retval = -EIO;
+			break;
+			break;
+		}
+		if (memmem(git_odb_object_data(obj), git_odb_object_size(obj), pattern, len))
+			git_oid_cpy(&candidates[j++], &candidates[i]);
+		gitfs_stats_add(pid, 0, 0, 0, git_odb_object_size(obj));
+		git_odb_object_free(obj);
+	}
+	gitfs_odb_put(o);
+
+	/* And list the paths they are found under */
+	if (retval == 0) {
+		if (!(s = calloc(1, sizeof(*s))) || !(s->found = calloc(t->nodes.count, 1)) ||
+		    !(s->out = open_memstream(&r->buf, &size))) {
+			retval = -ENOMEM;
+		} else {
+			s->matches = candidates;
+			s->match_count = j;
+			gitfs_search_paths(s, t->root, 0);
+			if (fclose(s->out) != 0 || !(r->paths = malloc((s->count + 1) * sizeof(*r->paths))))
+				retval = -ENOMEM;
+		}
+		if (retval < 0)
+			error("Failed to allocate memory for search\n");
+	}
+	if (retval == 0) {
+		for (p = r->buf; r->count < s->count; p += strlen(p) + 1)
+			r->paths[r->count++] = p;
+	}
+
+	if (s)
+		free(s->found);
+	free(s);
+	free(candidates);
+	return retval;
+}
+
+/* Release a search result */
+void gitfs_search_put(struct gitfs_search_result *r) {
+	if (__atomic_sub_fetch(&r->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(r->pattern);
+	free(r->paths);
+	free(r->buf);
+	free(r);
+}
+
+/* Find the result of searching for pattern in the mounted tree, from
+ * the recent searches or by searching. Returns -EAGAIN while the index
+ * is not built yet, and -EINVAL for patterns shorter than a trigram
+ * (which would have to read every file). The result must be released
+ * with gitfs_search_put. */
+static int gitfs_search(struct gitfs_data *d, const char *pattern, struct gitfs_search_result **out) {
+	struct gitfs_search_tree *t = __atomic_load_n(&d->search, __ATOMIC_ACQUIRE);
+	struct gitfs_search_result *r, **p;
+	size_t i;
+	int retval;
+
+	if (!t)
+		return -EAGAIN;
+	if (strlen(pattern) < 3)
+		return -EINVAL;
+
+	pthread_mutex_lock(&d->search_lock);
+	for (p = &d->search_results; (r = *p) && strcmp(r->pattern, pattern); p = &r->next)
+		;
+	if (r) {
+		/* Move it to the front */
+		*p = r->next;
+		r->next = d->search_results;
+		d->search_results = r;
+		/* gitfs_search_put doesn't take search_lock */
+		__atomic_add_fetch(&r->refcount, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&d->search_lock);
+	if (r) {
+		*out = r;
+		return 0;
+	}
+
+	if (!(r = calloc(1, sizeof(*r))) || !(r->pattern = strdup(pattern))) {
+		free(r);
+		return error("Failed to allocate memory for search\n"), -ENOMEM;
+	}
+	r->refcount = 2;
+	if ((retval = gitfs_search_run(d, t, pattern, r)) < 0) {
+		r->refcount = 1;
+		gitfs_search_put(r);
+		return retval;
+	}
+
+	/* Remember it (twice when searched for at the same time, which
+	 * is harmless), forgetting the oldest search */
+	pthread_mutex_lock(&d->search_lock);
+	r->next = d->search_results;
+	d->search_results = r;
+	for (i = 0, p = &d->search_results; *p && i < GITFS_SEARCH_RESULTS; i++)
+		p = &(*p)->next;
+	if (*p) {
+		gitfs_search_put(*p);
+		*p = NULL;
+	}
+	pthread_mutex_unlock(&d->search_lock);
+
+	*out = r;
+	return 0;
+}
+
+/* Entries in GITFS_SEARCH_PATH. /.git-fs-search/STRING is a directory
+ * with the files containing STRING, in their directories as in the
+ * mounted tree (so only the directories containing such files are
+ * there), e.g. "find /.git-fs-search/STRING -type f" lists them all. */
+int gitfs_lookup_search_entry(gitfs_entry **out, const char *path) {
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+	struct gitfs_search_result *r = NULL;
+	size_t len = strlen(GITFS_SEARCH_PATH), i;
+	const char *rest = "", *p;
+	char *pattern, *prefix;
+	int retval;
+
+	if (search_store.fd < 0 || strncmp(path, GITFS_SEARCH_PATH, len) || (path[len] && path[len] != '/'))
+		return -ENOENT;
+
+	path += len;
+	if (*path) {
+		/* Split /STRING/REST */
+		rest = strchrnul(path + 1, '/');
+		if (!(pattern = strndup(path + 1, rest - path - 1)))
+			return error("Failed to allocate memory for search\n"), -ENOMEM;
+		retval = gitfs_search(d, pattern, &r);
+		free(pattern);
+		if (retval < 0)
+			return retval;
+
+		if (*rest) {
+			/* Files are the files themselves */
+			for (i = 0; i < r->count; i++) {
+				if (!strcmp(r->paths[i], rest + 1)) {
+					gitfs_search_put(r);
+					return gitfs_lookup_git_entry(out, rest);
+				}
+			}
+			/* Directories only have files found */
+			for (i = 0, len = strlen(rest + 1); i < r->count; i++) {
+				p = r->paths[i];
+				if (!strncmp(p, rest + 1, len) && p[len] == '/')
+					break;
+			}
+			if (i == r->count) {
+				gitfs_search_put(r);
+				return -ENOENT;
+			}
+		}
+	}
+
+	if (!(*out = calloc(1, sizeof(gitfs_entry))) ||
+	    !(prefix = *rest ? malloc(strlen(rest) + 1) : strdup(""))) {
+		free(*out);
+		if (r)
+			gitfs_search_put(r);
+		return error("Failed to allocate memory for entry: '%s'\n", path), -ENOMEM;
+	}
+	/* The prefix of the paths of the files in the directory */
+	if (*rest)
+		sprintf(prefix, "%s/", rest + 1);
+	(*out)->type = GITFS_SEARCH;
+	(*out)->object.search.result = r;
+	(*out)->object.search.prefix = prefix;
+	return 0;
+}
+
+/* readdir for GITFS_SEARCH entries. Offsets are indexes into the
+ * result (plus one), the files of each directory being next to each
+ * other there. */
+static int gitfs_search_readdir(gitfs_entry *e, void *buf, fuse_fill_dir_t filler, off_t offset) {
+	struct gitfs_search_result *r = e->object.search.result;
+	const char *prefix = e->object.search.prefix, *name, *end, *last = NULL;
+	size_t len = strlen(prefix);
+	char component[NAME_MAX + 1];
+
+	if (!r)
+		return 0;
+
+	/* Don't repeat the directory added last time */
+	if (offset > 0 && offset <= r->count && !strncmp(r->paths[offset - 1], prefix, len))
+		last = r->paths[offset - 1] + len;
+
+	for (; offset < r->count; offset++) {
+		if (strncmp(r->paths[offset], prefix, len))
+			continue;
+		name = r->paths[offset] + len;
+		end = strchrnul(name, '/');
+		if (last && !strncmp(last, name, end - name) && (last[end - name] == '/' || !last[end - name]))
+			continue;
+		last = name;
+
+		if (end - name > NAME_MAX)
+			continue;
+		memcpy(component, name, end - name);
+		component[end - name] = '\0';
+		if (filler(buf, component, NULL, offset + 1) == 1)
+			return 0;
+	}
+	return 0;
+}
+
+/* Path queries. Reading /.git-fs-find/GLOB gives the paths of all
+ * files and directories whose name matches GLOB (like find -name), one
+ * per line, instead of walking all directories through the kernel.
+ * Paths come from a list of all paths in the mounted tree, which is
+ * built (reading only trees) on the first query. */
+#define GITFS_FIND_PATH "/.git-fs-find"
+
+struct gitfs_path_list {
+	/* All paths in tree order, each with a leading slash and
+	 * nul-terminated */
+	char *paths;
+	size_t size, capacity;
+	/* Where each path starts in paths */
+	size_t *offsets;
+	size_t count;
+};
+
+static void gitfs_path_list_free(struct gitfs_path_list *l) {
+	if (!l)
+		return;
+	free(l->paths);
+	free(l->offsets);
+	free(l);
+}
+
+static int gitfs_path_list_walk(const char *root, const git_tree_entry *entry, void *data) {
+	struct gitfs_path_list *l = data;
+	size_t len = 1 + strlen(root) + strlen(git_tree_entry_name(entry)) + 1;
+	size_t *offsets;
+	char *paths;
+
+	/* Submodules are not shown */
+	if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT)
+		return 0;
+
+	/* Grow by doubling, whenever the count reaches a power of two */
+	if (!(l->count & (l->count - 1))) {
+		if (!(offsets = realloc(l->offsets, (l->count ? l->count * 2 : 1024) * sizeof(*offsets))))
+			return -1;
+		l->offsets = offsets;
+	}
+	if (l->size + len > l->capacity) {
+		if (!(paths = realloc(l->paths, l->capacity * 2 + len)))
+			return -1;
+		l->paths = paths;
+		l->capacity = l->capacity * 2 + len;
+	}
+
+	l->offsets[l->count++] = l->size;
+	sprintf(l->paths + l->size, "/%s%s", root, git_tree_entry_name(entry));
+	l->size += len;
+	return 0;
+}
+
+/* Returns the list of all paths of the mounted tree, building it when
+ * needed */
+static struct gitfs_path_list *gitfs_path_list(struct gitfs_data *d) {
+	struct gitfs_path_list *l;
+	struct gitfs_odb *o;
+	git_tree *root;
+
+	pthread_mutex_lock(&d->paths_lock);
+	if ((l = d->paths))
+		goto out;
+
+	if (!(l = calloc(1, sizeof(*l)))) {
+		error("Failed to allocate memory for path list\n");
+		goto out;
+	}
+	o = gitfs_odb_get(d->repo);
+	if (git_tree_lookup(&root, o->repo, &d->tree_oid) < 0) {
+		error("Failed to lookup root tree: %s\n", giterr_last()->message);
+		gitfs_path_list_free(l);
+		l = NULL;
+	} else {
+		if (git_tree_walk(root, GIT_TREEWALK_PRE, gitfs_path_list_walk, l) != 0) {
+			error("Failed to list paths\n");
+			gitfs_path_list_free(l);
+			l = NULL;
+		}
+		git_tree_free(root);
+	}
+	gitfs_odb_put(o);
+	d->paths = l;
+out:
+	pthread_mutex_unlock(&d->paths_lock);
+	return l;
+}
+
+/* Format the result of a path query for glob */
+static char *gitfs_find_format(struct gitfs_data *d, const char *glob, size_t *len) {
+	struct gitfs_path_list *l = gitfs_path_list(d);
+	const char *path;
+	char *buf = NULL;
+	FILE *out;
+	size_t i;
+
+	if (!l || !(out = open_memstream(&buf, len)))
+		return NULL;
+	for (i = 0; i < l->count; i++) {
+		path = l->paths + l->offsets[i];
+		if (fnmatch(glob, strrchr(path, '/') + 1, 0) == 0)
+			fprintf(out, "%s\n", path);
+	}
+	if (fclose(out) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* Entries in GITFS_FIND_PATH, which is an empty directory with a file
+ * for each possible query */
+int gitfs_lookup_find_entry(gitfs_entry **out, const char *path) {
+	size_t len = strlen(GITFS_FIND_PATH);
+
+	if (strncmp(path, GITFS_FIND_PATH, len) || (path[len] && path[len] != '/') ||
+	    (path[len] && strchr(path + len + 1, '/')))
+		return -ENOENT;
+
+	if (!(*out = calloc(1, sizeof(gitfs_entry))))
+		return error("Failed to allocate memory for entry: '%s'\n", path), -ENOMEM;
+	if (path[len]) {
+		(*out)->type = GITFS_FIND;
+	} else if (!((*out)->object.search.prefix = strdup(""))) {
+		free(*out);
+		return error("Failed to allocate memory for entry: '%s'\n", path), -ENOMEM;
+	} else {
+		/* Just like GITFS_SEARCH_PATH */
+		(*out)->type = GITFS_SEARCH;
+	}
+	return 0;
+}
+
+/* Content digests. With the digest-index option, the SHA-256 digest of
+ * every regular file of the mounted tree is computed in the background.
+ * Digests are stored by blob oid, in a single store shared by all trees
+ * (and mounts, and runs), so each blob is only ever hashed once: a new
+ * release only costs hashing the blobs that changed. The digest of a
+ * file is its GITFS_XATTR_SHA256 extended attribute, and
+ * GITFS_MANIFEST_PATH lists the digests of all files. */
+
+#define GITFS_MANIFEST_PATH "/.git-fs-manifest"
+#define GITFS_XATTR_SHA256 "user.git-fs.sha256"
+
+/* Start of the store, which is followed by fixed-size records of a
+ * blob oid and its digest */
+#define GITFS_DIGEST_MAGIC "gfsdgs1\n"
+#define GITFS_DIGEST_MAGIC_LEN 8
+#define GITFS_DIGEST_SIZE 32
+#define GITFS_DIGEST_RECORD (GIT_OID_RAWSZ + GITFS_DIGEST_SIZE)
+
+struct gitfs_digest {
+	git_oid oid;
+	unsigned char sha256[GITFS_DIGEST_SIZE];
+	struct gitfs_digest *next;
+};
+
+/* The store of digests, which is only ever appended to */
+static struct {
+	/* Opened before chrooting */
+	int fd;
+	uint64_t size;
+	pthread_mutex_t lock;
+	/* All digests in the store */
+	struct gitfs_oid_table digests;
+} digest_store = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.digests = GITFS_OID_TABLE_INIT(struct gitfs_digest),
+};
+
+/* Returns the digest of the blob with the given oid, or NULL. Must be
+ * called with digest_store.lock held. */
+static struct gitfs_digest *gitfs_digest_find(const git_oid *oid) {
+	return gitfs_oid_table_find(&digest_store.digests, oid);
+}
+
+/* Add a digest to the hash table. Must be called with
+ * digest_store.lock held. */
+static int gitfs_digest_insert(const git_oid *oid, const unsigned char *sha256) {
+	struct gitfs_digest *g;
+
+	if (!(g = malloc(sizeof(*g))))
+		return error("Failed to allocate memory for digest index\n"), -ENOMEM;
+	git_oid_cpy(&g->oid, oid);
+	memcpy(g->sha256, sha256, GITFS_DIGEST_SIZE);
+	if (gitfs_oid_table_add(&digest_store.digests, g) < 0) {
+		free(g);
+		return error("Failed to allocate memory for digest index\n"), -ENOMEM;
+	}
+	return 0;
+}
+
+/* Load the digests in the store from offset up to size (the size of
+ * the file). Returns the end of the last complete record, or -1 on
+ * errors. */
+static int64_t gitfs_digest_load(uint64_t offset, uint64_t size) {
+	unsigned char record[GITFS_DIGEST_RECORD];
+	git_oid oid;
+
+	for (; offset + sizeof(record) <= size; offset += sizeof(record)) {
+		if (pread(digest_store.fd, record, sizeof(record), offset) != sizeof(record))
+			break;
+		memcpy(oid.id, record, GIT_OID_RAWSZ);
+		if (!gitfs_digest_find(&oid) && gitfs_digest_insert(&oid, record + GIT_OID_RAWSZ) < 0)
+			return -1;
+	}
+	return offset;
+}
+
+/* Open the digest index in path (creating it when needed) and load
+ * its digests. Must be called before chrooting. */
+static int gitfs_digest_open(const char *path) {
+	char magic[GITFS_DIGEST_MAGIC_LEN];
+	int64_t offset;
+	struct stat st;
+
+	if ((digest_store.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+	    fstat(digest_store.fd, &st) < 0)
+		return error("%s: Failed to open digest index: %s\n", path, strerror(errno)), -1;
+
+	if (st.st_size == 0) {
+		if (pwrite(digest_store.fd, GITFS_DIGEST_MAGIC, GITFS_DIGEST_MAGIC_LEN, 0) != GITFS_DIGEST_MAGIC_LEN)
+			return error("%s: Failed to write digest index: %s\n", path, strerror(errno)), -1;
+		digest_store.size = GITFS_DIGEST_MAGIC_LEN;
+		return 0;
+	}
+	if (pread(digest_store.fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+	    memcmp(magic, GITFS_DIGEST_MAGIC, sizeof(magic)))
+		return error("%s: Not a digest index\n", path), -1;
+
+	if ((offset = gitfs_digest_load(GITFS_DIGEST_MAGIC_LEN, st.st_size)) < 0)
+		return -1;
+
+	/* A partially written record (e.g. after a crash) is just
+	 * overwritten by the next one */
+	if (offset != st.st_size)
+		debug("Ignoring the end of the digest index after %llu bytes\n", (unsigned long long)offset);
+	digest_store.size = offset;
+	return 0;
+}
+
+/* Find the digest of the blob with the given oid, computing (and
+ * storing) it when needed */
+static int gitfs_digest_get(struct gitfs_odb *o, const git_oid *oid, unsigned char *sha256) {
+	unsigned char record[GITFS_DIGEST_RECORD];
+	struct gitfs_digest *g;
+	git_odb_object *obj;
+	struct stat st;
+	int64_t end;
+	int retval = 0;
+
+	pthread_mutex_lock(&digest_store.lock);
+	if ((g = gitfs_digest_find(oid)))
+		memcpy(sha256, g->sha256, GITFS_DIGEST_SIZE);
+	pthread_mutex_unlock(&digest_store.lock);
+	if (g)
+		return 0;
+
+	/* Read past the blob cache, so hashing everything doesn't push
+	 * out what is actually used */
+	if (git_odb_read(&obj, o->odb, oid) < 0)
+		return error("Blob not found?!: %s\n", giterr_last()->message), -EIO;
+	if (drop_pack_cache)
+		gitfs_odb_drop_cached(o, oid);
+	if (!EVP_Digest(git_odb_object_data(obj), git_odb_object_size(obj), sha256, NULL, EVP_sha256(), NULL)) {
+		git_odb_object_free(obj);
+		return error("Failed to compute digest\n"), -EIO;
+	}
+	git_odb_object_free(obj);
+
+	memcpy(record, oid->id, GIT_OID_RAWSZ);
+	memcpy(record + GIT_OID_RAWSZ, sha256, GITFS_DIGEST_SIZE);
+
+	pthread_mutex_lock(&digest_store.lock);
+	/* Other processes using the same index append to it as well, see
+	 * gitfs_search_add_blob */
+	if (flock(digest_store.fd, LOCK_EX) < 0 || fstat(digest_store.fd, &st) < 0) {
+		error("Failed to lock digest index: %s\n", strerror(errno));
+		pthread_mutex_unlock(&digest_store.lock);
+		return -EIO;
+	}
+	end = digest_store.size;
+	if ((uint64_t)st.st_size > digest_store.size)
+		end = gitfs_digest_load(digest_store.size, st.st_size);
+
+	if (end < 0) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	digest_store.size = end;
+
+	/* Another thread (or process) might have hashed it in the
+	 * meanwhile */
+	if (!gitfs_digest_find(oid)) {
+		if (pwrite(digest_store.fd, record, sizeof(record), digest_store.size) != sizeof(record)) {
+			error("Failed to write digest index: %s\n", strerror(errno));
+			retval = -EIO;
+		} else if ((retval = gitfs_digest_insert(oid, sha256)) == 0) {
+			digest_store.size += sizeof(record);
+		}
+	}
+out:
+	flock(digest_store.fd, LOCK_UN);
+	pthread_mutex_unlock(&digest_store.lock);
+	return retval;
+}
+
+/* State of gitfs_digest_walk */
+struct gitfs_digest_build {
+	struct gitfs_data *d;
+	struct gitfs_odb *o;
+	/* The manifest being written, or NULL when only computing */
+	FILE *out;
+	int retval;
+};
+
+/* Write a line of the manifest, in the format of sha256sum (so
+ * sha256sum -c checks it when run in the mountpoint): paths with a
+ * backslash or newline start with a backslash, and have those
+ * escaped */
+static void gitfs_manifest_line(FILE *out, const unsigned char *sha256, const char *root, const char *name) {
+	bool escape = strpbrk(root, "\\\n") || strpbrk(name, "\\\n");
+	const char *parts[2] = { root, name }, *p;
+	int i;
+
+	if (escape)
+		fputc('\\', out);
+	for (i = 0; i < GITFS_DIGEST_SIZE; i++)
+		fprintf(out, "%02x", sha256[i]);
+	fputs("  ", out);
+	for (i = 0; i < 2; i++) {
+		for (p = parts[i]; *p; p++) {
+			if (escape && *p == '\\')
+				fputs("\\\\", out);
+			else if (escape && *p == '\n')
+				fputs("\\n", out);
+			else
+				fputc(*p, out);
+		}
+	}
+	fputc('\n', out);
+}
+
+static int gitfs_digest_walk(const char *root, const git_tree_entry *entry, void *data) {
+	struct gitfs_digest_build *b = data;
+	unsigned char sha256[GITFS_DIGEST_SIZE];
+
+	/* Only in the background, not while writing the manifest for a
+	 * request */
+	if (!b->out)
+		gitfs_task_yield(&b->d->digest_stop);
+	if (__atomic_load_n(&b->d->digest_stop, __ATOMIC_RELAXED)) {
+		b->retval = -ECANCELED;
+		return -1;
+	}
+	/* Only regular files, symlinks just point elsewhere */
+	if (git_tree_entry_type(entry) != GIT_OBJ_BLOB || !S_ISREG(git_tree_entry_filemode(entry)))
+		return 0;
+
+	if ((b->retval = gitfs_digest_get(b->o, git_tree_entry_id(entry), sha256)) < 0)
+		return -1;
+	if (b->out)
+		gitfs_manifest_line(b->out, sha256, root, git_tree_entry_name(entry));
+	return 0;
+}
+
+/* Walk all files of the mounted tree, computing their digests and
+ * writing them to out (when not NULL) */
+static int gitfs_digest_tree(struct gitfs_data *d, FILE *out) {
+	struct gitfs_digest_build b = { .d = d, .out = out };
+	git_tree *root;
+
+	b.o = gitfs_odb_get(d->repo);
+	if (git_tree_lookup(&root, b.o->repo, &d->tree_oid) < 0) {
+		error("Failed to lookup root tree: %s\n", giterr_last()->message);
+		b.retval = -EIO;
+	} else {
+		git_tree_walk(root, GIT_TREEWALK_PRE, gitfs_digest_walk, &b);
+		git_tree_free(root);
+	}
+	gitfs_odb_put(b.o);
+	return b.retval;
+}
+
+/* Compute the digests of the mounted tree in the background */
+static void gitfs_digest_main(void *data) {
+	struct gitfs_data *d = data;
+	int retval;
+
+	if ((retval = gitfs_digest_tree(d, NULL)) == 0)
+		__atomic_store_n(&d->digests_done, true, __ATOMIC_RELEASE);
+	else if (retval != -ECANCELED)
+		error("Failed to compute digests\n");
+}
+
+/* Start computing the digests of d, when enabled */
+static void gitfs_digest_start(struct gitfs_data *d) {
+	if (digest_store.fd >= 0)
+		gitfs_task_submit(&d->digest_task, gitfs_digest_main, d, GITFS_TASK_DIGEST);
+}
+
+static void gitfs_digest_stop(struct gitfs_data *d) {
+	__atomic_store_n(&d->digest_stop, true, __ATOMIC_RELAXED);
+	gitfs_task_cancel(&d->digest_task);
+}
+
+/* Format the manifest of the mounted tree. Fails with EAGAIN while the
+ * digests are still being computed, since it would take too long to
+ * compute them all here. */
+static int gitfs_manifest_format(struct gitfs_data *d, char **buf, size_t *len) {
+	FILE *out;
+	int retval;
+
+	if (!__atomic_load_n(&d->digests_done, __ATOMIC_ACQUIRE))
+		return -EAGAIN;
+
+	*buf = NULL;
+	if (!(out = open_memstream(buf, len)))
+		return error("Failed to allocate memory for manifest\n"), -ENOMEM;
+	retval = gitfs_digest_tree(d, out);
+	if (fclose(out) != 0 && retval == 0) {
+		error("Failed to allocate memory for manifest\n");
+		retval = -ENOMEM;
+	}
+	if (retval < 0) {
+		free(*buf);
+		*buf = NULL;
+	}
+	return retval;
+}
+
+int gitfs_lookup_manifest_entry(gitfs_entry **out, const char *path) {
+	if (digest_store.fd < 0 || strcmp(path, GITFS_MANIFEST_PATH))
+		return -ENOENT;
+
+	if (!(*out = calloc(1, sizeof(gitfs_entry))))
+		return error("Failed to allocate memory for entry: '%s'\n", path), -ENOMEM;
+	(*out)->type = GITFS_MANIFEST;
+	return 0;
+}
+
+int gitfs_lookup_entry(gitfs_entry **out, const char *path) {
+	int retval = gitfs_lookup_git_entry(out, path);
+
+	/* Path not found in git, see if it's one of the magic oid paths */
+	if (retval == -ENOENT)
+		retval = gitfs_lookup_oid_entry(out, path);
+	if (retval == -ENOENT)
+		retval = gitfs_lookup_stats_entry(out, path);
+	if (retval == -ENOENT)
+		retval = gitfs_lookup_search_entry(out, path);
+	if (retval == -ENOENT)
+		retval = gitfs_lookup_find_entry(out, path);
+	if (retval == -ENOENT)
+		retval = gitfs_lookup_manifest_entry(out, path);
+
+	if (retval == -ENOENT)
+		debug("File not found: '%s'\n", path);
+
+	return retval;
+}
+
+/* Load the blob contents for a GITFS_FILE entry */
+int gitfs_entry_load_blob(gitfs_entry *e) {
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+
+	if (e->type != GITFS_FILE || e->object.blob)
+		return 0;
+	return gitfs_blob_get(&e->object.blob, d->repo, git_tree_entry_id(e->tree_entry), fuse_get_context()->pid);
+}
+
+/**
+ * Initialize an oid entry, which is a magic file inside / that contains
+ * an oid. Path must be the pathname, including leading /. The pointer
+ * in path must not be freed until gitfs_destroy, since it is used as is
+ * (e.g., a string constant is perfect).
+ */
+int gitfs_init_oid_entry(struct gitfs_data *d, const char *path, const git_oid* oid)
+{
+	/* Disabled, skip */
+	if (d->no_oid_files)
+		return 0;
+
+	/* Check if the statically allocated oid_entries array is long
+	 * enough. This is a sanity check, this can only occur when the
+	 * code is (incorrectly) modified. */
+	if (d->oid_entry_count == lengthof(d->oid_entries))
+		return error("oid_entries is nog long enough?!\n"), -ENOMEM;
+
+	/* Copy the path (pointer) */
+	d->oid_paths[d->oid_entry_count] = path;
+
+	/* Fill the entry */
+	gitfs_entry *e = &d->oid_entries[d->oid_entry_count];
+	e->tree_entry = NULL;
+	e->type = GITFS_OID;
+
+	e->object.oid = malloc(GIT_OID_HEXSZ + 1);
+	if (!e->object.oid)
+		return error("Could not allocate memory for oid file contents (%s)\n", path), -ENOMEM;
+	git_oid_fmt(e->object.oid, oid);
+	e->object.oid[GIT_OID_HEXSZ] = '\n';
+
+	d->oid_entry_count++;
+
+	return 0;
+}
+
+int gitfs_open(const char *path, struct fuse_file_info *fi)
+{
+	gitfs_entry *e;
+	int retval;
+
+	/* Find the corresponding entry and store it inside the fh
+	 * member, for use in other operations. */
+	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
+		return retval;
+
+	if ((retval = gitfs_entry_load_blob(e)) < 0) {
+		gitfs_entry_free(e);
+		return retval;
+	}
+
+	if (e->type == GITFS_FILE)
+		gitfs_stats_open(path);
+
+	if (e->type == GITFS_STATS) {
+		/* Take a snapshot, which doesn't have a size known in
+		 * advance (and differs on every open) */
+		if (!(e->object.text.data = gitfs_stats_format(&e->object.text.size))) {
+			gitfs_entry_free(e);
+			return error("Failed to format statistics\n"), -ENOMEM;
+		}
+		fi->direct_io = 1;
+	}
+
+	if (e->type == GITFS_FIND) {
+		/* Same here, the glob is the name of the file */
+		struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+		if (!(e->object.text.data = gitfs_find_format(d, strrchr(path, '/') + 1, &e->object.text.size))) {
+			gitfs_entry_free(e);
+			return error("Failed to find paths\n"), -ENOMEM;
+		}
+		fi->direct_io = 1;
+	}
+
+	if (e->type == GITFS_MANIFEST) {
+		struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+		if ((retval = gitfs_manifest_format(d, &e->object.text.data, &e->object.text.size)) < 0) {
+			gitfs_entry_free(e);
+			return retval;
+		}
+		fi->direct_io = 1;
+	}
+
+	fi->fh = (intptr_t)e;
+	return 0;
+}
+
+int gitfs_release(const char *path, struct fuse_file_info *fi)
+{
+	/* Free the gitfs_entry pointer in fh */
+	if(fi->fh)
+		gitfs_entry_free(GITFS_FH(fi));
+	return 0;
+}
+
+/* The recursive size of a tree, see gitfs_tree_size */
+struct gitfs_tree_size {
+	git_oid oid;
+	/* The total size of all blobs below the tree, and their
+	 * number, once done */
+	uint64_t bytes, files;
+	bool done;
+	/* Whether the task computing it is queued or running, and the
+	 * object database instance to walk the tree in meanwhile */
+	bool queued;
+	struct gitfs_odb *odb;
+	struct gitfs_task task;
+	struct gitfs_tree_size *next;
+};
+
+/* Process-wide memo of recursive tree sizes, by tree oid. Trees never
+ * change, so entries never go stale, and subtrees shared by several
+ * directories (or revisions, or mounts) are only walked once. Sizes
+ * are computed by background tasks, one for each tree asked for (not
+ * done yet). */
+static struct {
+	pthread_mutex_t lock;
+	struct gitfs_oid_table trees;
+} tree_sizes = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.trees = GITFS_OID_TABLE_INIT(struct gitfs_tree_size),
+};
+
+/* Extended attributes of directories with their recursive sizes, named
+ * after the equivalents of CephFS */
+#define GITFS_XATTR_RBYTES "user.git-fs.rbytes"
+#define GITFS_XATTR_RFILES "user.git-fs.rfiles"
+
+/* Memoise the size of a tree. Failing to allocate memory is not an
+ * error, the size is just computed again next time. */
+static void gitfs_tree_size_done(const git_oid *oid, uint64_t bytes, uint64_t files) {
+	struct gitfs_tree_size *t;
+
+	pthread_mutex_lock(&tree_sizes.lock);
+	if (!(t = gitfs_oid_table_find(&tree_sizes.trees, oid))) {
+		if ((t = calloc(1, sizeof(*t)))) {
+			git_oid_cpy(&t->oid, oid);
+			if (gitfs_oid_table_add(&tree_sizes.trees, t) < 0) {
+				free(t);
+				t = NULL;
+			}
+		}
+	}
+	if (t) {
+		t->bytes = bytes;
+		t->files = files;
+		t->done = true;
+	}
+	pthread_mutex_unlock(&tree_sizes.lock);
+}
+
+/* Find the total size (in bytes) and number of the files below the
+ * tree with the given oid, walking the tree (and reading the headers
+ * of its blobs) unless memoised, and memoising its subtrees on the
+ * way. Submodules are not counted. */
+static int gitfs_tree_size_walk(struct gitfs_odb *o, const git_oid *oid, uint64_t *bytes, uint64_t *files) {
+	const git_tree_entry *te;
+	struct gitfs_tree_size *t;
+	uint64_t sub_bytes, sub_files;
+	git_tree *tree;
+	git_otype type;
+	size_t i, size;
+	int retval = 0;
+	bool done;
+
+	pthread_mutex_lock(&tree_sizes.lock);
+	t = gitfs_oid_table_find(&tree_sizes.trees, oid);
+	if ((done = t && t->done)) {
+		*bytes = t->bytes;
+		*files = t->files;
+	}
+	pthread_mutex_unlock(&tree_sizes.lock);
+	if (done)
+		return 0;
+
+	gitfs_task_yield(NULL);
+	if (git_tree_lookup(&tree, o->repo, oid) < 0)
+		return error("Tree not found?!: %s\n", giterr_last()->message), -EIO;
+
+	*bytes = *files = 0;
+	for (i = 0; i < git_tree_entrycount(tree) && retval == 0; i++) {
+		te = git_tree_entry_byindex(tree, i);
+		switch (git_tree_entry_type(te)) {
+			case GIT_OBJ_TREE:
+				if ((retval = gitfs_tree_size_walk(o, git_tree_entry_id(te), &sub_bytes, &sub_files)) == 0) {
+					*bytes += sub_bytes;
+					*files += sub_files;
+				}
+				break;
+			case GIT_OBJ_BLOB:
+				if (git_odb_read_header(&size, &type, o->odb, git_tree_entry_id(te)) < 0) {
+					error("Blob not found?!: %s\n", giterr_last()->message);
+					retval = -EIO;
+					break;
+				}
+				*bytes += size;
+				(*files)++;
+				break;
+			default:
+				break;
+		}
+	}
+	git_tree_free(tree);
+	if (retval == 0)
+		gitfs_tree_size_done(oid, *bytes, *files);
+	return retval;
+}
+
+/* Compute the size of a queued tree, see gitfs_tree_size */
+static void gitfs_tree_size_run(void *data) {
+	struct gitfs_tree_size *t = data;
+	struct gitfs_odb *o = t->odb;
+	uint64_t bytes, files;
+
+	/* On errors, the size stays unknown, and the tree is queued
+	 * again when asked for next time. The entry itself is kept,
+	 * since the pool still uses its task when this returns. */
+	gitfs_tree_size_walk(o, &t->oid, &bytes, &files);
+	pthread_mutex_lock(&tree_sizes.lock);
+	t->queued = false;
+	t->odb = NULL;
+	pthread_mutex_unlock(&tree_sizes.lock);
+	gitfs_odb_put(o);
+}
+
+/* Find the total size (in bytes) and number of the files below the
+ * tree with the given oid (in the object database instance o). Trees
+ * can be huge, so unless memoised this doesn't wait for the size, but
+ * queues the tree to be walked in the background and returns -EAGAIN
+ * (as it does until the walk is done). */
+static int gitfs_tree_size(struct gitfs_odb *o, const git_oid *oid, uint64_t *bytes, uint64_t *files) {
+	struct gitfs_tree_size *t;
+	int retval = -EAGAIN;
+
+	pthread_mutex_lock(&tree_sizes.lock);
+	if (!(t = gitfs_oid_table_find(&tree_sizes.trees, oid)) && (t = calloc(1, sizeof(*t)))) {
+		git_oid_cpy(&t->oid, oid);
+		if (gitfs_oid_table_add(&tree_sizes.trees, t) < 0) {
+			free(t);
+			t = NULL;
+		}
+	}
+	if (t && t->done) {
+		*bytes = t->bytes;
+		*files = t->files;
+		retval = 0;
+	} else if (t && !t->queued) {
+		__atomic_add_fetch(&o->refcount, 1, __ATOMIC_RELAXED);
+		t->odb = o;
+		if (gitfs_task_submit(&t->task, gitfs_tree_size_run, t, GITFS_TASK_SIZE) == 0) {
+			t->queued = true;
+		} else {
+			t->odb = NULL;
+			gitfs_odb_put(o);
+		}
+	}
+	pthread_mutex_unlock(&tree_sizes.lock);
+	return retval;
+}
+
+int gitfs_getattr(const char *path, struct stat *stbuf)
+{
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+	int retval = 0;
+	debug("Getattr called for '%s'\n", path);
+	gitfs_entry *e = NULL;
+	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
+		goto out;
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	/* Set all times to the only time we (might) have available: The
+	 * time the commit we're working with was made. Note that we
+	 * _could_ search back through history to find the real times,
+	 * of files, but this is time-consuming and probably not worth
+	 * the trouble (right now). */
+	stbuf->st_atime = d->commit_time;
+	stbuf->st_ctime = d->commit_time;
+	stbuf->st_mtime = d->commit_time;
+
+	if (e->type == GITFS_DIR || e->type == GITFS_SEARCH) {
+		debug( "Path is a directory: '%s'\n", path);
+		stbuf->st_nlink = 2;
+		stbuf->st_mode = 040755;
+		stbuf->st_size = 4096;
+		/* Only the size, st_blocks is left alone so du (which
+		 * adds up the blocks of everything itself) still
+		 * works. Until computed, the plain size is reported. */
+		if (d->dir_sizes && e->type == GITFS_DIR) {
+			uint64_t bytes, files;
+			if (gitfs_tree_size(e->odb, git_tree_id(e->object.tree), &bytes, &files) == 0)
+				stbuf->st_size = bytes;
+		}
+	} else if (e->type == GITFS_FILE) {
+		debug( "Path is a file: '%s'\n", path);
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = git_tree_entry_filemode(e->tree_entry);
+		/* Override the permissions for links, since git just
+		 * stores the link type bit. */
+		if (S_ISLNK(stbuf->st_mode))
+			stbuf->st_mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
+		/* Note that this gives the length of the filename for
+		 * symlinks, but that's what native filesystems do as
+		 * well. Only read the object header, so the blob doesn't
+		 * need to be inflated. */
+		size_t size;
+		git_otype type;
+		struct gitfs_odb *o = gitfs_odb_get(d->repo);
+		int found = git_odb_read_header(&size, &type, o->odb, git_tree_entry_id(e->tree_entry));
+		gitfs_odb_put(o);
+		if (found < 0) {
+			error("Blob not found?!: '%s'\n", path);
+			retval = -EIO;
+			goto out;
+		}
+		stbuf->st_size = size;
+	} else if (e->type == GITFS_OID) {
+		debug( "Path is a special oid file: '%s'\n", path);
+		stbuf->st_nlink = 1;
+		/* Read-only for everyone */
+		stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+		stbuf->st_size = GIT_OID_HEXSZ + 1;
+	} else if (e->type == GITFS_STATS || e->type == GITFS_FIND || e->type == GITFS_MANIFEST) {
+		debug( "Path is a generated file: '%s'\n", path);
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+		/* Read with direct_io, so the size doesn't matter */
+		stbuf->st_size = 0;
+	} else {
+		error("Unsupported type?!\n");
+		retval = -EIO;
+		goto out;
+	}
+
+	stbuf->st_gid = 0;
+	stbuf->st_uid = 0;
+
+	/* Also used as the node id, see gitfs_node_ids_in */
+	if (d->nfs_export)
+		stbuf->st_ino = gitfs_path_ino(path);
+
+out:
+	if (e)
+		gitfs_entry_free(e);
+
+	return retval;
+}
+
+int gitfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi)
+{
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+	debug("readdir called for '%s'\n", path);
+	gitfs_entry *e = GITFS_FH(fi);
+	if (e->type == GITFS_SEARCH)
+		return gitfs_search_readdir(e, buf, filler, offset);
+	if (e->type != GITFS_DIR)
+		return debug("Path is not a directory?!: '%s'\n", path), -EIO;
+
+	int entry_count = git_tree_entrycount(e->object.tree);
+	while (offset < (entry_count)) {
+		const git_tree_entry *entry = git_tree_entry_byindex(e->object.tree, offset);
+		/* Add the entry to the list. The offset passed is the
+		 * offset to the _next_ entry. If filler returns 1, buf
+		 * is full, and we should stop trying to add entries.
+		 * Note that the the last entry is _not_ added in this
+		 * case. Future calls readdir will have offset
+		 * appropriately set to the value passed to filler with
+		 * the last successful addition. */
+		if (filler(buf, git_tree_entry_name(entry), NULL, offset + 1) == 1)
+			return 0;
+		offset++;
+	}
+
+	if (path[0] == '/' && path[1] == '\0') {
+		/* Dirlisting of root dir /, insert all magic oid paths
+		 * first. */
+		while (offset - entry_count < d->oid_entry_count) {
+			/* Note that we skip the first char of
+			 * object.oid.path, which is a leading / for
+			 * easy comparison in gitfs_lookup_oid_entry. */
+			if (filler(buf, d->oid_paths[offset - entry_count] + 1, NULL, offset + 1) == 1)
+				return 0;
+			offset++;
+		}
+	}
+
+
+	return 0;
+}
+
+/* The contents a read should be answered with, left by gitfs_read for
+ * gitfs_chan_send. libfuse sends the buffer it passed to gitfs_read as
+ * is (one of the iovecs passed to the channel), so the channel can send
+ * the contents straight from where they are instead, without copying
+ * them into that buffer first. The contents stay valid until then: an
+ * open file holds a reference to its blob (which keeps it from being
+ * evicted or compressed), and the kernel only releases a file once
+ * every read on it is answered. */
+static __thread struct {
+	/* Set in worker threads, which send replies through
+	 * gitfs_chan_send */
+	bool enabled;
+	/* The buffer of libfuse the contents belong in, or NULL */
+	char *buf;
+	const void *data;
+	size_t size;
+} read_reply;
+
+int gitfs_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	debug("read called for '%s' (offset %d, size %d)\n", path, offset, size);
+	size_t blob_size;
+	const void *blob;
+	int retval;
+
+	gitfs_entry *e = GITFS_FH(fi);
+	debug("type %d\n", e->type);
+	switch (e->type) {
+		case GITFS_FILE:
+			if (!S_ISREG(git_tree_entry_filemode(e->tree_entry)))
+				return error("Path is not a regular file?!: '%s'\n", path), -EIO;
+			/* Large blobs might not be inflated this far yet */
+			if ((retval = gitfs_stream_read(e->object.blob, &e->read_next, offset, offset + size)) < 0)
+				return retval;
+			blob_size = e->object.blob->size;
+			blob = e->object.blob->data;
+			break;
+		case GITFS_OID:
+			blob_size = GIT_OID_HEXSZ + 1;
+			blob = e->object.oid;
+			break;
+		case GITFS_STATS:
+		case GITFS_FIND:
+		case GITFS_MANIFEST:
+			blob_size = e->object.text.size;
+			blob = e->object.text.data;
+			break;
+		default:
+			return error("Path is not a file?!: '%s'\n", path), -EIO;
+	}
+
+	if (offset >= blob_size)
+		size = 0;
+	else if (offset + size > blob_size)
+		size = blob_size - offset;
+
+	if (size && read_reply.enabled) {
+		read_reply.buf = buf;
+		read_reply.data = blob + offset;
+		read_reply.size = size;
+	} else if (size) {
+		memcpy(buf, blob + offset, size);
+	}
+	gitfs_stats_add(fuse_get_context()->pid, 0, 0, size, 0);
+
+	debug( "read returned %d bytes\n", (int)size);
+	return size;
+}
+
+int gitfs_readlink(const char *path, char *buf, size_t size) {
+	int retval = 0;
+	debug("read called for '%s'\n", path);
+	gitfs_entry *e = NULL;
+
+	/* Sanity checks */
+	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
+		goto out;
+
+	if (e->type != GITFS_FILE || !S_ISLNK(git_tree_entry_filemode(e->tree_entry))) {
+		debug("Path is not a link?!: '%s'\n", path);
+		retval = -EIO;
+		goto out;
+	}
+
+	if ((retval = gitfs_entry_load_blob(e)) < 0)
+		goto out;
+
+	if ((retval = gitfs_stream_read(e->object.blob, NULL, 0, e->object.blob->size)) < 0)
+		goto out;
+
+	int blob_size = e->object.blob->size;
+
+	/* If the blob is too big for buf (keeping room for the trailing
+	 * NUL), truncate (as per fuse docs) */
+	if (blob_size  > size - 1)
+		blob_size = size - 1;
+
+	memcpy(buf, e->object.blob->data, blob_size);
+	buf[blob_size] = '\0';
+
+out:
+	if (e)
+		gitfs_entry_free(e);
+	return retval;
+}
+
+/* Extended attributes: directories have their recursive size and
+ * file count (see gitfs_tree_size), as decimal numbers (missing until
+ * computed), and regular files their digest (see gitfs_digest_get) in
+ * hex, when enabled */
+int gitfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+	unsigned char sha256[GITFS_DIGEST_SIZE];
+	uint64_t bytes, files;
+	gitfs_entry *e;
+	char buf[2 * GITFS_DIGEST_SIZE + 1];
+	bool digest = !strcmp(name, GITFS_XATTR_SHA256);
+	int retval, len, i;
+
+	debug("getxattr called for '%s' (%s)\n", path, name);
+	if (strcmp(name, GITFS_XATTR_RBYTES) && strcmp(name, GITFS_XATTR_RFILES) &&
+	    (!digest || digest_store.fd < 0))
+		return -ENODATA;
+
+	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
+		return retval;
+	if (digest && e->type == GITFS_FILE && S_ISREG(git_tree_entry_filemode(e->tree_entry))) {
+		/* Files don't keep a reference to their repository
+		 * generation */
+		struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+		struct gitfs_odb *o = gitfs_odb_get(d->repo);
+		retval = gitfs_digest_get(o, git_tree_entry_id(e->tree_entry), sha256);
+		gitfs_odb_put(o);
+	} else if (!digest && e->type == GITFS_DIR) {
+		if ((retval = gitfs_tree_size(e->odb, git_tree_id(e->object.tree), &bytes, &files)) == -EAGAIN)
+			retval = -ENODATA;
+	} else {
+		retval = -ENODATA;
+	}
+	gitfs_entry_free(e);
+	if (retval < 0)
+		return retval;
+
+	if (digest) {
+		for (i = 0; i < GITFS_DIGEST_SIZE; i++)
+			sprintf(buf + 2 * i, "%02x", sha256[i]);
+		len = 2 * GITFS_DIGEST_SIZE;
+	} else {
+		len = snprintf(buf, sizeof(buf), "%llu",
+			(unsigned long long)(strcmp(name, GITFS_XATTR_RBYTES) ? files : bytes));
+	}
+	/* A size of 0 asks for the size needed */
+	if (size == 0)
+		return len;
+	if (size < (size_t)len)
+		return -ERANGE;
+	memcpy(value, buf, len);
+	return len;
+}
+
+int gitfs_listxattr(const char *path, char *list, size_t size) {
+	static const char dir_names[] = GITFS_XATTR_RBYTES "\0" GITFS_XATTR_RFILES;
+	static const char file_names[] = GITFS_XATTR_SHA256;
+	const char *names = NULL;
+	gitfs_entry *e;
+	size_t len = 0;
+	int retval;
+
+	debug("listxattr called for '%s'\n", path);
+	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
+		return retval;
+	if (e->type == GITFS_DIR) {
+		names = dir_names;
+		len = sizeof(dir_names);
+	} else if (digest_store.fd >= 0 && e->type == GITFS_FILE && S_ISREG(git_tree_entry_filemode(e->tree_entry))) {
+		names = file_names;
+		len = sizeof(file_names);
+	}
+	gitfs_entry_free(e);
+
+	/* Each name is nul-terminated */
+	if (size == 0 || !names)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(list, names, len);
+	return len;
+}
+
+void gitfs_destroy(void *private_data) {
+	struct gitfs_data *d = (struct gitfs_data *)private_data;
+	int i;
+
+	if (d) {
+		gitfs_search_stop(d);
+		gitfs_digest_stop(d);
+		gitfs_path_list_free(d->paths);
+		d->paths = NULL;
+		if (d->repo) gitfs_repo_close(d->repo);
+		for (i = 0; i < d->oid_entry_count; i++) {
+			free(d->oid_entries[i].object.oid);
+		}
+		d->repo = NULL;
+		d->oid_entry_count = 0;
+	}
+}
+
+/* Is path inside (or equal to) dir? */
+static bool gitfs_path_inside(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+	return !strncmp(path, dir, len) && (len == 1 || path[len] == '/' || path[len] == '\0');
+}
+
+/* Returns the path of the given (absolute) path as seen after
+ * chrooting into d->chroot_path */
+static const char *gitfs_chrooted_path(struct gitfs_data *d, const char *path) {
+	size_t len = strlen(d->chroot_path);
+
+	/* Chrooting into / changes nothing */
+	if (len == 1)
+		return path;
+
+	return path[len] ? path + len : "/";
+}
+
+void* gitfs_init(struct fuse_conn_info *conn) {
+	char sha[GIT_OID_HEXSZ + 1];
+	/* Start by chrooting into the git repository. Doing this allows
+	 * git-fs to be started from within initrd and not break if
+	 * mount points are shuffled around, causing the location of the
+	 * git repository to change. By chrooting into the .git dir,
+	 * anything can happen, except for unmounting it completely.
+	 * Note that we can't do this chroot in main(), since fuse_main
+	 * needs /dev/fuse and possibly /dev/null and others too... */
+	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
+
+	if (d->nfs_export) {
+		/* Let the kernel resolve NFS file handles by sending us
+		 * lookups of "." and ".." on node ids */
+		if (conn->capable & FUSE_CAP_EXPORT_SUPPORT)
+			conn->want |= FUSE_CAP_EXPORT_SUPPORT;
+		else
+			error("Kernel does not support exporting fuse over NFS\n");
+	}
+	pthread_mutex_init(&d->node_ids_lock, NULL);
+
+	/* In daemon mode, the repository was already opened (and
+	 * possibly shared with other mounts) */
+	if (!d->daemon) {
+		const char *alternates[d->alternate_count + 1];
+		struct gitfs_outside *outside[d->alternate_count + 1];
+		size_t i, inside_count = 0, outside_count = 0;
+
+		/* Alternates outside of the repository can't be found
+		 * after chrooting, so open them now */
+		for (i = 0; i < d->alternate_count; i++) {
+			if (gitfs_path_inside(d->alternates[i], d->chroot_path))
+				continue;
+			debug("opening alternate %s before chrooting\n", d->alternates[i]);
+			if (!(outside[outside_count] = gitfs_outside_open(d->alternates[i])))
+				break;
+			outside_count++;
+		}
+		outside[outside_count] = NULL;
+
+		debug("chrooting to %s\n", d->chroot_path);
+		if (i < d->alternate_count) {
+			/* Already reported */
+		} else if (chroot(d->chroot_path) < 0) {
+			error("Failed to chroot to %s: %s\n", d->chroot_path, strerror(errno));
+		} else if (chdir("/") < 0) {
+			error("Failed to chdir to /: %s\n", strerror(errno));
+		} else if (local_cache.dir_fd >= 0 && fchdir(local_cache.dir_fd) < 0) {
+			error("Failed to chdir to local cache: %s\n", strerror(errno));
+		} else {
+			for (i = 0; i < d->alternate_count; i++) {
+				if (gitfs_path_inside(d->alternates[i], d->chroot_path))
+					alternates[inside_count++] = gitfs_chrooted_path(d, d->alternates[i]);
+			}
+			alternates[inside_count] = NULL;
+
+			/* libgit2 only opens files by path, so copies in the
+			 * local cache are opened relative to it (the working
+			 * directory) from now on */
+			if (local_cache.dir_fd >= 0)
+				strcpy(local_cache.path, ".");
+
+			debug("opening repo after fuse_main\n");
+			d->repo = gitfs_repo_open(gitfs_chrooted_path(d, d->repo_path), alternates, outside);
+		}
+		/* The repository keeps its own references */
+		for (i = 0; i < outside_count; i++)
+			gitfs_outside_put(outside[i]);
+		if (!d->repo)
+			goto err;
+	}
+
+	/* Check that the tree is there, lookups will find it again
+	 * later (possibly in other packs, after a repack) */
+	struct gitfs_odb *o = gitfs_odb_get(d->repo);
+	git_tree *tree;
+	int found = git_tree_lookup(&tree, o->repo, &d->tree_oid);
+	if (found == 0)
+		git_tree_free(tree);
+	gitfs_odb_put(o);
+	if (found < 0) {
+		git_oid_fmt(sha, &d->tree_oid);
+		sha[GIT_OID_HEXSZ] = '\0';
+		error("Failed to lookup tree: %s\n", sha);
+		goto err;
+	}
+
+	pthread_mutex_init(&d->paths_lock, NULL);
+	gitfs_search_start(d);
+	gitfs_digest_start(d);
+
+	/* This return value can be accessed through
+	 * fuse_get_context()->private_data */
+	return (void*)d;
+
+err:
+	gitfs_destroy((void*)d);
+
+	/* Tell fuse to exit the mainloop (doesn't exit immediately) */
+	fuse_exit(fuse_get_context()->fuse);
+
+	/* Store a return value, so we don't return success when the
+	 * mounting failed */
+	d->retval = 1;
+	return NULL;
+}
+
+struct fuse_operations gitfs_oper = {
+	.init= gitfs_init,
+	.destroy= gitfs_destroy,
+	.open= gitfs_open,
+	.release= gitfs_release,
+	/* Reuse open/release for directories */
+	.opendir= gitfs_open,
+	.releasedir= gitfs_release,
+	.getattr= gitfs_getattr,
+	.readdir= gitfs_readdir,
+	.read= gitfs_read,
+	.readlink= gitfs_readlink,
+	.getxattr= gitfs_getxattr,
+	.listxattr= gitfs_listxattr
+};
+
+/* State for a single request processing thread. Each worker reads
+ * requests from (and writes replies to) its own clone of the /dev/fuse
+ * fd, so workers don't all contend for the same fd. */
+struct gitfs_worker {
+	struct fuse_session *se;
+	/* Our channel wrapping fd */
+	struct fuse_chan *ch;
+	int fd;
+	/* Is fd a clone that should be closed afterwards? */
+	bool cloned;
+	size_t bufsize;
+	pthread_t thread;
+	/* Posted when this worker stops */
+	sem_t *finished;
+	/* Added to the generation of lookup replies */
+	uint32_t generation;
+	/* The mount, when translating node ids (see gitfs_node_ids_in) */
+	struct gitfs_data *d;
+	/* Set while making libfuse look up a node itself, whose reply
+	 * is not for the kernel */
+	bool internal;
+	/* Opcode of the request being processed by this worker */
+	uint32_t opcode;
+	/* The nice value the worker thread currently runs at, see
+	 * gitfs_qos_renice */
+	int nice;
+	/* The process that made the request being processed */
+	pid_t pid;
+};
+
+/* Translating node ids, for nfs-export.
+ *
+ * The kernel puts node ids in NFS file handles, but libfuse assigns
+ * them in lookup order, so a handle from before a restart would point
+ * at another file (or none, which makes libfuse abort). So the kernel
+ * is given the inode number derived from the path (see gitfs_path_ino)
+ * as node id instead, which is translated to and from libfuse's own
+ * node id for the same node. Nodes only looked up before a restart
+ * are found by their path, and looked up through libfuse first. With
+ * noforget, libfuse never drops a node, so neither does this. */
+struct gitfs_node_id {
+	uint64_t ino, node;
+	struct gitfs_node_id *next_ino, *next_node;
+};
+
+static size_t gitfs_node_id_hash(uint64_t id) {
+	return gitfs_fnv1a(GITFS_FNV_INIT, &id, sizeof(id));
+}
+
+/* Returns the libfuse node id of the node the kernel knows by ino, or
+ * 0 when not known */
+static uint64_t gitfs_node_id_find(struct gitfs_data *d, uint64_t ino) {
+	struct gitfs_node_id *n = NULL;
+
+	pthread_mutex_lock(&d->node_ids_lock);
+	if (d->node_id_buckets) {
+		n = d->node_ids_by_ino[gitfs_node_id_hash(ino) & (d->node_id_buckets - 1)];
+		while (n && n->ino != ino)
+			n = n->next_ino;
+	}
+	pthread_mutex_unlock(&d->node_ids_lock);
+	return n ? n->node : 0;
+}
+
+/* Record that libfuse knows the node the kernel knows by ino as node */
+static int gitfs_node_id_add(struct gitfs_data *d, uint64_t ino, uint64_t node) {
+	struct gitfs_node_id **by_ino, **by_node, *n, *next;
+	size_t i, count;
+	int retval = 0;
+
+	pthread_mutex_lock(&d->node_ids_lock);
+	if (d->node_id_buckets) {
+		n = d->node_ids_by_ino[gitfs_node_id_hash(ino) & (d->node_id_buckets - 1)];
+		while (n && n->ino != ino)
+			n = n->next_ino;
+		if (n) {
+			/* Two paths with the same inode number, which
+			 * can't both be handed out */
+			if (n->node != node) {
+				error("Inode number %llu used for two nodes\n", (unsigned long long)ino);
+				retval = -EIO;
+			}
+			goto out;
+		}
+	}
+
+	if (d->node_id_count >= d->node_id_buckets) {
+		count = d->node_id_buckets ? d->node_id_buckets * 2 : 1024;
+		if (!(by_ino = calloc(count, sizeof(*by_ino))) || !(by_node = calloc(count, sizeof(*by_node)))) {
+			free(by_ino);
+			error("Failed to allocate memory for node ids\n");
+			retval = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < d->node_id_buckets; i++) {
+			for (n = d->node_ids_by_ino[i]; n; n = next) {
+				next = n->next_ino;
+				n->next_ino = by_ino[gitfs_node_id_hash(n->ino) & (count - 1)];
+				by_ino[gitfs_node_id_hash(n->ino) & (count - 1)] = n;
+				n->next_node = by_node[gitfs_node_id_hash(n->node) & (count - 1)];
+				by_node[gitfs_node_id_hash(n->node) & (count - 1)] = n;
+			}
+		}
+		free(d->node_ids_by_ino);
+		free(d->node_ids_by_node);
+		d->node_ids_by_ino = by_ino;
+		d->node_ids_by_node = by_node;
+		d->node_id_buckets = count;
+	}
+
+	if (!(n = calloc(1, sizeof(*n)))) {
+		error("Failed to allocate memory for node ids\n");
+		retval = -ENOMEM;
+		goto out;
+	}
+	n->ino = ino;
+	n->node = node;
+	n->next_ino = d->node_ids_by_ino[gitfs_node_id_hash(ino) & (d->node_id_buckets - 1)];
+	d->node_ids_by_ino[gitfs_node_id_hash(ino) & (d->node_id_buckets - 1)] = n;
+	n->next_node = d->node_ids_by_node[gitfs_node_id_hash(node) & (d->node_id_buckets - 1)];
+	d->node_ids_by_node[gitfs_node_id_hash(node) & (d->node_id_buckets - 1)] = n;
+	d->node_id_count++;
+out:
+	pthread_mutex_unlock(&d->node_ids_lock);
+	return retval;
+}
+
+static void gitfs_node_ids_free(struct gitfs_data *d) {
+	struct gitfs_node_id *n, *next;
+	size_t i;
+
+	for (i = 0; i < d->node_id_buckets; i++) {
+		for (n = d->node_ids_by_ino[i]; n; n = next) {
+			next = n->next_ino;
+			free(n);
+		}
+	}
+	free(d->node_ids_by_ino);
+	free(d->node_ids_by_node);
+}
+
+/* Make libfuse look up name (len bytes) in the directory it knows as
+ * parent, as if the kernel asked for it (on behalf of the same process
+ * as the request in). Its reply records the node ids found. */
+static void gitfs_node_ids_lookup(struct gitfs_worker *w, const struct gitfs_fuse_in_header *in, uint64_t parent,
+		const char *name, size_t len) {
+	char buf[sizeof(struct gitfs_fuse_in_header) + NAME_MAX + 1];
+	struct gitfs_fuse_in_header *lookup = (struct gitfs_fuse_in_header *)buf;
+
+	if (len > NAME_MAX)
+		return;
+	memset(lookup, 0, sizeof(*lookup));
+	lookup->len = sizeof(*lookup) + len + 1;
+	lookup->opcode = GITFS_FUSE_LOOKUP;
+	lookup->nodeid = parent;
+	lookup->uid = in->uid;
+	lookup->gid = in->gid;
+	lookup->pid = in->pid;
+	memcpy(buf + sizeof(*lookup), name, len);
+	buf[sizeof(*lookup) + len] = '\0';
+
+	w->opcode = GITFS_FUSE_LOOKUP;
+	w->internal = true;
+	fuse_session_process(w->se, buf, lookup->len, w->ch);
+	w->internal = false;
+}
+
+struct gitfs_ino_search {
+	uint64_t ino;
+	char path[PATH_MAX];
+	bool found;
+};
+
+/* git_tree_walk callback looking for the path with the inode number in
+ * the struct gitfs_ino_search it is passed */
+static int gitfs_ino_search_cb(const char *root, const git_tree_entry *entry, void *payload) {
+	struct gitfs_ino_search *s = (struct gitfs_ino_search *)payload;
+
+	if (snprintf(s->path, sizeof(s->path), "/%s%s", root, git_tree_entry_name(entry)) >= sizeof(s->path))
+		return 0;
+	if (gitfs_path_ino(s->path) != s->ino)
+		return 0;
+	s->found = true;
+	return -1;
+}
+
+/* Returns the libfuse node id of the node the kernel knows by ino (for
+ * the request in), looking it up through libfuse when not handed out
+ * by this instance. Returns 0 when there is no such node. */
+static uint64_t gitfs_node_ids_resolve(struct gitfs_worker *w, const struct gitfs_fuse_in_header *in, uint64_t ino) {
+	struct gitfs_ino_search s = { .ino = ino };
+	const char *path = s.path, *name, *end;
+	char prefix[PATH_MAX];
+	struct gitfs_odb *o;
+	git_tree *root;
+	uint64_t node;
+
+	if (ino == 1 || (node = gitfs_node_id_find(w->d, ino)))
+		return ino == 1 ? 1 : node;
+
+	/* Only the inode numbers of paths are known, so find the one
+	 * with this inode number among all paths of the tree. This is
+	 * needed only once per node after a restart. */
+	o = gitfs_odb_get(w->d->repo);
+	if (git_tree_lookup(&root, o->repo, &w->d->tree_oid) == 0) {
+		git_tree_walk(root, GIT_TREEWALK_PRE, gitfs_ino_search_cb, &s);
+		git_tree_free(root);
+	}
+	gitfs_odb_put(o);
+	if (!s.found)
+		return 0;
+	debug("Looking up %s for a node id from before a restart\n", path);
+
+	/* Look up each directory leading to it, then the node itself,
+	 * starting from the root */
+	node = 1;
+	for (name = path + 1; node && *name; name = *end ? end + 1 : end) {
+		end = strchrnul(name, '/');
+		memcpy(prefix, path, end - path);
+		prefix[end - path] = '\0';
+		ino = gitfs_path_ino(prefix);
+		if (!gitfs_node_id_find(w->d, ino))
+			gitfs_node_ids_lookup(w, in, node, name, end - name);
+		node = gitfs_node_id_find(w->d, ino);
+	}
+	return node;
+}
+
+/* Translate the node ids in the request in buf (size bytes) to those
+ * libfuse uses. Returns -1 when the request was dealt with here
+ * already (so libfuse must not see it). */
+static int gitfs_node_ids_in(struct gitfs_worker *w, char *buf, size_t size) {
+	struct gitfs_fuse_in_header *in = (struct gitfs_fuse_in_header *)buf;
+	struct gitfs_fuse_batch_forget_in *batch = (struct gitfs_fuse_batch_forget_in *)(in + 1);
+	struct gitfs_fuse_forget_one *forget = (struct gitfs_fuse_forget_one *)(batch + 1);
+	struct gitfs_fuse_out_header out;
+	uint64_t node;
+	uint32_t i;
+
+	if (in->opcode == GITFS_FUSE_BATCH_FORGET) {
+		for (i = 0; size >= sizeof(*in) + sizeof(*batch) && i < batch->count &&
+		     (char *)(forget + i + 1) <= buf + size; i++) {
+			/* Forgetting the root does nothing */
+			node = gitfs_node_id_find(w->d, forget[i].nodeid);
+			forget[i].nodeid = node ? node : 1;
+		}
+		return 0;
+	}
+
+	/* Anything but a node (e.g. init) */
+	if (in->nodeid == 0)
+		return 0;
+
+	/* Nodes are only forgotten once looked up by this instance
+	 * (forgets have no reply) */
+	if (in->opcode == GITFS_FUSE_FORGET)
+		node = in->nodeid == 1 ? 1 : gitfs_node_id_find(w->d, in->nodeid);
+	else
+		node = gitfs_node_ids_resolve(w, in, in->nodeid);
+	if (node) {
+		in->nodeid = node;
+		return 0;
+	}
+
+	if (in->opcode != GITFS_FUSE_FORGET) {
+		out.len = sizeof(out);
+		out.error = -ESTALE;
+		out.unique = in->unique;
+		if (write(w->fd, &out, sizeof(out)) < 0 && errno != ENOENT)
+			error("Failed to write to /dev/fuse: %s\n", strerror(errno));
+	}
+	return -1;
+}
+
+/* Run the worker at the nice value of the class of the request it
+ * processes. This only affects how the thread is scheduled while
+ * processing it: requests are still read from /dev/fuse in order of
+ * arrival, whatever their class. A higher nice value is only set when
+ * the thread can lower it again afterwards (e.g. for the next request,
+ * of another class), so it can't get stuck at nice 19. Setting a lower
+ * one can simply fail. */
+static void gitfs_qos_renice(struct gitfs_worker *w) {
+	int nice = current_qos ? current_qos->nice : qos.nice;
+
+	if (nice == w->nice || (nice > w->nice && !qos.can_lower))
+		return;
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) < 0)
+		debug("Failed to set nice value %d: %s\n", nice, strerror(errno));
+	else
+		w->nice = nice;
+}
+
+/* Receive a single request. This mirrors what libfuse does for its own
+ * (kernel) channel, but reads from the fd of the worker. */
+static int gitfs_chan_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+	struct gitfs_worker *w = (struct gitfs_worker *)fuse_chan_data(*chp);
+	ssize_t res;
+	int err;
+
+	/* The buffer of a read that was never answered is gone */
+	read_reply.buf = NULL;
+
+restart:
+	res = read(w->fd, buf, size);
+	err = errno;
+
+	if (fuse_session_exited(w->se))
+		return 0;
+
+	if (res < 0) {
+		/* ENOENT means the request was interrupted before we
+		 * could read it, just try the next one */
+		if (err == ENOENT)
+			goto restart;
+
+		/* ENODEV means the filesystem was unmounted */
+		if (err == ENODEV) {
+			fuse_session_exit(w->se);
+			return 0;
+		}
+
+		if (err != EINTR && err != EAGAIN)
+			error("Failed to read from /dev/fuse: %s\n", strerror(err));
+		return -err;
+	}
+
+	if (w->d && res >= sizeof(struct gitfs_fuse_in_header) && gitfs_node_ids_in(w, buf, res) < 0)
+		goto restart;
+
+	/* Requests are processed synchronously by the thread reading
+	 * them, so this is still valid when sending the reply */
+	if (res >= sizeof(struct gitfs_fuse_in_header)) {
+		const struct gitfs_fuse_in_header *in = (struct gitfs_fuse_in_header *)buf;
+		w->opcode = in->opcode;
+		w->pid = in->pid;
+		current_qos = gitfs_qos_classify(in->pid, in->uid);
+	} else {
+		w->opcode = 0;
+		w->pid = 0;
+		current_qos = NULL;
+	}
+
+	gitfs_qos_renice(w);
+	return res;
+}
+
+/* Send a reply through the fd of the worker that received the request */
+static int gitfs_chan_send(struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+	struct gitfs_worker *w = (struct gitfs_worker *)fuse_chan_data(ch);
+	struct iovec data[2];
+
+	if (!iov)
+		return 0;
+
+	/* Send the contents of a read from where they are, see
+	 * read_reply. Any other reply (e.g. an error after all) gets
+	 * them copied, like gitfs_read would have. */
+	if (read_reply.buf) {
+		if (w->opcode == GITFS_FUSE_READ && count == 2 &&
+		    iov[1].iov_base == read_reply.buf && iov[1].iov_len == read_reply.size) {
+			data[0] = iov[0];
+			data[1].iov_base = (void *)read_reply.data;
+			data[1].iov_len = read_reply.size;
+			iov = data;
+		} else {
+			memcpy(read_reply.buf, read_reply.data, read_reply.size);
+		}
+		read_reply.buf = NULL;
+	}
+
+	if (w->generation && w->opcode == GITFS_FUSE_LOOKUP && count >= 2 &&
+	    iov[1].iov_len >= sizeof(struct gitfs_fuse_entry_out)) {
+		struct gitfs_fuse_out_header *out = iov[0].iov_base;
+		struct gitfs_fuse_entry_out *entry = iov[1].iov_base;
+		/* Node id 0 is a negative entry, which has no
+		 * generation */
+		if (out->error == 0 && entry->nodeid != 0) {
+			entry->generation += w->generation;
+			/* Hand out the inode number as node id, see
+			 * gitfs_node_ids_in */
+			if (w->d) {
+				int err = entry->ino == 1 ? 0 : gitfs_node_id_add(w->d, entry->ino, entry->nodeid);
+				if (err < 0) {
+					out->error = err;
+					out->len = sizeof(*out);
+					count = 1;
+				}
+				entry->nodeid = entry->ino;
+			}
+		}
+	}
+
+	/* Replies to lookups of our own are not for the kernel */
+	if (w->internal)
+		return 0;
+
+	if (writev(w->fd, iov, count) < 0) {
+		int err = errno;
+		/* ENOENT means the request was interrupted, which is
+		 * not an error */
+		if (err != ENOENT && !fuse_session_exited(w->se))
+			error("Failed to write to /dev/fuse: %s\n", strerror(err));
+		return -err;
+	}
+	return 0;
+}
+
+static void gitfs_chan_destroy(struct fuse_chan *ch)
+{
+	/* The fd is closed by gitfs_loop, nothing to do here */
+}
+
+static struct fuse_chan_ops gitfs_chan_ops = {
+	.receive = gitfs_chan_receive,
+	.send = gitfs_chan_send,
+	.destroy = gitfs_chan_destroy,
+};
+
+/* Open a new /dev/fuse fd connected to the same mount as master_fd.
+ * Returns -1 when cloning is not supported (kernels older than 4.2). */
+static int gitfs_clone_fd(int master_fd)
+{
+	uint32_t master = master_fd;
+	int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (ioctl(fd, FUSE_DEV_IOC_CLONE, &master) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void *gitfs_worker_main(void *data)
+{
+	struct gitfs_worker *w = (struct gitfs_worker *)data;
+	char *buf = malloc(w->bufsize);
+
+	read_reply.enabled = true;
+
+	if (!buf) {
+		error("Failed to allocate request buffer\n");
+		fuse_session_exit(w->se);
+	}
+
+	while (buf && !fuse_session_exited(w->se)) {
+		struct fuse_chan *ch = w->ch;
+		int res;
+
+		/* Only allow cancellation while waiting for a request, not
+		 * halfway processing one */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_chan_recv(&ch, buf, w->bufsize);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			if (res < 0)
+				fuse_session_exit(w->se);
+			break;
+		}
+
+		/* Makes background tasks wait, see gitfs_task_yield */
+		__atomic_add_fetch(&tasks.foreground, 1, __ATOMIC_SEQ_CST);
+		if (stats.enabled) {
+			struct timespec start, end;
+			uint64_t ns;
+
+			__atomic_add_fetch(&stats.inflight, 1, __ATOMIC_RELAXED);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			fuse_session_process(w->se, buf, res, ch);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			__atomic_sub_fetch(&stats.inflight, 1, __ATOMIC_RELAXED);
+
+			ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+			gitfs_stats_request(w->opcode, ns);
+			gitfs_stats_add(w->pid, 1, ns, 0, 0);
+		} else {
+			fuse_session_process(w->se, buf, res, ch);
+		}
+		gitfs_task_foreground_done();
+	}
+
+	free(buf);
+	sem_post(w->finished);
+	return NULL;
+}
+
+/* Protects gitfs_data.loop_finished */
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Make gitfs_loop (running in another thread) return, even if the
+ * filesystem is still mounted */
+static void gitfs_loop_exit(struct fuse *f, struct gitfs_data *d)
+{
+	fuse_exit(f);
+	pthread_mutex_lock(&loop_lock);
+	if (d->loop_finished)
+		sem_post(d->loop_finished);
+	pthread_mutex_unlock(&loop_lock);
+}
+
+/* Returns the number of cpus we are allowed to run on */
+static unsigned gitfs_cpu_count()
+{
+	cpu_set_t set;
+	long n;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+/* Process requests until the filesystem is unmounted, using the given
+ * number of worker threads. This replaces fuse_loop_mt, which lets all
+ * threads read from the single /dev/fuse fd. Here, every worker gets
+ * its own clone of that fd instead, so the kernel can hand requests to
+ * each worker separately and replies don't serialize on one fd. */
+static int gitfs_loop(struct fuse *f, struct gitfs_data *d)
+{
+	unsigned threads = d->threads;
+	struct fuse_session *se = fuse_get_session(f);
+	struct fuse_chan *master = fuse_session_next_chan(se, NULL);
+	int master_fd = fuse_chan_fd(master);
+	struct gitfs_worker *workers;
+	sigset_t all, old;
+	sem_t finished;
+	unsigned i, started = 0;
+	int retval = 0;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return error("Failed to allocate memory for workers\n"), -1;
+	sem_init(&finished, 0, 0);
+	pthread_mutex_lock(&loop_lock);
+	d->loop_finished = &finished;
+	pthread_mutex_unlock(&loop_lock);
+
+	/* The cleanup thread is only started when the remember option
+	 * is used, just like fuse_loop_mt does */
+	fuse_start_cleanup_thread(f);
+
+	/* Start the workers with all signals blocked, so signals
+	 * (e.g. SIGINT to unmount) are delivered to this thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < threads; i++) {
+		struct gitfs_worker *w = &workers[i];
+		w->se = se;
+		w->bufsize = fuse_chan_bufsize(master);
+		w->finished = &finished;
+		w->generation = d->generation;
+		w->nice = qos.nice;
+		if (d->nfs_export)
+			w->d = d;
+
+		/* The first worker uses the original fd. If cloning is
+		 * not supported, the others share it as well. */
+		w->fd = -1;
+		if (i > 0)
+			w->fd = gitfs_clone_fd(master_fd);
+		if (w->fd < 0) {
+			if (i > 0)
+				debug("Failed to clone /dev/fuse fd, sharing it instead\n");
+			w->fd = master_fd;
+		} else {
+			w->cloned = true;
+		}
+
+		w->ch = fuse_chan_new(&gitfs_chan_ops, w->fd, w->bufsize, w);
+		if (!w->ch) {
+			error("Failed to create channel for worker %u\n", i);
+			break;
+		}
+
+		if (pthread_create(&w->thread, NULL, gitfs_worker_main, w) != 0) {
+			error("Failed to start worker %u\n", i);
+			break;
+		}
+		started++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	debug("started %u worker threads\n", started);
+
+	if (started < threads) {
+		fuse_session_exit(se);
+		retval = -1;
+	}
+
+	/* Wait until the session exits, either because a worker got
+	 * ENODEV (filesystem unmounted), or because the exit signal
+	 * handler interrupted us. */
+	while (!fuse_session_exited(se))
+		sem_wait(&finished);
+
+	for (i = 0; i < started; i++)
+		pthread_cancel(workers[i].thread);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < threads; i++) {
+		if (workers[i].ch)
+			fuse_chan_destroy(workers[i].ch);
+		if (workers[i].cloned)
+			close(workers[i].fd);
+	}
+
+	pthread_mutex_lock(&loop_lock);
+	d->loop_finished = NULL;
+	pthread_mutex_unlock(&loop_lock);
+	sem_destroy(&finished);
+	free(workers);
+	fuse_stop_cleanup_thread(f);
+
+	/* Allow the session to be restarted (fuse_loop_mt does this
+	 * too) */
+	fuse_session_reset(se);
+	return retval;
+}
+
+void usage(struct fuse_args *args, FILE *out) {
+	fprintf(out,
+	     "usage: %s [options] repo-path mountpoint\n"
+	     "\n"
+	     "Mount the repository in repo-path onto mountpoint.\n"
+	     "repo-path should point to the .git directory, not the\n"
+	     "checkout directory (can also point to a bare repository).\n"
+	     "\n"
+	     "    %s [options] --pack=PACK --rev=OID mountpoint\n"
+	     "\n"
+	     "Mount the tree (or commit) OID straight from the pack\n"
+	     "file PACK, which needs its index next to it (see git\n"
+	     "index-pack), without any repository. Only opening the\n"
+	     "index is needed to start. A pack file can also be\n"
+	     "given as repo-path.\n"
+	     "\n"
+	     "    %s [options] --export-erofs=IMAGE repo-path\n"
+	     "\n"
+	     "Write the tree to mount (see --rev) to the EROFS image\n"
+	     "IMAGE instead, which the kernel can mount by itself\n"
+	     "(mount -t erofs -o loop IMAGE mountpoint). Small\n"
+	     "files are stored next to their inode, and files with\n"
+	     "the same contents share their blocks. With\n"
+	     "--export-order=FILE, the contents of the files listed\n"
+	     "in FILE (one path per line, e.g. those read while\n"
+	     "booting) are placed first, in that order. Times are\n"
+	     "those of the commit, or SOURCE_DATE_EPOCH (0 when not\n"
+	     "set) when --rev names a tree, so the same tree always\n"
+	     "gives the same image.\n"
+	     "\n"
+	     "general options:\n"
+	     "    -o opt,[opt...]\n"
+	     "        mount options (see below)\n"
+	     "    -h\n"
+	     "    --help\n"
+	     "        print help\n"
+	     "\n"
+	     "git-fs options:\n"
+	     "    -o rev=STRING\n"
+	     "    --rev=STRING\n"
+	     "        Revision to mount. Can be any name that points to\n"
+	     "        a commit or tree object (e.g. a branch name, tag\n"
+	     "        name, symbolic ref, sha). When not specified,\n"
+	     "        HEAD is used.\n"
+	     "    -o no-oid-files\n"
+	     "        Don't export magic files /.git-fs-tree-id and\n"
+	     "        (when applicable) /.git-fs-commit-id containing\n"
+	     "        the hashes of the mounted tree and commit\n"
+	     "        respectively.\n"
+	     "    -o dir-sizes\n"
+	     "        Report the total size of all files below a\n"
+	     "        directory as its size (e.g. for ls -l). This\n"
+	     "        is always available from the user.git-fs.rbytes\n"
+	     "        and user.git-fs.rfiles (number of files)\n"
+	     "        extended attributes of directories. Both are\n"
+	     "        computed in the background when first asked\n"
+	     "        for, until then directories have their plain\n"
+	     "        size and no such attributes.\n"
+	     "    -o threads=NUM\n"
+	     "        Number of threads processing requests, each\n"
+	     "        with its own /dev/fuse fd. Defaults to the\n"
+	     "        number of cpus available. Ignored with -s.\n"
+	     "    -o nfs-export\n"
+	     "        Allow exporting the mount over NFS. Note that\n"
+	     "        the export needs an explicit fsid= option.\n"
+	     "        Implies use_ino and noforget. Inode numbers and\n"
+	     "        file handles are derived from the path, so they\n"
+	     "        stay valid when git-fs is restarted with the\n"
+	     "        same tree.\n"
+	     "    -o cache-size=SIZE\n"
+	     "        Memory to use for caching objects (a number of\n"
+	     "        bytes, optionally followed by K, M or G).\n"
+	     "        Defaults to 64M.\n"
+	     "    -o shared-cache=SIZE\n"
+	     "        Share inflated blobs with other git-fs processes\n"
+	     "        using the same option, through SIZE bytes of\n"
+	     "        shared memory (/dev/shm/git-fs-blobs-UID). The\n"
+	     "        size is only used by the process that creates\n"
+	     "        it.\n"
+	     "    -o drop-pack-cache\n"
+	     "        Drop the compressed data of blobs from the page\n"
+	     "        cache once inflated, since their contents are\n"
+	     "        cached already. Saves memory on small machines,\n"
+	     "        at the cost of rereading packs on cache misses.\n"
+	     "    -o stream-size=SIZE\n"
+	     "        Inflate blobs of at least SIZE bytes that are\n"
+	     "        stored whole in a pack while they are read, a\n"
+	     "        growing window ahead of sequential readers,\n"
+	     "        instead of completely when opened (for up to 16\n"
+	     "        blobs at a time). Defaults to 8M, 0 disables\n"
+	     "        this.\n"
+	     "    -o scan-threshold=NUM\n"
+	     "        Treat processes causing NUM cache misses within\n"
+	     "        10 seconds as scanning the whole tree (e.g.\n"
+	     "        backups or updatedb), and don't cache what they\n"
+	     "        read, so they don't push out what others use.\n"
+	     "        Disabled (0) by default.\n"
+	     "    -o qos=FILE\n"
+	     "        Load classes of processes to treat differently\n"
+	     "        from FILE. Each line matches processes on\n"
+	     "        comm=NAME, cgroup=PATH or uid=UID, followed by\n"
+	     "        any of nice=NUM (nice value to process their\n"
+	     "        requests at, which doesn't change the order\n"
+	     "        requests are read in), inflate=NUM (maximum\n"
+	     "        number of blobs they inflate at the same time)\n"
+	     "        and nocache (don't cache what they read). The\n"
+	     "        first match wins.\n"
+	     "    -o search-index=DIR\n"
+	     "        Index the text files of the mounted tree in the\n"
+	     "        background, storing the index in DIR (which can\n"
+	     "        be shared by any number of trees and mounts).\n"
+	     "        Once done, /.git-fs-search/STRING is a directory\n"
+	     "        with only the files containing STRING (and the\n"
+	     "        directories leading to them), found without\n"
+	     "        reading most of the others. STRING must be at\n"
+	     "        least 3 bytes long.\n"
+	     "    -o digest-index=FILE\n"
+	     "        Compute the SHA-256 digest of every file of the\n"
+	     "        mounted tree in the background, storing them in\n"
+	     "        FILE (which can be shared by any number of trees\n"
+	     "        and mounts, so unchanged files are never hashed\n"
+	     "        again). Digests are available from the\n"
+	     "        user.git-fs.sha256 extended attribute of each\n"
+	     "        file and, once all are done, from\n"
+	     "        /.git-fs-manifest (which sha256sum -c can check).\n"
+	     "    -o background-threads=NUM\n"
+	     "        Run background work (building indexes, computing\n"
+	     "        digests) on NUM threads. By default, a quarter\n"
+	     "        of the available cpus is used. This work only\n"
+	     "        runs when no requests are being processed, with\n"
+	     "        idle cpu and io priority.\n"
+	     "    -o background-cpu=PERCENT\n"
+	     "        Limit each background thread to PERCENT of a cpu\n"
+	     "        (100 by default, i.e. no limit).\n"
+	     "    -o local-cache=DIR\n"
+	     "        Copy the packs of the repository (and its\n"
+	     "        alternates) to DIR in the background, and read\n"
+	     "        them from there once copied, e.g. when the\n"
+	     "        repository is on NFS or USB storage. Copies are\n"
+	     "        checked against the checksum of their pack, and\n"
+	     "        only used while it matches the original's. DIR\n"
+	     "        can be shared by any number of repositories.\n"
+	     "    -o local-cache-size=SIZE\n"
+	     "        Remove the copies used least recently when all\n"
+	     "        of them would take more than SIZE bytes. Copies\n"
+	     "        of packs a mount still has are kept, and new\n"
+	     "        copies not made when they don't fit then.\n"
+	     "        Unlimited by default.\n"
+	     "    -o stats\n"
+	     "        Keep track of the requests, bytes read, bytes\n"
+	     "        inflated and time spent per process, as well\n"
+	     "        as request latencies, cache hits and the most\n"
+	     "        opened files, readable from /.git-fs-stats\n"
+	     "        (see git-fs-top).\n"
+	     "\n"
+	     "daemon mode:\n"
+	     "    %s [options] --daemon=SOCKET\n"
+	     "\n"
+	     "    Run a single process serving any number of mounts,\n"
+	     "    which share their caches and repositories. Mounts\n"
+	     "    are managed by writing commands (one per line) to\n"
+	     "    the unix socket SOCKET:\n"
+	     "\n"
+	     "    mount REPO-PATH MOUNTPOINT [OPT,[OPT...]]\n"
+	     "        Mount a repository, using the same options as\n"
+	     "        above (e.g. rev=master,no-oid-files).\n"
+	     "    umount MOUNTPOINT\n"
+	     "        Unmount a mount made through mount.\n"
+	     "    list\n"
+	     "        Print each mountpoint, repository and tree.\n"
+	     "\n"
+	     "    Every command is answered with \"ok\" or \"error\",\n"
+	     "    on a line of their own.\n"
+	     "\n"
+	     , args->argv[0], args->argv[0], args->argv[0], args->argv[0]);
+             fuse_opt_add_arg(args, "-ho");
+             fuse_main(args->argc, args->argv, &gitfs_oper, NULL);
+}
+
+enum {
+	KEY_DEBUG,
+	KEY_HELP,
+	KEY_REV,
+	KEY_RWRO,
+	KEY_NO_OID_FILES,
+	KEY_DIR_SIZES,
+	KEY_THREADS,
+	KEY_NFS_EXPORT,
+	KEY_DAEMON,
+	KEY_CACHE_SIZE,
+	KEY_SHARED_CACHE,
+	KEY_DROP_PACK_CACHE,
+	KEY_STREAM_SIZE,
+	KEY_SCAN_THRESHOLD,
+	KEY_QOS,
+	KEY_STATS,
+	KEY_SEARCH_INDEX,
+	KEY_DIGEST_INDEX,
+	KEY_BACKGROUND_THREADS,
+	KEY_BACKGROUND_CPU,
+	KEY_LOCAL_CACHE,
+	KEY_LOCAL_CACHE_SIZE,
+	KEY_PACK,
+	KEY_EXPORT_EROFS,
+	KEY_EXPORT_ORDER,
+};
+
+static struct fuse_opt gitfs_opts[] = {
+	FUSE_OPT_KEY("-d",             KEY_DEBUG),
+	FUSE_OPT_KEY("debug",          KEY_DEBUG),
+	FUSE_OPT_KEY("-h",             KEY_HELP),
+	FUSE_OPT_KEY("--help",         KEY_HELP),
+	FUSE_OPT_KEY("--rev=%s",       KEY_REV),
+	FUSE_OPT_KEY("rev=%s",         KEY_REV),
+	FUSE_OPT_KEY("--pack=%s",      KEY_PACK),
+	FUSE_OPT_KEY("--export-erofs=%s", KEY_EXPORT_EROFS),
+	FUSE_OPT_KEY("--export-order=%s", KEY_EXPORT_ORDER),
+	FUSE_OPT_KEY("rw",             KEY_RWRO),
+	FUSE_OPT_KEY("ro",             KEY_RWRO),
+	FUSE_OPT_KEY("no-oid-files",   KEY_NO_OID_FILES),
+	FUSE_OPT_KEY("dir-sizes",      KEY_DIR_SIZES),
+	FUSE_OPT_KEY("threads=%s",     KEY_THREADS),
+	FUSE_OPT_KEY("nfs-export",     KEY_NFS_EXPORT),
+	FUSE_OPT_KEY("--daemon=%s",    KEY_DAEMON),
+	FUSE_OPT_KEY("cache-size=%s",  KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("shared-cache=%s", KEY_SHARED_CACHE),
+	FUSE_OPT_KEY("drop-pack-cache", KEY_DROP_PACK_CACHE),
+	FUSE_OPT_KEY("stream-size=%s", KEY_STREAM_SIZE),
+	FUSE_OPT_KEY("scan-threshold=%s", KEY_SCAN_THRESHOLD),
+	FUSE_OPT_KEY("qos=%s",         KEY_QOS),
+	FUSE_OPT_KEY("stats",          KEY_STATS),
+	FUSE_OPT_KEY("search-index=%s", KEY_SEARCH_INDEX),
+	FUSE_OPT_KEY("digest-index=%s", KEY_DIGEST_INDEX),
+	FUSE_OPT_KEY("background-threads=%s", KEY_BACKGROUND_THREADS),
+	FUSE_OPT_KEY("background-cpu=%s", KEY_BACKGROUND_CPU),
+	FUSE_OPT_KEY("local-cache=%s", KEY_LOCAL_CACHE),
+	FUSE_OPT_KEY("local-cache-size=%s", KEY_LOCAL_CACHE_SIZE),
+	FUSE_OPT_END
+};
+
+/* Parse a size in bytes, optionally followed by a K, M or G suffix */
+static int gitfs_parse_size(const char *arg, size_t *out)
+{
+	char *end;
+	unsigned long long size = strtoull(arg, &end, 10);
+
+	if (end == arg)
+		return -1;
+
+	switch (*end) {
+		case 'G': size <<= 10; /* Fall through */
+		case 'M': size <<= 10; /* Fall through */
+		case 'K': size <<= 10; end++; break;
+	}
+
+	if (*end != '\0')
+		return -1;
+	*out = size;
+	return 0;
+}
+
+static int gitfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	struct gitfs_data *d = (struct gitfs_data *)data;
+
+	/* The first non-option argument is the repo path */
+	if (key == FUSE_OPT_KEY_NONOPT && d->repo_path == NULL) {
+		d->repo_path = realpath(arg, NULL);
+		if (d->repo_path == NULL) {
+			error("%s: Failed to resolve path: %s\n", arg, strerror(errno));
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_DEBUG) {
+		enable_debug = 1;
+		/* Pass this option onto fuse_main */
+		return 1;
+	} else if (key == KEY_RWRO) {
+		error("Mount is always read-only, ignoring %s option\n", arg);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_REV) {
+		if (d->rev != NULL) {
+			error("--rev / -o rev can be passed only once\n");
+			return -1;
+		}
+		d->rev = strdup(strchr(arg, '=') + 1);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_PACK) {
+		/* Takes the place of the repository path */
+		if (d->repo_path != NULL) {
+			error("--pack replaces the repository path, and must come before the mountpoint\n");
+			return -1;
+		}
+		d->repo_path = realpath(strchr(arg, '=') + 1, NULL);
+		if (d->repo_path == NULL) {
+			error("%s: Failed to resolve path: %s\n", strchr(arg, '=') + 1, strerror(errno));
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_EXPORT_EROFS) {
+		free(d->export_erofs);
+		d->export_erofs = strdup(strchr(arg, '=') + 1);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_EXPORT_ORDER) {
+		free(d->export_order);
+		d->export_order = strdup(strchr(arg, '=') + 1);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_HELP) {
+		usage(outargs, stdout);
+		exit(0);
+	} else if (key == KEY_NO_OID_FILES) {
+		d->no_oid_files = 1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_DIR_SIZES) {
+		d->dir_sizes = 1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_THREADS) {
+		char *end;
+		d->threads = strtoul(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || d->threads == 0) {
+			error("Invalid number of threads: %s\n", arg);
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_NFS_EXPORT) {
+		d->nfs_export = 1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_DAEMON) {
+		free(d->daemon_socket);
+		d->daemon_socket = strdup(strchr(arg, '=') + 1);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_CACHE_SIZE) {
+		size_t size;
+		if (gitfs_parse_size(strchr(arg, '=') + 1, &size) < 0) {
+			error("Invalid cache size: %s\n", arg);
+			return -1;
+		}
+		/* This is a process-wide setting, also in daemon mode */
+		gitfs_set_cache_size(size);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_SHARED_CACHE) {
+		size_t size;
+		if (gitfs_parse_size(strchr(arg, '=') + 1, &size) < 0) {
+			error("Invalid shared cache size: %s\n", arg);
+			return -1;
+		}
+		/* Process-wide as well, so only opened once. Note that
+		 * this must happen before chrooting. */
+		if (!shm_cache.header && gitfs_shm_open(size) < 0)
+			return -1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_DROP_PACK_CACHE) {
+		/* Process-wide too, and only affects repositories opened
+		 * (or reopened after a repack) from now on */
+		drop_pack_cache = true;
+		/* Pages libgit2 keeps mapped can't be dropped, so make it
+		 * map small windows and unmap them again soon */
+		git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)GITFS_MWINDOW_SIZE);
+		git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, (size_t)GITFS_MWINDOW_MAPPED_LIMIT);
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_STREAM_SIZE) {
+		/* Process-wide as well */
+		if (gitfs_parse_size(strchr(arg, '=') + 1, &stream_size) < 0) {
+			error("Invalid stream size: %s\n", arg);
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_SCAN_THRESHOLD) {
+		char *end;
+		/* Process-wide as well */
+		scan_threshold = strtoul(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0') {
+			error("Invalid scan threshold: %s\n", arg);
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_QOS) {
+		/* Process-wide as well, so only loaded once. Note that
+		 * this must happen before chrooting. */
+		if (qos.classes) {
+			error("Only a single qos option is supported\n");
+			return -1;
+		}
+		if (gitfs_qos_load(strchr(arg, '=') + 1) < 0)
+			return -1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_STATS) {
+		/* Process-wide as well, /proc is needed to find the
+		 * names of processes */
+		if (gitfs_proc_open() < 0)
+			return -1;
+		if (!stats.enabled)
+			clock_gettime(CLOCK_MONOTONIC, &stats.start);
+		stats.enabled = true;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_SEARCH_INDEX) {
+		/* Process-wide as well, so only opened once. Note that
+		 * this must happen before chrooting. */
+		if (search_store.dir_fd >= 0) {
+			error("Only a single search-index option is supported\n");
+			return -1;
+		}
+		if (gitfs_search_open(strchr(arg, '=') + 1) < 0)
+			return -1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_DIGEST_INDEX) {
+		/* Same here */
+		if (digest_store.fd >= 0) {
+			error("Only a single digest-index option is supported\n");
+			return -1;
+		}
+		if (gitfs_digest_open(strchr(arg, '=') + 1) < 0)
+			return -1;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_BACKGROUND_THREADS) {
+		/* Process-wide as well, also in daemon mode */
+		char *end;
+		tasks.threads = strtoul(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || tasks.threads == 0) {
+			error("Invalid number of background threads: %s\n", arg);
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_BACKGROUND_CPU) {
+		char *end;
+		tasks.cpu = strtoul(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || tasks.cpu == 0 || tasks.cpu > 100) {
+			error("Invalid background cpu percentage: %s\n", arg);
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_LOCAL_CACHE) {
+		/* Process-wide as well, and only affects repositories
+		 * opened (or reopened) from now on */
+		free(local_cache.path);
+		local_cache.path = realpath(strchr(arg, '=') + 1, NULL);
+		if (local_cache.path == NULL) {
+			error("%s: Failed to resolve path: %s\n", strchr(arg, '=') + 1, strerror(errno));
+			return -1;
+		}
+		/* Opened now, so it is still reachable after chrooting */
+		if (local_cache.dir_fd >= 0)
+			close(local_cache.dir_fd);
+		if ((local_cache.dir_fd = open(local_cache.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+			error("%s: Failed to open local cache: %s\n", local_cache.path, strerror(errno));
+			return -1;
+		}
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	} else if (key == KEY_LOCAL_CACHE_SIZE) {
+		size_t size;
+		if (gitfs_parse_size(strchr(arg, '=') + 1, &size) < 0) {
+			error("Invalid local cache size: %s\n", arg);
+			return -1;
+		}
+		local_cache.max_size = size;
+		/* Don't pass this option onto fuse_main */
+		return 0;
+	}
+
+	/* Pass all other options to fuse_main */
+	return 1;
+}
+
+/* Resolve the revision to mount (d->rev) in repo, filling
+ * d->tree_oid, d->commit_time and the oid entries. Returns -1 (after
+ * printing an error) when the revision cannot be resolved. */
+static int gitfs_resolve_rev(struct gitfs_data *d, git_repository *repo)
+{
+	char sha[GIT_OID_HEXSZ + 1];
+
+	/* Default to HEAD */
+	const char *rev = "HEAD";
+	if (d->rev)
+		rev = d->rev;
+	debug("using rev %s\n", rev);
+
+	git_object *obj;
+	if (git_revparse_single(&obj, repo, rev) < 0)
+		return error("Failed to resolve rev: %s\n", rev), -1;
+
+	git_tree *tree;
+	git_commit *commit;
+	switch (git_object_type(obj)) {
+		case GIT_OBJ_COMMIT:
+			commit = (git_commit*)obj;
+			git_oid_fmt(sha, git_commit_id(commit));
+			sha[GIT_OID_HEXSZ] = '\0';
+			debug("using commit %s\n", sha);
+
+			/* rev points to a commit, lookup corresponding
+			 * tree */
+			if (git_commit_tree(&tree, commit) < 0) {
+				git_object_free(obj);
+				return error("Failed to lookup tree for rev: %s\n", rev), -1;
+			}
+			d->commit_time = git_commit_time(commit);
+			git_oid_cpy(&d->commit_oid, git_commit_id(commit));
+
+			/* Export the commit id through a magic file */
+			if (gitfs_init_oid_entry(d, "/.git-fs-commit-id", git_commit_id(commit)) < 0) {
+				git_tree_free(tree);
+				git_object_free(obj);
+				return -1;
+			}
+			git_object_free(obj);
+			break;
+		case GIT_OBJ_TREE:
+			/* rev points to a tree, just use it */
+			tree = (git_tree*)obj;
+
+			git_oid_fmt(sha, git_tree_id(tree));
+			sha[GIT_OID_HEXSZ] = '\0';
+			debug("using commit %s\n", sha);
+
+			/* Trees don't store any time information, so
+			 * just use the current time (better than using
+			 * 0, which can confuse programs such as tar).
+			 * */
+			d->commit_time = time(NULL);
+			break;
+		default:
+			git_object_free(obj);
+			return error("rev does not point to a tree or commit: %s\n", rev), -1;
+	}
+
+	git_oid_fmt(sha, git_tree_id(tree));
+	sha[GIT_OID_HEXSZ] = '\0';
+	debug("using tree %s\n", sha);
+
+	/* Save the oid we found, for gitfs_init to open after chrooting */
+	git_oid_cpy(&d->tree_oid, git_tree_id(tree));
+
+	git_tree_free(tree);
+
+	/* Export the tree id through a magic file */
+	if (gitfs_init_oid_entry(d, "/.git-fs-tree-id", &d->tree_oid) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Add the alternates listed in objects_dir/info/alternates, and their
+ * alternates (recursively, like git does) to d->alternates. */
+static int gitfs_load_alternates(struct gitfs_data *d, const char *objects_dir, int depth)
+{
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t len = 0, i;
+	int retval = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/info/alternates", objects_dir);
+	if (!(f = fopen(path, "r")))
+		return 0;
+
+	/* This is the same limit git uses */
+	if (depth > 5) {
+		fclose(f);
+		return error("%s: too many nested alternates\n", path), -1;
+	}
+
+	while (retval == 0 && getline(&line, &len, f) >= 0) {
+		char *end = line + strlen(line);
+		while (end > line && (end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t'))
+			*--end = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		/* Relative alternates are relative to the objects dir
+		 * that lists them */
+		if (line[0] == '/')
+			snprintf(path, sizeof(path), "%s", line);
+		else
+			snprintf(path, sizeof(path), "%s/%s", objects_dir, line);
+
+		char *resolved = realpath(path, NULL);
+		if (!resolved) {
+			error("%s: Failed to resolve alternate: %s\n", path, strerror(errno));
+			continue;
+		}
+
+		for (i = 0; i < d->alternate_count; i++) {
+			if (!strcmp(d->alternates[i], resolved))
+				break;
+		}
+		if (i < d->alternate_count) {
+			free(resolved);
+			continue;
+		}
+
+		char **alternates = realloc(d->alternates, (d->alternate_count + 2) * sizeof(*alternates));
+		if (!alternates) {
+			free(resolved);
+			error("Failed to allocate memory for alternates\n");
+			retval = -1;
+			break;
+		}
+		d->alternates = alternates;
+		d->alternates[d->alternate_count++] = resolved;
+		d->alternates[d->alternate_count] = NULL;
+
+		retval = gitfs_load_alternates(d, resolved, depth + 1);
+	}
+
+	free(line);
+	fclose(f);
+	return retval;
+}
+
+/* Find the alternates of the repository and the directory to chroot
+ * into. This must happen before chrooting (obviously). */
+static int gitfs_resolve_chroot(struct gitfs_data *d)
+{
+	char objects_dir[PATH_MAX];
+
+	if (!(d->chroot_path = strdup(d->repo_path)))
+		return error("Failed to allocate memory for chroot path\n"), -1;
+
+	if (d->pack) {
+		/* A single pack has no alternates, so just chroot into
+		 * its directory */
+		char *slash = strrchr(d->chroot_path, '/');
+		slash[slash == d->chroot_path] = '\0';
+	} else {
+		snprintf(objects_dir, sizeof(objects_dir), "%s/objects", d->repo_path);
+		if (gitfs_load_alternates(d, objects_dir, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Add the mount options used for every git-fs mount to args */
+static void gitfs_add_mount_opts(struct gitfs_data *d, struct fuse_args *args)
+{
+	char *opts = NULL; /* fuse_opt_add_opt will allocate this */
+
+	/* Force the mount to be read-only */
+	fuse_opt_add_opt(&opts, "ro");
+
+	/* Set a meaningful fsname (e.g., to let mount show
+	 * "foo.git mounted on /somewhere"). */
+	char fsname_opt[PATH_MAX + 8];
+	snprintf(fsname_opt, lengthof(fsname_opt), "fsname=%s", d->repo_path);
+	fuse_opt_add_opt_escaped(&opts, fsname_opt);
+
+	/* Make the filsystem type "fuse.git-fs" (this is the default if
+	 * fsname is not specified). */
+	fuse_opt_add_opt(&opts, "subtype=git-fs");
+
+	/* Since we are a read-only filesystem and our contents cannot
+	 * be externally modified (note that even if the git repository
+	 * changes, the specific tree object we've locked onto can never
+	 * change!), enable some aggresive caching to greatly improve
+	 * performance. */
+
+	/* This enables the usual kernel caching methods for file
+	 * contents. The kernel normally takes care of updating any
+	 * cache entries when they are written to (so this only works
+	 * when the filesystem is only written to through fuse). */
+	fuse_opt_add_opt(&opts, "kernel_cache");
+
+	/* These enable more aggresive caching of file existence and
+	 * attributes (the default is 1 second, but since our contents
+	 * never change, we raise this to 600 seconds). */
+	fuse_opt_add_opt(&opts, "entry_timeout=600");
+	fuse_opt_add_opt(&opts, "negative_timeout=600");
+	fuse_opt_add_opt(&opts, "attr_timeout=600");
+
+	/* Tell the kernel to go ahead and check permissions based on
+	 * the mode we return in getattr (by default, we're supposed to
+	 * check permissions in open, getattr, etc. but we don't want
+	 * that). There's probably not much permissions to check, but
+	 * let's set this anyway. */
+	fuse_opt_add_opt(&opts, "default_permissions");
+
+	if (d->nfs_export) {
+		/* Use the inode numbers from getattr, which are derived
+		 * from the path and hence stable (and used as node ids,
+		 * see gitfs_node_ids_in) */
+		fuse_opt_add_opt(&opts, "use_ino");
+		/* NFS clients can present a file handle long after the
+		 * kernel dropped the inode, so libfuse must remember the
+		 * node id -> path mapping for all nodes it handed out */
+		fuse_opt_add_opt(&opts, "noforget");
+
+		/* Node ids are derived from the path, so they stay the
+		 * same over restarts, but the same path is another file
+		 * in another tree. Derive the generation from the tree,
+		 * so the kernel rejects handles for another tree as
+		 * stale. Zero is avoided, since it means "don't
+		 * adjust". */
+		uint64_t gen = gitfs_fnv1a(GITFS_FNV_INIT, &d->tree_oid, sizeof(d->tree_oid));
+		d->generation = (uint32_t)(gen ^ (gen >> 32)) | 1;
+	}
+
+	/* Append the options collected in opts */
+	fuse_opt_insert_arg(args, 1, "-o");
+	fuse_opt_insert_arg(args, 2, opts);
+
+	free(opts);
+	opts = NULL;
+}
+
+/* A mount managed by the daemon */
+struct gitfs_mount {
+	char *mountpoint;
+	struct gitfs_data *d;
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	/* Runs gitfs_loop for this mount */
+	pthread_t thread;
+	/* Set when thread is done, so it can be joined */
+	volatile bool finished;
+	struct gitfs_mount *next;
+};
+
+static struct gitfs_mount *mounts;
+static volatile sig_atomic_t daemon_exit;
+
+static void gitfs_daemon_signal(int signum) {
+	daemon_exit = 1;
+}
+
+static void gitfs_data_free(struct gitfs_data *d) {
+	size_t i;
+
+	for (i = 0; i < d->alternate_count; i++)
+		free(d->alternates[i]);
+	free(d->alternates);
+	free(d->chroot_path);
+	free(d->repo_path);
+	free(d->rev);
+	free(d->daemon_socket);
+	gitfs_node_ids_free(d);
+	free(d->export_erofs);
+	free(d->export_order);
+	free(d);
+}
+
+static void *gitfs_mount_main(void *data) {
+	struct gitfs_mount *m = (struct gitfs_mount *)data;
+
+	gitfs_loop(m->fuse, m->d);
+
+	/* This (lazily) unmounts, if not done externally already */
+	fuse_unmount(m->mountpoint, m->ch);
+	/* This calls gitfs_destroy, but only if the mount was
+	 * initialized, so call it again to be sure (it is safe to call
+	 * it twice). */
+	fuse_destroy(m->fuse);
+	gitfs_destroy(m->d);
+
+	debug("unmounted %s\n", m->mountpoint);
+	m->finished = true;
+	return NULL;
+}
+
+/* Join and free mounts that were unmounted */
+static void gitfs_daemon_reap() {
+	struct gitfs_mount **p = &mounts, *m;
+
+	while ((m = *p)) {
+		if (!m->finished) {
+			p = &m->next;
+			continue;
+		}
+		pthread_join(m->thread, NULL);
+		*p = m->next;
+		gitfs_data_free(m->d);
+		free(m->mountpoint);
+		free(m);
+	}
+}
+
+/* Mount a repository from the daemon. Options are given in the same
+ * format as passed to -o on the commandline. */
+static int gitfs_daemon_mount(const char *repo_path, const char *mountpoint, const char *options)
 {
-	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
-	debug("readdir called for '%s'\n", path);
-	gitfs_entry *e = GITFS_FH(fi);
-	if (e->type != GITFS_DIR)
-		return debug("Path is not a directory?!: '%s'\n", path), -EIO;
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct gitfs_mount *m;
+	struct gitfs_data *d;
+	char *mnt = NULL;
+	int multithreaded, foreground;
+	sigset_t all, old;
 
-	int entry_count = git_tree_entrycount(e->object.tree);
-	while (offset < (entry_count)) {
-		const git_tree_entry *entry = git_tree_entry_byindex(e->object.tree, offset);
-		/* Add the entry to the list. The offset passed is the
-		 * offset to the _next_ entry. If filler returns 1, buf
-		 * is full, and we should stop trying to add entries.
-		 * Note that the the last entry is _not_ added in this
-		 * case. Future calls readdir will have offset
-		 * appropriately set to the value passed to filler with
-		 * the last successful addition. */
-		if (filler(buf, git_tree_entry_name(entry), NULL, offset + 1) == 1)
-			return 0;
-		offset++;
+	m = calloc(1, sizeof(*m));
+	d = calloc(1, sizeof(*d));
+	if (!m || !d) {
+		error("Failed to allocate memory for mount\n");
+		goto err;
 	}
+	d->daemon = true;
+	m->d = d;
 
-	if (path[0] == '/' && path[1] == '\0') {
-		/* Dirlisting of root dir /, insert all magic oid paths
-		 * first. */
-		while (offset - entry_count < d->oid_entry_count) {
-			/* Note that we skip the first char of
-			 * object.oid.path, which is a leading / for
-			 * easy comparison in gitfs_lookup_oid_entry. */
-			if (filler(buf, d->oid_paths[offset - entry_count] + 1, NULL, offset + 1) == 1)
-				return 0;
-			offset++;
-		}
+	fuse_opt_add_arg(&args, "git-fs");
+	fuse_opt_add_arg(&args, repo_path);
+	fuse_opt_add_arg(&args, mountpoint);
+	if (options) {
+		fuse_opt_add_arg(&args, "-o");
+		fuse_opt_add_arg(&args, options);
+	}
+
+	if (fuse_opt_parse(&args, d, gitfs_opts, gitfs_opt_proc))
+		goto err;
+	if (d->daemon_socket) {
+		error("Cannot start a daemon from a daemon\n");
+		goto err;
+	}
+
+	/* No need to reopen the repository later, since we're not
+	 * chrooting */
+	if (!(d->repo = gitfs_repo_open(d->repo_path, NULL, NULL)))
+		goto err;
+	struct gitfs_odb *o = gitfs_odb_get(d->repo);
+	int resolved = gitfs_resolve_rev(d, o->repo);
+	gitfs_odb_put(o);
+	if (resolved < 0)
+		goto err;
+
+	gitfs_add_mount_opts(d, &args);
+
+	/* This is what fuse_setup does, except for daemonizing and
+	 * setting up signal handlers */
+	if (fuse_parse_cmdline(&args, &mnt, &multithreaded, &foreground) < 0)
+		goto err;
+	if (!mnt) {
+		error("No mountpoint given\n");
+		goto err;
 	}
+	m->mountpoint = mnt;
 
+	if (!(m->ch = fuse_mount(mnt, &args)))
+		goto err;
+
+	if (!(m->fuse = fuse_new(m->ch, &args, &gitfs_oper, sizeof(gitfs_oper), d))) {
+		fuse_unmount(mnt, m->ch);
+		goto err;
+	}
+
+	if (!multithreaded)
+		d->threads = 1;
+	else if (!d->threads)
+		d->threads = gitfs_cpu_count();
+
+	/* Signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&m->thread, NULL, gitfs_mount_main, m) != 0) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		error("Failed to start thread for %s\n", mnt);
+		fuse_unmount(mnt, m->ch);
+		fuse_destroy(m->fuse);
+		goto err;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
+	m->next = mounts;
+	mounts = m;
+	fuse_opt_free_args(&args);
 	return 0;
+
+err:
+	fuse_opt_free_args(&args);
+	if (d) {
+		gitfs_destroy(d);
+		gitfs_data_free(d);
+	}
+	free(mnt);
+	free(m);
+	return -1;
 }
 
-int gitfs_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static int gitfs_daemon_umount(const char *mountpoint)
 {
-	debug("read called for '%s' (offset %d, size %d)\n", path, offset, size);
-	size_t blob_size;
-	const void *blob;
+	struct gitfs_mount *m;
+	char *path = realpath(mountpoint, NULL);
 
-	gitfs_entry *e = GITFS_FH(fi);
-	debug("type %d\n", e->type);
-	switch (e->type) {
-		case GITFS_FILE:
-			if (!S_ISREG(git_tree_entry_filemode(e->tree_entry)))
-				return error("Path is not a regular file?!: '%s'\n", path), -EIO;
-			blob_size = git_blob_rawsize(e->object.blob);
-			blob = git_blob_rawcontent(e->object.blob);
-			break;
-		case GITFS_OID:
-			blob_size = GIT_OID_HEXSZ + 1;
-			blob = e->object.oid;
+	for (m = mounts; m; m = m->next) {
+		if (!m->finished && (!strcmp(m->mountpoint, mountpoint) ||
+				     (path && !strcmp(m->mountpoint, path))))
 			break;
-		default:
-			return error("Path is not a file?!: '%s'\n", path), -EIO;
 	}
+	free(path);
 
-	if (offset >= blob_size)
-		size = 0;
-	else if (offset + size > blob_size)
-		size = blob_size - offset;
+	if (!m)
+		return error("Not mounted: %s\n", mountpoint), -1;
 
-	if (size)
-		memcpy(buf, blob + offset, size);
+	/* Unmounting makes the kernel abort the connection, after which
+	 * gitfs_loop for this mount returns and cleans up */
+	fuse_unmount(m->mountpoint, NULL);
+	return 0;
+}
 
-	debug( "read copied %d bytes\n", (int)size);
-	return size;
+/* Handle a single command line, writing the reply to out */
+static void gitfs_daemon_command(char *line, FILE *out)
+{
+	char *save, *cmd, *arg1, *arg2, *arg3;
+	int retval = -1;
+
+	cmd = strtok_r(line, " \t\r\n", &save);
+	arg1 = strtok_r(NULL, " \t\r\n", &save);
+	arg2 = strtok_r(NULL, " \t\r\n", &save);
+	arg3 = strtok_r(NULL, " \t\r\n", &save);
+
+	gitfs_daemon_reap();
+
+	if (!cmd) {
+		/* Ignore empty lines */
+		return;
+	} else if (!strcmp(cmd, "mount") && arg1 && arg2) {
+		retval = gitfs_daemon_mount(arg1, arg2, arg3);
+	} else if (!strcmp(cmd, "umount") && arg1 && !arg2) {
+		retval = gitfs_daemon_umount(arg1);
+	} else if (!strcmp(cmd, "list") && !arg1) {
+		struct gitfs_mount *m;
+		char sha[GIT_OID_HEXSZ + 1];
+		for (m = mounts; m; m = m->next) {
+			if (m->finished)
+				continue;
+			git_oid_fmt(sha, &m->d->tree_oid);
+			sha[GIT_OID_HEXSZ] = '\0';
+			fprintf(out, "%s %s %s\n", m->mountpoint, m->d->repo_path, sha);
+		}
+		retval = 0;
+	} else {
+		error("Invalid command: %s\n", cmd);
+	}
+
+	fprintf(out, retval < 0 ? "error\n" : "ok\n");
+	fflush(out);
 }
 
-int gitfs_readlink(const char *path, char *buf, size_t size) {
-	int retval = 0;
-	debug("read called for '%s'\n", path);
-	gitfs_entry *e = NULL;
+/* Run as a daemon managing mounts through the control socket at
+ * socket_path, until we get a signal to quit. Returns the exit code. */
+static int gitfs_daemon(const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = gitfs_daemon_signal };
+	struct gitfs_mount *m;
+	int sock;
 
-	/* Sanity checks */
-	if ((retval = gitfs_lookup_entry(&e, path)) < 0)
-		goto out;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return error("Socket path too long: %s\n", socket_path), 1;
+	strcpy(addr.sun_path, socket_path);
 
-	if (e->type != GITFS_FILE || !S_ISLNK(git_tree_entry_filemode(e->tree_entry))) {
-		debug("Path is not a link?!: '%s'\n", path);
-		retval = -EIO;
-		goto out;
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return error("Failed to create socket: %s\n", strerror(errno)), 1;
+
+	/* Remove a stale socket from a previous run */
+	unlink(socket_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+		error("Failed to listen on %s: %s\n", socket_path, strerror(errno));
+		close(sock);
+		return 1;
 	}
 
-	int blob_size = git_blob_rawsize(e->object.blob);
+	/* No SA_RESTART, so accept and friends return EINTR on a
+	 * signal */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
 
-	/* If the blob is too big for buf (keeping room for the trailing
-	 * NUL), truncate (as per fuse docs) */
-	if (blob_size  > size - 1)
-		blob_size = size - 1;
+	debug("listening on %s\n", socket_path);
+	while (!daemon_exit) {
+		int client = accept(sock, NULL, NULL);
+		if (client < 0) {
+			if (errno != EINTR)
+				error("Failed to accept connection: %s\n", strerror(errno));
+			continue;
+		}
 
-	memcpy(buf, git_blob_rawcontent(e->object.blob), blob_size);
-	buf[blob_size] = '\0';
+		FILE *f = fdopen(client, "r+");
+		if (!f) {
+			close(client);
+			continue;
+		}
 
-out:
-	if (e)
-		gitfs_entry_free(e);
-	return retval;
+		/* Handle commands until the client closes the
+		 * connection. Clients are handled one at a time. */
+		char *line = NULL;
+		size_t len = 0;
+		while (!daemon_exit && getline(&line, &len, f) >= 0)
+			gitfs_daemon_command(line, f);
+		free(line);
+		fclose(f);
+	}
+
+	debug("unmounting everything\n");
+	close(sock);
+	unlink(socket_path);
+
+	/* Stop processing requests, even for mounts that are still in
+	 * use (gitfs_mount_main unmounts them lazily afterwards) */
+	for (m = mounts; m; m = m->next) {
+		if (!m->finished)
+			gitfs_loop_exit(m->fuse, m->d);
+	}
+	for (m = mounts; m; m = m->next)
+		m->finished = true;
+	gitfs_daemon_reap();
+
+	return 0;
 }
 
-void gitfs_destroy(void *private_data) {
-	struct gitfs_data *d = (struct gitfs_data *)private_data;
-	int i;
+/* Exporting as an EROFS image, see --export-erofs.
+ *
+ * Writes the files of the tree to an image that the kernel mounts by
+ * itself (mount -t erofs -o loop), for trees used as is for a long time
+ * (e.g. as root filesystem), which don't need anything git-fs does.
+ * Only the plain (uncompressed) layouts are used: the inodes are packed
+ * in the metadata area following the superblock, each followed by the
+ * tail of its data (the part not filling a block) when small enough,
+ * and the full blocks go in the data area after that. Files with the
+ * same contents share their blocks, which are written in the export
+ * order (e.g. the order files are read in while booting) when given,
+ * then in the order they are first found in. */
+#define GITFS_EROFS_MAGIC 0xE0F5E1E2
+#define GITFS_EROFS_BLOCK_BITS 12
+#define GITFS_EROFS_BLOCK (1 << GITFS_EROFS_BLOCK_BITS)
+#define GITFS_EROFS_SUPER_OFFSET 1024
+#define GITFS_EROFS_SUPER_SIZE 128
+/* Inodes are found by their nid: their offset in the metadata area
+ * (which starts at block 0) in slots */
+#define GITFS_EROFS_SLOT 32
+#define GITFS_EROFS_COMPACT_SIZE 32
+#define GITFS_EROFS_EXTENDED_SIZE 64
+#define GITFS_EROFS_DIRENT_SIZE 12
+#define GITFS_EROFS_NAME_LEN 255
+/* Data layouts */
+#define GITFS_EROFS_FLAT_PLAIN 0
+#define GITFS_EROFS_FLAT_INLINE 2
+/* File types of dirents */
+#define GITFS_EROFS_FT_REG_FILE 1
+#define GITFS_EROFS_FT_DIR 2
+#define GITFS_EROFS_FT_SYMLINK 7
+/* The largest tail stored after its inode (so the two always fit in
+ * a block), larger ones get a block of their own */
+#define GITFS_EROFS_INLINE_MAX (GITFS_EROFS_BLOCK / 2)
 
-	if (d) {
-		if (d->tree) git_tree_free(d->tree);
-		if (d->repo) git_repository_free(d->repo);
-		for (i = 0; i < d->oid_entry_count; i++) {
-			free(d->oid_entries[i].object.oid);
+#define GITFS_EROFS_BLOCKS(size) (((size) + GITFS_EROFS_BLOCK - 1) >> GITFS_EROFS_BLOCK_BITS)
+
+/* Contents of any number of files in the image */
+struct gitfs_erofs_blob {
+	git_oid oid;
+	uint64_t size;
+	/* Position in the export order (SIZE_MAX when not listed) and
+	 * in walk order */
+	size_t rank, index;
+	/* First block of the data */
+	uint32_t blkaddr;
+	/* The files with these contents */
+	struct gitfs_erofs_node *nodes;
+	struct gitfs_erofs_blob *next;
+};
+
+/* A file, symlink or directory in the image */
+struct gitfs_erofs_node {
+	char *name;
+	uint16_t mode;
+	uint32_t nlink;
+	/* Contents of files and symlinks (NULL for directories), and
+	 * the next file with the same contents */
+	struct gitfs_erofs_blob *blob;
+	struct gitfs_erofs_node *next;
+	/* Entries of directories, sorted by name once all are found */
+	struct gitfs_erofs_node **entries;
+	size_t count;
+	struct gitfs_erofs_node *parent;
+	/* Size of the data (the dirents for directories), where its
+	 * blocks are and whether its tail follows the inode */
+	uint64_t size;
+	uint32_t blkaddr;
+	bool inline_tail;
+	uint64_t nid;
+};
+
+/* A directory entry, see gitfs_erofs_dir */
+struct gitfs_erofs_dirent {
+	const char *name;
+	struct gitfs_erofs_node *node;
+};
+
+/* A path listed in the export order, see gitfs_erofs_load_order */
+struct gitfs_erofs_order {
+	char *path;
+	size_t rank;
+};
+
+/* State of exporting a tree, see gitfs_export_erofs */
+struct gitfs_erofs {
+	struct gitfs_data *d;
+	struct gitfs_odb *o;
+	int fd;
+	/* All nodes in walk order (each directory before its entries,
+	 * starting with the root), which is the order of their inodes */
+	struct gitfs_erofs_node **nodes;
+	size_t count;
+	/* The directories leading to the entry walked, by depth */
+	struct gitfs_erofs_node **dirs;
+	size_t dir_capacity;
+	/* Distinct blobs */
+	struct gitfs_oid_table blobs;
+	/* The export order, sorted by path */
+	struct gitfs_erofs_order *order;
+	size_t order_count;
+	int retval;
+};
+
+static void gitfs_put_le16(unsigned char *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void gitfs_put_le32(unsigned char *p, uint32_t v) {
+	gitfs_put_le16(p, v);
+	gitfs_put_le16(p + 2, v >> 16);
+}
+
+static void gitfs_put_le64(unsigned char *p, uint64_t v) {
+	gitfs_put_le32(p, v);
+	gitfs_put_le32(p + 4, v >> 32);
+}
+
+/* Returns whether the tail of data of the given size follows its
+ * inode */
+static bool gitfs_erofs_inline(uint64_t size) {
+	return size % GITFS_EROFS_BLOCK && size % GITFS_EROFS_BLOCK <= GITFS_EROFS_INLINE_MAX;
+}
+
+/* Returns the number of blocks in the data area taken by data of the
+ * given size */
+static uint64_t gitfs_erofs_data_blocks(uint64_t size) {
+	return gitfs_erofs_inline(size) ? size / GITFS_EROFS_BLOCK : GITFS_EROFS_BLOCKS(size);
+}
+
+/* Compact inodes leave out the mtime (the build time of the image is
+ * used) and only have room for 32-bit sizes and 16-bit link counts */
+static size_t gitfs_erofs_inode_size(const struct gitfs_erofs_node *n) {
+	if (n->size > UINT32_MAX || n->nlink > UINT16_MAX)
+		return GITFS_EROFS_EXTENDED_SIZE;
+	return GITFS_EROFS_COMPACT_SIZE;
+}
+
+static uint8_t gitfs_erofs_file_type(const struct gitfs_erofs_node *n) {
+	if (S_ISDIR(n->mode))
+		return GITFS_EROFS_FT_DIR;
+	if (S_ISLNK(n->mode))
+		return GITFS_EROFS_FT_SYMLINK;
+	return GITFS_EROFS_FT_REG_FILE;
+}
+
+static void gitfs_erofs_free(struct gitfs_erofs *e) {
+	struct gitfs_erofs_blob *b, *next;
+	size_t i;
+
+	for (i = 0; i < e->count; i++) {
+		free(e->nodes[i]->name);
+		free(e->nodes[i]->entries);
+		free(e->nodes[i]);
+	}
+	free(e->nodes);
+	free(e->dirs);
+	for (i = 0; i < e->blobs.bucket_count; i++) {
+		for (b = e->blobs.buckets[i]; b; b = next) {
+			next = b->next;
+			free(b);
 		}
 	}
+	free(e->blobs.buckets);
+	for (i = 0; i < e->order_count; i++)
+		free(e->order[i].path);
+	free(e->order);
 }
 
-void* gitfs_init(struct fuse_conn_info *conn) {
-	char sha[GIT_OID_HEXSZ + 1];
-	/* Start by chrooting into the git repository. Doing this allows
-	 * git-fs to be started from within initrd and not break if
-	 * mount points are shuffled around, causing the location of the
-	 * git repository to change. By chrooting into the .git dir,
-	 * anything can happen, except for unmounting it completely.
-	 * Note that we can't do this chroot in main(), since fuse_main
-	 * needs /dev/fuse and possibly /dev/null and others too... */
-	struct gitfs_data *d = (struct gitfs_data *)(fuse_get_context()->private_data);
-	debug("chrooting to %s\n", d->repo_path);
+static int gitfs_erofs_order_cmp(const void *a, const void *b) {
+	return strcmp(((const struct gitfs_erofs_order *)a)->path, ((const struct gitfs_erofs_order *)b)->path);
+}
 
-	if (chroot(d->repo_path) < 0) {
-		error("Failed to chroot to %s: %s\n", d->repo_path, strerror(errno));
-		goto err;
+/* Load the export order from path: a path (relative to the root of the
+ * tree) per line, earlier ones placed first */
+static int gitfs_erofs_load_order(struct gitfs_erofs *e, const char *path) {
+	struct gitfs_erofs_order *order;
+	char *line = NULL, *p;
+	size_t len = 0;
+	ssize_t n;
+	FILE *in;
+
+	if (!(in = fopen(path, "re")))
+		return error("%s: Failed to open export order: %s\n", path, strerror(errno)), -1;
+	while ((n = getline(&line, &len, in)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		for (p = line; *p == '/'; p++)
+			;
+		if (!*p)
+			continue;
+		/* Grow by doubling, whenever the count reaches a power
+		 * of two */
+		if (!(e->order_count & (e->order_count - 1))) {
+			if (!(order = realloc(e->order, (e->order_count ? e->order_count * 2 : 1) * sizeof(*order))))
+				goto nomem;
+			e->order = order;
+		}
+		if (!(e->order[e->order_count].path = strdup(p)))
+			goto nomem;
+		e->order[e->order_count].rank = e->order_count;
+		e->order_count++;
 	}
-	if (chdir("/") < 0) {
-		error("Failed to chdir to /: %s\n", strerror(errno));
-		goto err;
+	if (ferror(in)) {
+		free(line);
+		fclose(in);
+		return error("%s: Failed to read export order\n", path), -1;
 	}
+	free(line);
+	fclose(in);
+	qsort(e->order, e->order_count, sizeof(*e->order), gitfs_erofs_order_cmp);
+	return 0;
 
-	debug("opening repo after fuse_main\n");
-	if (git_repository_open(&d->repo, "/") < 0) {
-		error("Cannot open git repository: %s\n", giterr_last()->message);
-		goto err;
-	}
+nomem:
+	free(line);
+	fclose(in);
+	return error("Failed to allocate memory for export order\n"), -ENOMEM;
+}
 
-	if (git_tree_lookup(&d->tree, d->repo, &d->tree_oid) < 0) {
-		git_oid_fmt(sha, &d->tree_oid);
-		sha[GIT_OID_HEXSZ] = '\0';
-		error("Failed to lookup tree: %s\n", sha);
-		goto err;
-	}
+/* Returns the blob with the given oid, adding it when not found yet */
+static struct gitfs_erofs_blob *gitfs_erofs_blob(struct gitfs_erofs *e, const git_oid *oid) {
+	struct gitfs_erofs_blob *b;
+	git_otype type;
+	size_t size;
 
-	/* This return value can be accessed through
-	 * fuse_get_context()->private_data */
-	return (void*)d;
+	if ((b = gitfs_oid_table_find(&e->blobs, oid)))
+		return b;
 
-err:
-	gitfs_destroy((void*)d);
+	/* Only the size is needed until the data is written */
+	if (git_odb_read_header(&size, &type, e->o->odb, oid) < 0)
+		return error("Blob not found?!: %s\n", giterr_last()->message), e->retval = -EIO, NULL;
 
-	/* Tell fuse to exit the mainloop (doesn't exit immediately) */
-	fuse_exit(fuse_get_context()->fuse);
+	if (!(b = calloc(1, sizeof(*b))))
+		goto nomem;
+	git_oid_cpy(&b->oid, oid);
+	b->size = size;
+	b->rank = SIZE_MAX;
+	b->index = e->blobs.count;
+	if (gitfs_oid_table_add(&e->blobs, b) < 0) {
+		free(b);
+		goto nomem;
+	}
+	return b;
 
-	/* Store a return value, so we don't return success when the
-	 * mounting failed */
-	d->retval = 1;
+nomem:
+	error("Failed to allocate memory for export\n");
+	e->retval = -ENOMEM;
 	return NULL;
 }
 
-struct fuse_operations gitfs_oper = {
-	.init= gitfs_init,
-	.destroy= gitfs_destroy,
-	.open= gitfs_open,
-	.release= gitfs_release,
-	/* Reuse open/release for directories */
-	.opendir= gitfs_open,
-	.releasedir= gitfs_release,
-	.getattr= gitfs_getattr,
-	.readdir= gitfs_readdir,
-	.read= gitfs_read,
-	.readlink= gitfs_readlink
-};
+/* Add n to the nodes of e, and to the entries of dir (unless it is the
+ * root) */
+static int gitfs_erofs_add(struct gitfs_erofs *e, struct gitfs_erofs_node *dir, struct gitfs_erofs_node *n) {
+	struct gitfs_erofs_node **grown;
 
-void usage(struct fuse_args *args, FILE *out) {
-	fprintf(out,
-	     "usage: %s [options] repo-path mountpoint\n"
-	     "\n"
-	     "Mount the repository in repo-path onto mountpoint.\n"
-	     "repo-path should point to the .git directory, not the\n"
-	     "checkout directory (can also point to a bare repository).\n"
-	     "\n"
-	     "general options:\n"
-	     "    -o opt,[opt...]\n"
-	     "        mount options (see below)\n"
-	     "    -h\n"
-	     "    --help\n"
-	     "        print help\n"
-	     "\n"
-	     "git-fs options:\n"
-	     "    -o rev=STRING\n"
-	     "    --rev=STRING\n"
-	     "        Revision to mount. Can be any name that points to\n"
-	     "        a commit or tree object (e.g. a branch name, tag\n"
-	     "        name, symbolic ref, sha). When not specified,\n"
-	     "        HEAD is used.\n"
-	     "    -o no-oid-files\n"
-	     "        Don't export magic files /.git-fs-tree-id and\n"
-	     "        (when applicable) /.git-fs-commit-id containing\n"
-	     "        the hashes of the mounted tree and commit\n"
-	     "        respectively.\n"
-	     "\n"
-	     , args->argv[0]);
-             fuse_opt_add_arg(args, "-ho");
-             fuse_main(args->argc, args->argv, &gitfs_oper, NULL);
+	/* Grow by doubling, whenever the count reaches a power of two */
+	if (!(e->count & (e->count - 1))) {
+		if (!(grown = realloc(e->nodes, (e->count ? e->count * 2 : 1) * sizeof(*grown))))
+			return -ENOMEM;
+		e->nodes = grown;
+	}
+	if (dir && !(dir->count & (dir->count - 1))) {
+		if (!(grown = realloc(dir->entries, (dir->count ? dir->count * 2 : 1) * sizeof(*grown))))
+			return -ENOMEM;
+		dir->entries = grown;
+	}
+	e->nodes[e->count++] = n;
+	if (dir)
+		dir->entries[dir->count++] = n;
+	n->parent = dir;
+	return 0;
+}
+
+static int gitfs_erofs_walk(const char *root, const git_tree_entry *entry, void *data) {
+	struct gitfs_erofs *e = data;
+	struct gitfs_erofs_order key, *order;
+	struct gitfs_erofs_node *n, **dirs;
+	size_t depth = 0;
+	char path[PATH_MAX];
+	const char *p;
+
+	/* Submodules are not shown */
+	if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT)
+		return 0;
+	if (strlen(git_tree_entry_name(entry)) > GITFS_EROFS_NAME_LEN)
+		return error("Name too long for EROFS: %s%s\n", root, git_tree_entry_name(entry)), e->retval = -1;
+
+	/* Walked depth-first, so the directory an entry is in was the
+	 * last one walked at its depth */
+	for (p = root; *p; p++)
+		depth += *p == '/';
+
+	if (!(n = calloc(1, sizeof(*n))))
+		goto nomem;
+	if (!(n->name = strdup(git_tree_entry_name(entry))) || gitfs_erofs_add(e, e->dirs[depth], n) < 0) {
+		free(n->name);
+		free(n);
+		goto nomem;
+	}
+
+	if (git_tree_entry_type(entry) == GIT_OBJ_TREE) {
+		n->mode = 040755;
+		n->nlink = 2;
+		e->dirs[depth]->nlink++;
+		if (depth + 1 >= e->dir_capacity) {
+			if (!(dirs = realloc(e->dirs, e->dir_capacity * 2 * sizeof(*dirs))))
+				goto nomem;
+			e->dirs = dirs;
+			e->dir_capacity *= 2;
+		}
+		e->dirs[depth + 1] = n;
+		return 0;
+	}
+
+	n->mode = git_tree_entry_filemode(entry);
+	/* git just stores the link type bit for links */
+	if (S_ISLNK(n->mode))
+		n->mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
+	n->nlink = 1;
+	if (!(n->blob = gitfs_erofs_blob(e, git_tree_entry_id(entry))))
+		return -1;
+	n->size = n->blob->size;
+	n->next = n->blob->nodes;
+	n->blob->nodes = n;
+
+	/* Shared blobs are placed for the earliest of their paths */
+	if (e->order_count && snprintf(path, sizeof(path), "%s%s", root, n->name) < (int)sizeof(path)) {
+		key.path = path;
+		order = bsearch(&key, e->order, e->order_count, sizeof(*e->order), gitfs_erofs_order_cmp);
+		if (order && order->rank < n->blob->rank)
+			n->blob->rank = order->rank;
+	}
+	return 0;
+
+nomem:
+	error("Failed to allocate memory for export\n");
+	return e->retval = -ENOMEM;
 }
 
-enum {
-	KEY_DEBUG,
-	KEY_HELP,
-	KEY_REV,
-	KEY_RWRO,
-	KEY_NO_OID_FILES,
-};
+static int gitfs_erofs_node_cmp(const void *a, const void *b) {
+	return strcmp((*(struct gitfs_erofs_node *const *)a)->name, (*(struct gitfs_erofs_node *const *)b)->name);
+}
 
-static struct fuse_opt gitfs_opts[] = {
-	FUSE_OPT_KEY("-d",             KEY_DEBUG),
-	FUSE_OPT_KEY("debug",          KEY_DEBUG),
-	FUSE_OPT_KEY("-h",             KEY_HELP),
-	FUSE_OPT_KEY("--help",         KEY_HELP),
-	FUSE_OPT_KEY("--rev=%s",       KEY_REV),
-	FUSE_OPT_KEY("rev=%s",         KEY_REV),
-	FUSE_OPT_KEY("rw",             KEY_RWRO),
-	FUSE_OPT_KEY("ro",             KEY_RWRO),
-	FUSE_OPT_KEY("no-oid-files",   KEY_NO_OID_FILES),
-	FUSE_OPT_END
-};
+static int gitfs_erofs_dirent_cmp(const void *a, const void *b) {
+	return strcmp(((const struct gitfs_erofs_dirent *)a)->name, ((const struct gitfs_erofs_dirent *)b)->name);
+}
 
-static int gitfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
-{
-	struct gitfs_data *d = (struct gitfs_data *)data;
+/* Blobs are written in export order, then in walk order */
+static int gitfs_erofs_blob_cmp(const void *a, const void *b) {
+	const struct gitfs_erofs_blob *x = *(struct gitfs_erofs_blob *const *)a;
+	const struct gitfs_erofs_blob *y = *(struct gitfs_erofs_blob *const *)b;
 
-	/* The first non-option argument is the repo path */
-	if (key == FUSE_OPT_KEY_NONOPT && d->repo_path == NULL) {
-		d->repo_path = realpath(arg, NULL);
-		if (d->repo_path == NULL) {
-			error("%s: Failed to resolve path: %s\n", arg, strerror(errno));
-			return -1;
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Lay out the dirents of directory n, setting its size, and fill data
+ * (zeroed, the size of the blocks needed) with them when given. Each
+ * block holds as many dirents as fit followed by their names (not
+ * terminated), all sorted by name (lookups bisect them), including "."
+ * and "..". */
+static int gitfs_erofs_dir(struct gitfs_erofs_node *n, unsigned char *data) {
+	struct gitfs_erofs_dirent *dirents;
+	size_t count = n->count + 2, first, i, j, len = 0, nameoff, name_len;
+	uint64_t block = 0;
+	unsigned char *p;
+
+	if (!(dirents = malloc(count * sizeof(*dirents))))
+		return error("Failed to allocate memory for export\n"), -ENOMEM;
+	dirents[0].name = ".";
+	dirents[0].node = n;
+	dirents[1].name = "..";
+	dirents[1].node = n->parent ? n->parent : n;
+	for (i = 0; i < n->count; i++) {
+		dirents[i + 2].name = n->entries[i]->name;
+		dirents[i + 2].node = n->entries[i];
+	}
+	qsort(dirents, count, sizeof(*dirents), gitfs_erofs_dirent_cmp);
+
+	for (first = 0; first < count; first = i) {
+		if (first)
+			block += GITFS_EROFS_BLOCK;
+		for (i = first, len = 0; i < count; i++) {
+			name_len = strlen(dirents[i].name);
+			if (len + GITFS_EROFS_DIRENT_SIZE + name_len > GITFS_EROFS_BLOCK)
+				break;
+			len += GITFS_EROFS_DIRENT_SIZE + name_len;
 		}
-		/* Don't pass this option onto fuse_main */
-		return 0;
-	} else if (key == KEY_DEBUG) {
-		enable_debug = 1;
-		/* Pass this option onto fuse_main */
-		return 1;
-	} else if (key == KEY_RWRO) {
-		error("Mount is always read-only, ignoring %s option\n", arg);
-		/* Don't pass this option onto fuse_main */
-		return 0;
-	} else if (key == KEY_REV) {
-		if (d->rev != NULL) {
-			error("--rev / -o rev can be passed only once\n");
-			return -1;
+		if (!data)
+			continue;
+		nameoff = (i - first) * GITFS_EROFS_DIRENT_SIZE;
+		for (j = first; j < i; j++) {
+			p = data + block + (j - first) * GITFS_EROFS_DIRENT_SIZE;
+			gitfs_put_le64(p, dirents[j].node->nid);
+			gitfs_put_le16(p + 8, nameoff);
+			p[10] = gitfs_erofs_file_type(dirents[j].node);
+			name_len = strlen(dirents[j].name);
+			memcpy(data + block + nameoff, dirents[j].name, name_len);
+			nameoff += name_len;
 		}
-		d->rev = strdup(strchr(arg, '=') + 1);
-		/* Don't pass this option onto fuse_main */
-		return 0;
-	} else if (key == KEY_HELP) {
-		usage(outargs, stdout);
-		exit(0);
-	} else if (key == KEY_NO_OID_FILES) {
-		d->no_oid_files = 1;
-		/* Don't pass this option onto fuse_main */
+	}
+
+	/* The last block ends with the last name */
+	n->size = block + len;
+	free(dirents);
+	return 0;
+}
+
+static int gitfs_erofs_write(struct gitfs_erofs *e, const void *buf, size_t len, uint64_t offset) {
+	if (pwrite(e->fd, buf, len, offset) != (ssize_t)len)
+		return error("Failed to write image: %s\n", strerror(errno)), -EIO;
+	return 0;
+}
+
+/* Write the inode of n, followed by the tail of its data (size bytes)
+ * when inline */
+static int gitfs_erofs_write_inode(struct gitfs_erofs *e, struct gitfs_erofs_node *n, const unsigned char *data) {
+	unsigned char buf[GITFS_EROFS_EXTENDED_SIZE + GITFS_EROFS_INLINE_MAX] = { 0 };
+	size_t size = gitfs_erofs_inode_size(n), tail = n->inline_tail ? n->size % GITFS_EROFS_BLOCK : 0;
+	uint16_t format = (n->inline_tail ? GITFS_EROFS_FLAT_INLINE : GITFS_EROFS_FLAT_PLAIN) << 1;
+
+	gitfs_put_le16(buf + 4, n->mode);
+	gitfs_put_le32(buf + 16, n->blkaddr);
+	gitfs_put_le32(buf + 20, n->nid);
+	if (size == GITFS_EROFS_COMPACT_SIZE) {
+		gitfs_put_le16(buf, format);
+		gitfs_put_le16(buf + 6, n->nlink);
+		gitfs_put_le32(buf + 8, n->size);
+	} else {
+		gitfs_put_le16(buf, format | 1);
+		gitfs_put_le64(buf + 8, n->size);
+		gitfs_put_le64(buf + 32, e->d->commit_time);
+		gitfs_put_le32(buf + 44, n->nlink);
+	}
+	if (tail)
+		memcpy(buf + size, data + n->size - tail, tail);
+	return gitfs_erofs_write(e, buf, size + tail, n->nid * GITFS_EROFS_SLOT);
+}
+
+/* Write the blocks of data (size bytes) in the data area, from
+ * blkaddr: all but an inline tail */
+static int gitfs_erofs_write_blocks(struct gitfs_erofs *e, const unsigned char *data, uint64_t size,
+		uint32_t blkaddr) {
+	if (gitfs_erofs_inline(size))
+		size -= size % GITFS_EROFS_BLOCK;
+	if (!size)
 		return 0;
+	return gitfs_erofs_write(e, data, size, (uint64_t)blkaddr << GITFS_EROFS_BLOCK_BITS);
+}
+
+/* Write the tree of d->rev (HEAD when not given) to an EROFS image at
+ * d->export_erofs */
+static int gitfs_export_erofs(struct gitfs_data *d) {
+	struct gitfs_erofs e = { .d = d, .fd = -1, .blobs = GITFS_OID_TABLE_INIT(struct gitfs_erofs_blob) };
+	unsigned char super[GITFS_EROFS_SUPER_SIZE] = { 0 };
+	struct gitfs_erofs_blob **blobs = NULL, *b;
+	struct gitfs_erofs_node *n;
+	unsigned char *data;
+	uint64_t pos = GITFS_EROFS_SUPER_OFFSET + GITFS_EROFS_SUPER_SIZE, blocks, tail;
+	git_odb_object *obj;
+	git_tree *tree = NULL;
+	size_t i, j, size;
+	int retval = -1;
+
+	if (d->export_order && gitfs_erofs_load_order(&e, d->export_order) < 0)
+		goto out;
+	if (!(d->repo = gitfs_repo_open(d->repo_path, NULL, NULL)))
+		goto out;
+	e.o = gitfs_odb_get(d->repo);
+	if (gitfs_resolve_rev(d, e.o->repo) < 0)
+		goto out;
+	/* A tree has no time of its own, and the image must only depend
+	 * on the tree, so use SOURCE_DATE_EPOCH (as reproducible builds
+	 * do) or 0 instead of the current time */
+	if (git_oid_iszero(&d->commit_oid)) {
+		const char *epoch = getenv("SOURCE_DATE_EPOCH");
+		char *end;
+
+		d->commit_time = 0;
+		if (epoch && *epoch) {
+			d->commit_time = strtoll(epoch, &end, 10);
+			if (*end != '\0') {
+				error("Invalid SOURCE_DATE_EPOCH: %s\n", epoch);
+				goto out;
+			}
+		}
+	}
+	if (git_tree_lookup(&tree, e.o->repo, &d->tree_oid) < 0) {
+		error("Failed to lookup root tree: %s\n", giterr_last()->message);
+		goto out;
 	}
 
-	/* Pass all other options to fuse_main */
-	return 1;
+	/* Find all nodes and blobs */
+	if (!(n = calloc(1, sizeof(*n))) || !(e.dirs = malloc(16 * sizeof(*e.dirs))) ||
+	    gitfs_erofs_add(&e, NULL, n) < 0) {
+		free(n);
+		error("Failed to allocate memory for export\n");
+		goto out;
+	}
+	n->mode = 040755;
+	n->nlink = 2;
+	e.dirs[0] = n;
+	e.dir_capacity = 16;
+	if (git_tree_walk(tree, GIT_TREEWALK_PRE, gitfs_erofs_walk, &e) != 0) {
+		if (!e.retval)
+			error("Failed to walk tree\n");
+		goto out;
+	}
+	debug("Exporting %zu files and directories, %zu distinct blobs\n", e.count, e.blobs.count);
+
+	/* Place the inodes in walk order (so the root comes first, as
+	 * its nid must fit in 16 bits), which needs the size of the
+	 * directories (but not their contents yet) */
+	for (i = 0; i < e.count; i++) {
+		n = e.nodes[i];
+		if (S_ISDIR(n->mode)) {
+			qsort(n->entries, n->count, sizeof(*n->entries), gitfs_erofs_node_cmp);
+			if (gitfs_erofs_dir(n, NULL) < 0)
+				goto out;
+		}
+		n->inline_tail = gitfs_erofs_inline(n->size);
+		tail = n->inline_tail ? n->size % GITFS_EROFS_BLOCK : 0;
+		/* An inode and its tail can't cross a block boundary */
+		if (pos % GITFS_EROFS_BLOCK + gitfs_erofs_inode_size(n) + tail > GITFS_EROFS_BLOCK)
+			pos = GITFS_EROFS_BLOCKS(pos) << GITFS_EROFS_BLOCK_BITS;
+		n->nid = pos / GITFS_EROFS_SLOT;
+		pos += gitfs_erofs_inode_size(n) + tail;
+		pos = (pos + GITFS_EROFS_SLOT - 1) / GITFS_EROFS_SLOT * GITFS_EROFS_SLOT;
+	}
+
+	/* Then the data: directories first (needed for any lookup),
+	 * then each distinct blob once */
+	blocks = GITFS_EROFS_BLOCKS(pos);
+	for (i = 0; i < e.count; i++) {
+		n = e.nodes[i];
+		if (S_ISDIR(n->mode)) {
+			n->blkaddr = blocks;
+			blocks += gitfs_erofs_data_blocks(n->size);
+		}
+	}
+	if (!(blobs = malloc((e.blobs.count + 1) * sizeof(*blobs)))) {
+		error("Failed to allocate memory for export\n");
+		goto out;
+	}
+	for (i = 0, j = 0; i < e.blobs.bucket_count; i++) {
+		for (b = e.blobs.buckets[i]; b; b = b->next)
+			blobs[j++] = b;
+	}
+	qsort(blobs, e.blobs.count, sizeof(*blobs), gitfs_erofs_blob_cmp);
+	for (i = 0; i < e.blobs.count; i++) {
+		blobs[i]->blkaddr = blocks;
+		for (n = blobs[i]->nodes; n; n = n->next)
+			n->blkaddr = blocks;
+		blocks += gitfs_erofs_data_blocks(blobs[i]->size);
+	}
+	if (blocks > UINT32_MAX) {
+		error("Tree too large for an EROFS image\n");
+		goto out;
+	}
+
+	if ((e.fd = open(d->export_erofs, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		error("%s: Failed to create image: %s\n", d->export_erofs, strerror(errno));
+		goto out;
+	}
+	/* Anything not written is zero */
+	if (ftruncate(e.fd, blocks << GITFS_EROFS_BLOCK_BITS) < 0) {
+		error("Failed to write image: %s\n", strerror(errno));
+		goto out;
+	}
+
+	gitfs_put_le32(super, GITFS_EROFS_MAGIC);
+	super[12] = GITFS_EROFS_BLOCK_BITS;
+	gitfs_put_le16(super + 14, e.nodes[0]->nid);
+	gitfs_put_le64(super + 16, e.count);
+	gitfs_put_le64(super + 24, d->commit_time);
+	gitfs_put_le32(super + 36, blocks);
+	/* The same tree always gives the same image */
+	memcpy(super + 48, d->tree_oid.id, 16);
+	if (gitfs_erofs_write(&e, super, sizeof(super), GITFS_EROFS_SUPER_OFFSET) < 0)
+		goto out;
+
+	for (i = 0; i < e.count; i++) {
+		n = e.nodes[i];
+		if (!S_ISDIR(n->mode))
+			continue;
+		size = GITFS_EROFS_BLOCKS(n->size) << GITFS_EROFS_BLOCK_BITS;
+		if (!(data = calloc(1, size))) {
+			error("Failed to allocate memory for export\n");
+			goto out;
+		}
+		if (gitfs_erofs_dir(n, data) < 0 || gitfs_erofs_write_blocks(&e, data, n->size, n->blkaddr) < 0 ||
+		    gitfs_erofs_write_inode(&e, n, data) < 0) {
+			free(data);
+			goto out;
+		}
+		free(data);
+	}
+
+	/* Read past the blob cache, everything is read once anyway */
+	for (i = 0; i < e.blobs.count; i++) {
+		b = blobs[i];
+		if (git_odb_read(&obj, e.o->odb, &b->oid) < 0) {
+			error("Blob not found?!: %s\n", giterr_last()->message);
+			goto out;
+		}
+		data = (unsigned char *)git_odb_object_data(obj);
+		if (git_odb_object_size(obj) != b->size) {
+			error("Blob changed size?!\n");
+			git_odb_object_free(obj);
+			goto out;
+		}
+		if (gitfs_erofs_write_blocks(&e, data, b->size, b->blkaddr) < 0) {
+			git_odb_object_free(obj);
+			goto out;
+		}
+		for (n = b->nodes; n; n = n->next) {
+			if (gitfs_erofs_write_inode(&e, n, data) < 0) {
+				git_odb_object_free(obj);
+				goto out;
+			}
+		}
+		git_odb_object_free(obj);
+	}
+
+	if (fsync(e.fd) < 0) {
+		error("Failed to write image: %s\n", strerror(errno));
+		goto out;
+	}
+	debug("Wrote %llu blocks\n", (unsigned long long)blocks);
+	retval = 0;
+
+out:
+	if (e.fd >= 0 && close(e.fd) < 0 && retval == 0) {
+		error("Failed to write image: %s\n", strerror(errno));
+		retval = -1;
+	}
+	if (e.fd >= 0 && retval < 0)
+		unlink(d->export_erofs);
+	free(blobs);
+	gitfs_erofs_free(&e);
+	if (tree)
+		git_tree_free(tree);
+	if (e.o)
+		gitfs_odb_put(e.o);
+	if (d->repo)
+		gitfs_repo_close(d->repo);
+	return retval;
 }
 
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct stat st;
-	char sha[41];
 
 	// When runing form initrd, mark ourselves as a storage daemon
 	// that runs from initrd for systemd. This prevents
@@ -657,15 +8995,45 @@ int main(int argc, char *argv[])
 		return error("Failed to allocate memory for userdata\n"), 1;
 	}
 
+	gitfs_set_cache_size(GITFS_DEFAULT_CACHE_SIZE);
+
 	if (fuse_opt_parse(&args, d, gitfs_opts, gitfs_opt_proc))
 		return 1;
 
+	if (d->daemon_socket) {
+		if (d->repo_path)
+			return error("No repository or mountpoint allowed in daemon mode\n"), 1;
+
+		int retval = gitfs_daemon(d->daemon_socket);
+		gitfs_data_free(d);
+		fuse_opt_free_args(&args);
+		git_threads_shutdown();
+		return retval;
+	}
+
 	if (d->repo_path == NULL)
 		return error("No repository path given\n\n"), usage(&args, stderr), 1;
 
-	if (stat(d->repo_path, &st) < 0 || !S_ISDIR(st.st_mode))
+	if (stat(d->repo_path, &st) < 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
 		return error("%s: path does not exist?\n", d->repo_path), 1;
 
+	/* Anything but a directory is mounted as a single pack */
+	d->pack = S_ISREG(st.st_mode);
+	if (d->pack && !d->rev)
+		return error("A pack has no HEAD, pass the oid to mount with --rev\n"), 1;
+
+	/* Nothing is mounted when exporting */
+	if (d->export_erofs) {
+		int retval = gitfs_export_erofs(d) < 0;
+		gitfs_data_free(d);
+		fuse_opt_free_args(&args);
+		git_threads_shutdown();
+		return retval;
+	}
+
+	if (gitfs_resolve_chroot(d) < 0)
+		return 1;
+
 	/* We open the repo now and resolve the arguments given, so we
 	 * can bail out and provide an error message when anything is
 	 * wrong. We'll have to re-open the repository later in
@@ -674,141 +9042,68 @@ int main(int argc, char *argv[])
 	 * already detached from the terminal, so it's too late to
 	 * provide useful error messages). */
 	debug("opening repo before fuse_main\n");
-	git_repository *repo;
-	if (git_repository_open(&repo, d->repo_path) < 0)
-		return error("Cannot open git repository: %s\n", giterr_last()->message), 1;
-
-	/* Default to HEAD */
-	const char *rev = "HEAD";
-	if (d->rev)
-		rev = d->rev;
-	debug("using rev %s\n", rev);
-
-	git_object *obj;
-	if (git_revparse_single(&obj, repo, rev) < 0)
-		return error("Failed to resolve rev: %s\n", rev), 1;
-
-	git_tree *tree;
-	git_commit *commit;
-	switch (git_object_type(obj)) {
-		case GIT_OBJ_COMMIT:
-			commit = (git_commit*)obj;
-			git_oid_fmt(sha, git_commit_id(commit));
-			sha[GIT_OID_HEXSZ] = '\0';
-			debug("using commit %s\n", sha);
-
-			/* rev points to a commit, lookup corresponding
-			 * tree */
-			if (git_commit_tree(&tree, commit) < 0) {
-				return error("Failed to lookup tree for rev: %s\n", rev), 1;
-			}
-			d->commit_time = git_commit_time(commit);
-
-			/* Export the commit id through a magic file */
-			if (gitfs_init_oid_entry(d, "/.git-fs-commit-id", git_commit_id(commit)) < 0)
-				return 1;
-			git_object_free(obj);
-			break;
-		case GIT_OBJ_TREE:
-			/* rev points to a tree, just use it */
-			tree = (git_tree*)obj;
+	int resolved;
+	if (d->pack) {
+		/* Opening a pack doesn't start any threads (which
+		 * wouldn't survive daemonizing) */
+		struct gitfs_repo *r = gitfs_repo_open(d->repo_path, NULL, NULL);
+		if (!r)
+			return 1;
+		struct gitfs_odb *o = gitfs_odb_get(r);
+		resolved = gitfs_resolve_rev(d, o->repo);
+		gitfs_odb_put(o);
+		gitfs_repo_close(r);
+	} else {
+		git_repository *repo;
+		if (git_repository_open(&repo, d->repo_path) < 0)
+			return error("Cannot open git repository: %s\n", giterr_last()->message), 1;
 
-			git_oid_fmt(sha, git_tree_id(tree));
-			sha[GIT_OID_HEXSZ] = '\0';
-			debug("using commit %s\n", sha);
+		resolved = gitfs_resolve_rev(d, repo);
 
-			/* Trees don't store any time information, so
-			 * just use the current time (better than using
-			 * 0, which can confuse programs such as tar).
-			 * */
-			d->commit_time = time(NULL);
-			break;
-		default:
-			return error("rev does not point to a tree or commit: %s\n", rev), 1;
+		/* Unallocate this stuff, since it's useless after
+		 * chrooting */
+		git_repository_free(repo);
 	}
-
-	git_oid_fmt(sha, git_tree_id(tree));
-	sha[GIT_OID_HEXSZ] = '\0';
-	debug("using tree %s\n", sha);
-
-	/* Save the oid we found, for gitfs_init to open after chrooting */
-	git_oid_cpy(&d->tree_oid, git_tree_id(tree));
-
-	/* Export the tree id through a magic file */
-	if (gitfs_init_oid_entry(d, "/.git-fs-tree-id", &d->tree_oid) < 0)
+	if (resolved < 0)
 		return 1;
 
-
-	/* Unallocate this stuff, since it's useless after chrooting */
-	git_tree_free(tree);
-	git_repository_free(repo);
-
-	char *opts = NULL; /* fuse_opt_add_opt will allocate this */
-
-	/* Force the mount to be read-only */
-	fuse_opt_add_opt(&opts, "ro");
-
-	/* Set a meaningful fsname (e.g., to let mount show
-	 * "foo.git mounted on /somewhere"). */
-	char fsname_opt[PATH_MAX + 8];
-	snprintf(fsname_opt, lengthof(fsname_opt), "fsname=%s", d->repo_path);
-	fuse_opt_add_opt_escaped(&opts, fsname_opt);
-
-	/* Make the filsystem type "fuse.git-fs" (this is the default if
-	 * fsname is not specified). */
-	fuse_opt_add_opt(&opts, "subtype=git-fs");
-
-	/* Since we are a read-only filesystem and our contents cannot
-	 * be externally modified (note that even if the git repository
-	 * changes, the specific tree object we've locked onto can never
-	 * change!), enable some aggresive caching to greatly improve
-	 * performance. */
-
-	/* This enables the usual kernel caching methods for file
-	 * contents. The kernel normally takes care of updating any
-	 * cache entries when they are written to (so this only works
-	 * when the filesystem is only written to through fuse). */
-	fuse_opt_add_opt(&opts, "kernel_cache");
-
-	/* These enable more aggresive caching of file existence and
-	 * attributes (the default is 1 second, but since our contents
-	 * never change, we raise this to 600 seconds). */
-	fuse_opt_add_opt(&opts, "entry_timeout=600");
-	fuse_opt_add_opt(&opts, "negative_timeout=600");
-	fuse_opt_add_opt(&opts, "attr_timeout=600");
-
-	/* Tell the kernel to go ahead and check permissions based on
-	 * the mode we return in getattr (by default, we're supposed to
-	 * check permissions in open, getattr, etc. but we don't want
-	 * that). There's probably not much permissions to check, but
-	 * let's set this anyway. */
-	fuse_opt_add_opt(&opts, "default_permissions");
-
-	/* Append the options collected in opts */
-	fuse_opt_insert_arg(&args, 1, "-o");
-	fuse_opt_insert_arg(&args, 2, opts);
-
-	free(opts);
-	opts = NULL;
+	gitfs_add_mount_opts(d, &args);
 
 	/* fuse_main will redirect stderr to /dev/null, so keep a reference
 	 * around in case we need to print a segfault trace */
 	error_fd = dup(error_fd);
 
 	/* Pass d as user_data, which will be made available through the
-	 * context in gitfs_init. */
-	fuse_main(args.argc, args.argv, &gitfs_oper, d);
+	 * context in gitfs_init. This mounts and daemonizes like
+	 * fuse_main does, but we run our own loop below. */
+	char *mountpoint;
+	int multithreaded;
+	struct fuse *fuse = fuse_setup(args.argc, args.argv, &gitfs_oper,
+				       sizeof(gitfs_oper), &mountpoint,
+				       &multithreaded, d);
+	if (fuse) {
+		if (!multithreaded)
+			d->threads = 1;
+		else if (!d->threads)
+			d->threads = gitfs_cpu_count();
+
+		if (gitfs_loop(fuse, d) < 0)
+			d->retval = 1;
+		fuse_teardown(fuse, mountpoint);
+	} else {
+		d->retval = 1;
+	}
 
 	fuse_opt_free_args(&args);
 
-	free(d->repo_path);
-	free(d->rev);
-	free(d);
+	/* Allow git_init to change our exit code */
+	int retval = d->retval;
+
+	gitfs_data_free(d);
 
 	/* Clean up thread storage in libgit2 */
 	git_threads_shutdown();
 
-	/* Allow git_init to change our exit code */
-	return d->retval;
+	return retval;
 }
 